@@ -0,0 +1,454 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * abootimg-bench - time abootimg on synthetic boot images
+ *
+ * Images are generated for a range of page sizes and section sizes, then
+ * each command is run with every --io engine which applies to it. The
+ * best wall time of the runs is reported with the throughput it gives,
+ * and the peak RSS of the runs above the one of abootimg -h, one tab
+ * separated line per measure.
+ * Page caches of the files involved are dropped before each run, unless
+ * --warm is given.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+
+#define MB  (1024*1024)
+
+enum engine {
+  engine_auto,
+  engine_buffered,
+  engine_mmap,
+  engine_copy,
+  engine_direct,
+  nb_engines
+};
+
+static const char* engine_names[nb_engines] = { "auto", "buffered", "mmap", "copy", "direct" };
+
+#define ALL_ENGINES   ((1 << nb_engines) - 1)
+#define READ_ENGINES  ((1 << engine_auto) | (1 << engine_buffered))
+#define COPY_ENGINES  (ALL_ENGINES & ~(1 << engine_direct))
+
+enum op {
+  op_info,
+  op_extract,
+  op_update_kernel,
+  op_update_cmdline,
+  op_create,
+  nb_ops
+};
+
+static const struct {
+  const char* name;
+  unsigned    engines;
+} ops[nb_ops] = {
+  { "info",           READ_ENGINES },
+  { "extract",        COPY_ENGINES },
+  { "update-kernel",  ALL_ENGINES },
+  { "update-cmdline", ALL_ENGINES },
+  { "create",         ALL_ENGINES },
+};
+
+static const unsigned full_page_sizes[] = { 2048, 4096, 16384 };
+static const unsigned full_sizes[] = { 1, 16, 64 };    /* MB, kernel and ramdisk */
+static const unsigned quick_page_sizes[] = { 2048 };
+static const unsigned quick_sizes[] = { 1, 16 };
+
+#define SECOND_SIZE  (MB / 2)
+
+typedef struct
+{
+  char*        abootimg;
+  char*        dir;
+  int          runs;
+  int          warm;
+  int          keep;
+  long         base_rss;    /* kB, of a run doing nothing */
+} t_bench;
+
+
+
+static void die(const char* fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "abootimg-bench: ");
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+
+
+static char* path(t_bench* b, const char* name)
+{
+  static char buf[PATH_MAX];
+  snprintf(buf, sizeof(buf), "%s/%s", b->dir, name);
+  return buf;
+}
+
+
+
+/* pseudo random content, which neither compresses nor deduplicates */
+static void write_random(t_bench* b, const char* name, unsigned long long size, uint64_t seed)
+{
+  uint64_t* buf = malloc(MB);
+  uint64_t x = seed * 0x9e3779b97f4a7c15ULL + 1;
+  unsigned i;
+
+  if (!buf)
+    die("%s", strerror(errno));
+  int fd = open(path(b, name), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd == -1)
+    die("%s: %s", path(b, name), strerror(errno));
+
+  while (size) {
+    size_t len = size < MB ? size : MB;
+    for (i=0; i<MB/sizeof(buf[0]); i++) {
+      x ^= x >> 12;
+      x ^= x << 25;
+      x ^= x >> 27;
+      buf[i] = x * 0x2545f4914f6cdd1dULL;
+    }
+    if (write(fd, buf, len) != (ssize_t)len)
+      die("%s: %s", path(b, name), strerror(errno));
+    size -= len;
+  }
+  close(fd);
+  free(buf);
+}
+
+
+
+static void copy_file(t_bench* b, const char* from, const char* to)
+{
+  char* buf = malloc(MB);
+  char src[PATH_MAX];
+  ssize_t rb;
+
+  if (!buf)
+    die("%s", strerror(errno));
+
+  snprintf(src, sizeof(src), "%s", path(b, from));
+  int in = open(src, O_RDONLY);
+  int out = open(path(b, to), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if ((in == -1) || (out == -1))
+    die("%s: %s", to, strerror(errno));
+  while ((rb = read(in, buf, MB)) > 0)
+    if (write(out, buf, rb) != rb)
+      die("%s: %s", to, strerror(errno));
+  if (rb < 0)
+    die("%s: %s", from, strerror(errno));
+  close(in);
+  close(out);
+  free(buf);
+}
+
+
+
+/* write back and evict the pages of a file, for a cold cache run */
+static void drop_cache(t_bench* b, const char* name)
+{
+  int fd = open(path(b, name), O_RDONLY);
+  if (fd == -1)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+
+
+/*
+ * Run abootimg in the bench directory with args, its output discarded.
+ * Returns its wall time in seconds, and its peak RSS in kB.
+ *
+ * The peak RSS of the child covers its life before exec too, when it was
+ * a copy of the bench: the buffers of the bench are freed between runs
+ * to keep that small, and base_rss tells what it amounts to.
+ */
+static double run_abootimg(t_bench* b, char** args, long* maxrss)
+{
+  struct timespec start, end;
+  struct rusage ru;
+  int status;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid_t pid = fork();
+  if (pid == -1)
+    die("fork: %s", strerror(errno));
+  if (!pid) {
+    int null = open("/dev/null", O_WRONLY);
+    if ((null == -1) || (dup2(null, STDOUT_FILENO) == -1) || chdir(b->dir))
+      _exit(127);
+    execv(b->abootimg, args);
+    _exit(127);
+  }
+
+  if (wait4(pid, &status, 0, &ru) == -1)
+    die("wait4: %s", strerror(errno));
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "abootimg-bench: failed:");
+    for (; *args; args++)
+      fprintf(stderr, " %s", *args);
+    fprintf(stderr, "\n");
+    exit(1);
+  }
+
+  *maxrss = ru.ru_maxrss;
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+
+
+static void bench_op(t_bench* b, enum op op, enum engine engine, unsigned page_size,
+                     unsigned long long size, unsigned long long second_size)
+{
+  char* args[32];
+  int n = 0;
+  int i;
+
+  // what the command actually moves, for the throughput
+  unsigned long long bytes = 0;
+  if ((op == op_extract) || (op == op_create))
+    bytes = 2 * size + second_size;
+  else if (op == op_update_kernel)
+    bytes = size;
+
+  args[n++] = "abootimg";
+  switch (op) {
+    case op_info:
+      args[n++] = "-i";
+      args[n++] = "base.img";
+      break;
+    case op_extract:
+      args[n++] = "-x";
+      args[n++] = "base.img";
+      args[n++] = "x.cfg";
+      args[n++] = "x.kernel";
+      args[n++] = "x.ramdisk";
+      args[n++] = "x.second";
+      break;
+    case op_update_kernel:
+      args[n++] = "-u";
+      args[n++] = "work.img";
+      args[n++] = "-k";
+      args[n++] = "kernel2";
+      break;
+    case op_update_cmdline:
+      args[n++] = "-u";
+      args[n++] = "work.img";
+      args[n++] = "-c";
+      args[n++] = "cmdline=console=ttyS0 bench";
+      break;
+    case op_create:
+      args[n++] = "--create";
+      args[n++] = "new.img";
+      args[n++] = "-f";
+      args[n++] = "base.cfg";
+      args[n++] = "-k";
+      args[n++] = "kernel";
+      args[n++] = "-r";
+      args[n++] = "ramdisk";
+      if (second_size) {
+        args[n++] = "-s";
+        args[n++] = "second";
+      }
+      break;
+    default:
+      break;
+  }
+  args[n++] = "--io";
+  args[n++] = (char*)engine_names[engine];
+  args[n] = NULL;
+
+  double best = 0;
+  long peak = 0;
+  for (i=0; i<b->runs; i++) {
+    long maxrss;
+    if ((op == op_update_kernel) || (op == op_update_cmdline))
+      copy_file(b, "base.img", "work.img");
+    if (op == op_create)
+      unlink(path(b, "new.img"));
+    if (!b->warm) {
+      const char* files[] = { "base.img", "work.img", "kernel", "kernel2", "ramdisk", "second" };
+      unsigned j;
+      for (j=0; j<sizeof(files)/sizeof(files[0]); j++)
+        drop_cache(b, files[j]);
+    }
+    double t = run_abootimg(b, args, &maxrss);
+    if (!i || (t < best))
+      best = t;
+    if (maxrss > peak)
+      peak = maxrss;
+  }
+
+  printf("%u\t%llu\t%llu\t%llu\t%s\t%s\t%.2f\t", page_size, size, size, second_size,
+         ops[op].name, engine_names[engine], best * 1000);
+  if (bytes)
+    printf("%.1f", bytes / best / MB);
+  else
+    printf("-");
+  printf("\t%ld\n", peak > b->base_rss ? peak - b->base_rss : 0);
+  fflush(stdout);
+}
+
+
+
+static void bench_config(t_bench* b, unsigned page_size, unsigned long long size,
+                         unsigned long long second_size)
+{
+  int op, engine;
+
+  write_random(b, "kernel", size, 1);
+  write_random(b, "kernel2", size, 2);
+  write_random(b, "ramdisk", size, 3);
+  if (second_size)
+    write_random(b, "second", second_size, 4);
+
+  FILE* cfg = fopen(path(b, "base.cfg"), "w");
+  if (!cfg)
+    die("%s: %s", path(b, "base.cfg"), strerror(errno));
+  fprintf(cfg, "pagesize = 0x%x\ncmdline = console=ttyS0\n", page_size);
+  fclose(cfg);
+
+  char* args[] = { "abootimg", "--create", "base.img", "-f", "base.cfg", "-k", "kernel",
+                   "-r", "ramdisk", second_size ? "-s" : NULL, "second", NULL };
+  long maxrss;
+  run_abootimg(b, args, &maxrss);
+
+  for (op=0; op<nb_ops; op++)
+    for (engine=0; engine<nb_engines; engine++)
+      if (ops[op].engines & (1 << engine))
+        bench_op(b, op, engine, page_size, size, second_size);
+}
+
+
+
+static void cleanup(t_bench* b)
+{
+  const char* files[] = { "kernel", "kernel2", "ramdisk", "second", "base.cfg", "base.img",
+                          "work.img", "new.img", "x.cfg", "x.kernel", "x.ramdisk", "x.second" };
+  unsigned i;
+
+  for (i=0; i<sizeof(files)/sizeof(files[0]); i++)
+    unlink(path(b, files[i]));
+  rmdir(b->dir);
+}
+
+
+
+static void usage(void)
+{
+  fprintf(stderr,
+    "usage: abootimg-bench [--abootimg <path>] [--dir <dir>] [--runs <n>] [--quick] [--warm] [--keep]\n"
+    "\n"
+    "  --abootimg  abootimg binary to time (default ./abootimg)\n"
+    "  --dir       where to generate the images, to bench a given storage\n"
+    "              (default a new directory in the current one)\n"
+    "  --runs      runs per measure, the best one is kept (default 3)\n"
+    "  --quick     2048 byte pages and 1 and 16 MB sections only\n"
+    "  --warm      keep the page cache between runs\n"
+    "  --keep      leave the generated files\n");
+  exit(1);
+}
+
+
+
+int main(int argc, char** argv)
+{
+  t_bench b;
+  char* abootimg = "./abootimg";
+  char* dir = NULL;
+  int quick = 0;
+  int i, j, k;
+
+  memset(&b, 0, sizeof(b));
+  b.runs = 3;
+
+  for (i=1; i<argc; i++) {
+    if (!strcmp(argv[i], "--abootimg") && (i+1 < argc))
+      abootimg = argv[++i];
+    else if (!strcmp(argv[i], "--dir") && (i+1 < argc))
+      dir = argv[++i];
+    else if (!strcmp(argv[i], "--runs") && (i+1 < argc)) {
+      b.runs = atoi(argv[++i]);
+      if (b.runs <= 0)
+        usage();
+    }
+    else if (!strcmp(argv[i], "--quick"))
+      quick = 1;
+    else if (!strcmp(argv[i], "--warm"))
+      b.warm = 1;
+    else if (!strcmp(argv[i], "--keep"))
+      b.keep = 1;
+    else
+      usage();
+  }
+
+  // the commands run in the bench directory
+  if (!(b.abootimg = realpath(abootimg, NULL)))
+    die("%s: %s", abootimg, strerror(errno));
+
+  char tmpl[PATH_MAX];
+  snprintf(tmpl, sizeof(tmpl), "%s/abootimg-bench.XXXXXX", dir ? dir : ".");
+  if (!(b.dir = mkdtemp(tmpl)))
+    die("%s: %s", tmpl, strerror(errno));
+
+  const unsigned* page_sizes = quick ? quick_page_sizes : full_page_sizes;
+  int nb_page_sizes = quick ? sizeof(quick_page_sizes) / sizeof(unsigned) : sizeof(full_page_sizes) / sizeof(unsigned);
+  const unsigned* sizes = quick ? quick_sizes : full_sizes;
+  int nb_sizes = quick ? sizeof(quick_sizes) / sizeof(unsigned) : sizeof(full_sizes) / sizeof(unsigned);
+
+  // what a run costs whatever it does, taken out of the peak RSS measured
+  char* base_args[] = { "abootimg", "-h", NULL };
+  run_abootimg(&b, base_args, &b.base_rss);
+
+  printf("page_size\tkernel\tramdisk\tsecond\top\tengine\tms\tMB/s\tmaxrss_delta_kB\n");
+  for (i=0; i<nb_page_sizes; i++)
+    for (j=0; j<nb_sizes; j++)
+      for (k=0; k<2; k++)
+        bench_config(&b, page_sizes[i], (unsigned long long)sizes[j] * MB, k ? SECOND_SIZE : 0);
+
+  if (b.keep)
+    fprintf(stderr, "files left in %s\n", b.dir);
+  else
+    cleanup(&b);
+  free(b.abootimg);
+  return 0;
+}
@@ -16,19 +16,29 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#define _GNU_SOURCE /* copy_file_range */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <time.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 
 #ifdef __linux__
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <linux/fs.h> /* BLKGETSIZE64 */
 #endif
 
@@ -53,6 +63,20 @@
 
 #include "version.h"
 #include "bootimg.h"
+#include "sparse_format.h"
+#include "abootimg.h"
+#include "libabootimg.h"
+#include "compress.h"
+#include "ramdisk.h"
+#include "info.h"
+#include "index.h"
+#include "sha1.h"
+#include "scan.h"
+#include "diff.h"
+#include "delta.h"
+#include "stats.h"
+#include "find.h"
+#include "remote.h"
 
 
 enum command {
@@ -61,38 +85,244 @@ enum command {
   info,
   extract,
   update,
-  create
+  create,
+  batch,
+  scan,
+  verify,
+  diff,
+  make_patch,
+  apply_patch,
+  find,
+  serve
 };
 
 
+#define MAX_CONF_LEN    4096
+
+
+/* how the sections are moved around, --io */
+enum io_engine {
+  io_auto,        /* reflink, kernel side copies, then mapped or buffered writes */
+  io_buffered,    /* read() and write() through the copy buffer, no map */
+  io_mmap,        /* writes from maps of the inputs */
+  io_copy,        /* copy_file_range(), then sendfile() */
+  io_direct       /* O_DIRECT writes of the image, the rest as io_auto */
+};
+
+static const char* io_engine_names[] = { "auto", "buffered", "mmap", "copy", "direct" };
+
+
+/* how the sections are named on the command line, and by the messages */
+typedef struct
+{
+  char*        option;      /* of -u and --create, and of -x for the long ones */
+  char*        fname;       /* extracted by -x to */
+  char*        description;
+} t_section_file;
+
+static const t_section_file section_files[bootimg_nb_sections] = {
+  { "-k",              "zImage",             "kernel" },
+  { "-r",              "initrd.img",         "ramdisk" },
+  { "-s",              "stage2.img",         "second stage" },
+  { "--recovery-dtbo", "recovery_dtbo.img",  "recovery dtbo" },
+  { "--dtb",           "dtb.img",            "dtb" },
+  { "--signature",     "boot_signature.img", "boot signature" },
+};
+
+
+/*
+ * A section copied on a thread of its own, concurrently with the others:
+ * they are at independent offsets, and each transfer is mostly waiting
+ * for the storage. Errors are kept for the thread which waits for it.
+ */
+typedef struct
+{
+  int          in_fd;
+  off_t        in_offset;
+  const char*  in_map;
+  char*        in_fname;
+  int          out_fd;
+  off_t        out_offset;
+  char*        out_fname;
+  size_t       size;
+  int          close_out;   /* out_fd belongs to the copy */
+  enum io_engine engine;
+  t_stats*     stats;
+  int          section;     /* of the stats */
+
+  char*        buf;
+  size_t       buf_size;
+  FILE*        out;
+  pthread_t    thread;
+  int          running;
+  char         error[512];
+} t_section_copy;
+
+
 typedef struct
 {
-  unsigned     size;
+  unsigned long long size;
+  unsigned long long offset; /* of the image in its file, --offset */
   int          is_blkdev;
+  int          is_new;
+  int          sparse;
+  int          compare;
+
+  int          direct;
+  int          direct_sync; /* synced once written, even when O_DIRECT was refused */
+
+  int          direct_fd;
+  char*        compare_buf;
+  unsigned     blocks_written;
+  unsigned     blocks_skipped;
+  off_t        compare_page; /* last page counted, its end may come next */
+  int          compare_page_same;
+
+  int          direct_wfd;
+  unsigned     direct_align;
+  char*        stage_buf;
+  size_t       stage_size;
+  off_t        stage_offset;
+  size_t       stage_head;
+  size_t       stage_len;
+  unsigned long long bytes_written;
+  unsigned long long bytes_total;
+  struct timespec    write_start;
 
   char*        fname;
   char*        config_fname;
-  char*        kernel_fname;
-  char*        ramdisk_fname;
-  char*        second_fname;
+  char*        section_fnames[bootimg_nb_sections]; /* inputs, or outputs of -x */
+  char*        pack_dir;
+  char*        pack_cache;
+  enum codec   ramdisk_codec;
+  t_ramdisk_edit* ramdisk_edits;
+  int          nb_ramdisk_edits;
+  char*        unpack_dir;
+
+  char         config_args[MAX_CONF_LEN];
+
+  char*        batch_fname;
+  char*        scan_path;
+  char*        socket_fname; /* --serve */
+  int          jobs;        /* threads of --batch, --scan and --serve */
+  t_info_output info;       /* --format and --fields of -i and --scan */
+  char*        index_fname;
+  t_index      index;
+  int          index_opened;
+  t_index*     shared_index; /* of --serve, for the jobs which give no --index */
+  char*        diff_fname;  /* the image compared to fname, or made from it by a patch */
+  int          differs;
+  char*        delta_fname; /* patch of --make-delta and --apply-delta */
+  int          keep_id;     /* the id of the header comes with the patch */
 
   FILE*        stream;
+  t_remote*    remote;      /* in place of stream, for http://, https:// and s3:// images */
+  char*        map;
+  size_t       map_size;
+
+  size_t       buffer_size;
+  int          buffer_size_set;
+  char*        buffer;
+  enum io_engine io;
+  t_stats*     stats;       /* --stats */
 
   boot_img_hdr header;
+  boot_img_hdr orig_header;
+
+  int          section_fds[bootimg_nb_sections];
+  int          section_streamed[bootimg_nb_sections];
+
+  t_sha1*      id_hash;     /* the id, while write_bootimg() writes the sections */
 
-  char*        kernel;
-  char*        ramdisk;
-  char*        second;
+  t_section_copy copies[bootimg_nb_sections];
+  int          nb_copies;
+
+#ifdef HAS_ZLIB
+  pthread_t    pack_thread;
+  int          pack_running;
+  int          pack_fd;
+  FILE*        pack_out;
+  char         pack_error[512];
+#endif
 } t_abootimg;
 
+#define COPY_BUFFER_SIZE    (1024*1024)
+#define DIRECT_BUFFER_SIZE  (4*1024*1024)
+
+
+
+/*
+ * A batch job runs on a worker thread: its messages are kept aside, and
+ * an error ends the job only, back to the setjmp() of run_job().
+ */
+#define MAX_JOB_CLEANUPS 4
+
+typedef struct
+{
+  jmp_buf      env;
+  FILE*        out;
+  char         error[512];
+  struct {
+    void (*fn)(void*);
+    void* arg;
+  }            cleanups[MAX_JOB_CLEANUPS];
+  int          nb_cleanups;
+} t_job_context;
+
+static __thread t_job_context* job_context;
+
+// the standard input of --serve is not the one of its clients
+static int serving;
 
-#define MAX_CONF_LEN    4096
-char config_args[MAX_CONF_LEN] = "";
 
 
+void job_cleanup_push(void (*fn)(void*), void* arg)
+{
+  if (!job_context)
+    return;
+  if (job_context->nb_cleanups == MAX_JOB_CLEANUPS)
+    abort_printf("too many pending cleanups\n");
+  job_context->cleanups[job_context->nb_cleanups].fn = fn;
+  job_context->cleanups[job_context->nb_cleanups].arg = arg;
+  job_context->nb_cleanups++;
+}
+
+void job_cleanup_pop(void* arg)
+{
+  int i;
+
+  if (!job_context)
+    return;
+  for (i=job_context->nb_cleanups-1; i>=0; i--)
+    if (job_context->cleanups[i].arg == arg) {
+      job_context->nb_cleanups--;
+      memmove(&job_context->cleanups[i], &job_context->cleanups[i+1],
+              (job_context->nb_cleanups - i) * sizeof(job_context->cleanups[0]));
+      return;
+    }
+}
+
+// the latest resource is released first, before leaving the job
+static void abort_job(void)
+{
+  while (job_context->nb_cleanups) {
+    job_context->nb_cleanups--;
+    job_context->cleanups[job_context->nb_cleanups].fn(job_context->cleanups[job_context->nb_cleanups].arg);
+  }
+  longjmp(job_context->env, 1);
+}
 
 void abort_perror(char* str)
 {
+  if (job_context) {
+    char buf[256];
+    char* msg = strerror_r(errno, buf, sizeof(buf));
+    if (str && *str)
+      snprintf(job_context->error, sizeof(job_context->error), "%s: %s", str, msg);
+    else
+      snprintf(job_context->error, sizeof(job_context->error), "%s", msg);
+    abort_job();
+  }
   perror(str);
   exit(errno);
 }
@@ -101,34 +331,238 @@ void abort_printf(char *fmt, ...)
 {
   va_list args;
   va_start(args, fmt);
+  if (job_context) {
+    vsnprintf(job_context->error, sizeof(job_context->error), fmt, args);
+    va_end(args);
+    size_t len = strlen(job_context->error);
+    while (len && (job_context->error[len-1] == '\n'))
+      job_context->error[--len] = '\0';
+    abort_job();
+  }
   vfprintf(stderr, fmt, args);
   va_end(args);
   fprintf(stderr, "\n");
   exit(1);
 }
 
+FILE* msg_stream(void)
+{
+  return job_context ? job_context->out : stdout;
+}
 
-int blkgetsize(int fd, unsigned long long *pbsize)
+void print_msg(char *fmt, ...)
 {
-# if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
-  return ioctl(fd, DIOCGMEDIASIZE, pbsize);
-# elif defined(__APPLE__)
-  return ioctl(fd, DKIOCGETBLOCKCOUNT, pbsize);
-# elif defined(__NetBSD__)
-  // does a suitable ioctl exist?
-  // return (ioctl(fd, DIOCGDINFO, &label) == -1);
-  return 1;
-# elif defined(__linux__) || defined(__CYGWIN__)
-  return ioctl(fd, BLKGETSIZE64, pbsize);
-# elif defined(__GNU__)
-  // does a suitable ioctl for HURD exist?
-  return 1;
-# else
-  return 1;
-# endif
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(msg_stream(), fmt, args);
+  va_end(args);
+}
+
+
+void write_all(int fd, const void* buf, size_t size, off_t offset, char* fname)
+{
+  const char* p = buf;
+
+  while (size) {
+    ssize_t wb = pwrite(fd, p, size, offset);
+    if (wb < 0) {
+      if (errno == EINTR)
+        continue;
+      abort_perror(fname);
+    }
+    stats_write(wb);
+    p += wb;
+    size -= wb;
+    offset += wb;
+  }
+}
+
 
+/* sequential counterpart of write_all(), for pipes */
+void write_stream(int fd, const void* buf, size_t size, char* fname)
+{
+  const char* p = buf;
+
+  while (size) {
+    ssize_t wb = write(fd, p, size);
+    if (wb < 0) {
+      if (errno == EINTR)
+        continue;
+      abort_perror(fname);
+    }
+    stats_write(wb);
+    p += wb;
+    size -= wb;
+  }
+}
+
+
+void read_all(int fd, void* buf, size_t size, off_t offset, char* fname)
+{
+  char* p = buf;
+
+  while (size) {
+    ssize_t rb = pread(fd, p, size, offset);
+    if (rb < 0) {
+      if (errno == EINTR)
+        continue;
+      abort_perror(fname);
+    }
+    stats_read(rb);
+    if (!rb)
+      abort_printf("%s: unexpected end of file\n", fname);
+    p += rb;
+    size -= rb;
+    offset += rb;
+  }
+}
+
+
+#ifdef FICLONERANGE
+/*
+ * Share the block-aligned part of a copy between two files on a CoW
+ * filesystem (btrfs, XFS with reflink, ...). Returns the number of bytes
+ * cloned, 0 whenever cloning is not possible: the caller copies the rest.
+ */
+size_t clone_range(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t size)
+{
+  struct stat in_st, out_st;
+
+  if (fstat(in_fd, &in_st) || fstat(out_fd, &out_st))
+    return 0;
+  if (!S_ISREG(in_st.st_mode) || !S_ISREG(out_st.st_mode))
+    return 0;
+
+  off_t bsize = in_st.st_blksize > out_st.st_blksize ? in_st.st_blksize : out_st.st_blksize;
+  if ((bsize <= 0) || (in_offset % bsize) || (out_offset % bsize))
+    return 0;
+
+  size_t len = size - (size % bsize);
+  if (!len)
+    return 0;
+
+  struct file_clone_range range = {
+    .src_fd = in_fd,
+    .src_offset = in_offset,
+    .src_length = len,
+    .dest_offset = out_offset,
+  };
+  if (ioctl(out_fd, FICLONERANGE, &range))
+    return 0;
+
+  return len;
+}
+#endif
+
+
+/*
+ * Copy size bytes from in_fd at in_offset to out_fd at out_offset.
+ *
+ * When both ends are block aligned, the blocks are first shared with a
+ * reflink, and only the unaligned tail is actually copied.
+ * The copy itself is delegated to the kernel (copy_file_range, then
+ * sendfile), which avoids bouncing the data through userspace and lets NFS
+ * or overlayfs do it server side. When neither is usable, the data is
+ * written from the in_map view if one is given, or copied through buf.
+ * Either way, at most buf_size bytes are in flight at a time.
+ *
+ * Any other engine than io_auto restricts the copy to its own method,
+ * io_mmap mapping the input itself when no view is given.
+ */
+void copy_range(int in_fd, off_t in_offset, const char* in_map, char* in_fname,
+                int out_fd, off_t out_offset, char* out_fname, size_t size,
+                char* buf, size_t buf_size, enum io_engine engine)
+{
+  if ((engine == io_direct) || (engine == io_auto)) {
+#ifdef FICLONERANGE
+    size_t cloned = clone_range(in_fd, in_offset, out_fd, out_offset, size);
+    if (cloned)
+      stats_copy(cloned);
+    in_offset += cloned;
+    out_offset += cloned;
+    size -= cloned;
+#endif
+    engine = io_auto;
+  }
+
+#ifdef __linux__
+  if ((engine == io_auto) || (engine == io_copy)) {
+    while (size) {
+      ssize_t cb = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, size, 0);
+      if (cb < 0) {
+        if (errno == EINTR)
+          continue;
+        if ((errno == EXDEV) || (errno == EINVAL) || (errno == ENOSYS) ||
+            (errno == EOPNOTSUPP) || (errno == EBADF))
+          break;
+        abort_perror(out_fname);
+      }
+      if (!cb)
+        abort_printf("%s: unexpected end of file\n", in_fname);
+      stats_copy(cb);
+      size -= cb;
+    }
+    if (!size)
+      return;
+
+    // sendfile() writes at the current output position
+    if (lseek(out_fd, out_offset, SEEK_SET) == (off_t)-1)
+      abort_perror(out_fname);
+    stats_seek();
+    while (size) {
+      ssize_t cb = sendfile(out_fd, in_fd, &in_offset, size);
+      if (cb < 0) {
+        if (errno == EINTR)
+          continue;
+        if ((errno == EINVAL) || (errno == ENOSYS))
+          break;
+        abort_perror(out_fname);
+      }
+      if (!cb)
+        abort_printf("%s: unexpected end of file\n", in_fname);
+      stats_copy(cb);
+      size -= cb;
+      out_offset += cb;
+    }
+    if (!size)
+      return;
+  }
+#endif
+
+  void* map = MAP_FAILED;
+  size_t map_size = in_offset + size;
+  if (engine == io_buffered)
+    in_map = NULL;
+  else if ((engine == io_mmap) && !in_map && size) {
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, in_fd, 0);
+    if (map != MAP_FAILED)
+      in_map = map;
+  }
+
+  while (size) {
+    size_t len = size < buf_size ? size : buf_size;
+    if (in_map) {
+      stats_mapped(len);
+      write_all(out_fd, in_map + in_offset, len, out_offset, out_fname);
+      // drop the pages already written from our resident set
+      off_t align = in_offset % getpagesize();
+      madvise((char*)in_map + in_offset - align, len + align - ((in_offset + len) % getpagesize()), MADV_DONTNEED);
+    }
+    else {
+      read_all(in_fd, buf, len, in_offset, in_fname);
+      write_all(out_fd, buf, len, out_offset, out_fname);
+    }
+    size -= len;
+    in_offset += len;
+    out_offset += len;
+  }
+
+  if (map != MAP_FAILED)
+    munmap(map, map_size);
 }
 
+
+
 void print_usage(void)
 {
   printf (
@@ -140,19 +574,72 @@ void print_usage(void)
  "\n"
  "      print usage\n"
  "\n"
- " abootimg -i <bootimg>\n"
+ " abootimg -i <bootimg> [--format=text|json|csv] [--fields=<field,...>] [--index <file>] [--io <engine>]\n"
+ "             [--offset <offset>]\n"
  "\n"
  "      print boot image information\n"
  "\n"
- " abootimg -x <bootimg> [<bootimg.cfg> [<kernel> [<ramdisk> [<secondstage>]]]]\n"
+ "      --format and --fields (also for --scan) print a record of the chosen fields\n"
+ "      (all by default): tab separated values, a JSON object, or CSV with a header\n"
+ "      row. Fields are file, status, image_size, page_size, name, kernel_size,\n"
+ "      kernel_offset, kernel_addr, ramdisk_size, ramdisk_offset, ramdisk_addr,\n"
+ "      second_size, second_offset, second_addr, tags_addr, cmdline, id,\n"
+ "      header_version, os_version, recovery_dtbo_size, recovery_dtbo_offset,\n"
+ "      dtb_size, dtb_offset, dtb_addr, signature_size, signature_offset, and the\n"
+ "      SHA-1 of the sections, kernel_sha1, ramdisk_sha1, second_sha1,\n"
+ "      recovery_dtbo_sha1, dtb_sha1 and signature_sha1 (only when asked for,\n"
+ "      and by --scan when already in the index). The fields the header version\n"
+ "      of an image does not have are left out.\n"
+ "\n"
+ "      --index (also for --scan) keeps the parsed headers and section hashes in\n"
+ "      file, created if needed, and answers from it while the images do not\n"
+ "      change (same inode, size and modification time).\n"
+ "\n"
+ "      --offset (also for -x) reads the image found at offset in a larger file\n"
+ "      or device, as listed by --find (not with --index).\n"
+ "\n"
+ "      bootimg (also for -x and --verify) can be an http://, https:// or\n"
+ "      s3://bucket/key URL, when built with libcurl: only the header, then the\n"
+ "      sections needed, are fetched with byte range requests (the credentials\n"
+ "      of S3 come from the AWS_* environment variables, see the README).\n"
+ "\n"
+ " abootimg -x <bootimg> [<bootimg.cfg> [<kernel> [<ramdisk> [<secondstage>]]]] [--buffer-size <size>]\n"
+ "             [--recovery-dtbo <file>] [--dtb <file>] [--signature <file>]\n"
+ "             [--unpack-ramdisk <dir>] [--io <engine>] [--stats[=json]] [--offset <offset>]\n"
  "\n"
  "      extract objects from boot image:\n"
  "      - config file (default name bootimg.cfg)\n"
  "      - kernel image (default name zImage)\n"
  "      - ramdisk image (default name initrd.img)\n"
  "      - second stage image (default name stage2.img)\n"
+ "      - recovery dtbo, version 1 and 2 (default name recovery_dtbo.img)\n"
+ "      - dtb, version 2 (default name dtb.img)\n"
+ "      - boot signature, version 4 (default name boot_signature.img)\n"
+ "      empty sections are not extracted.\n"
+ "\n"
+ "      --buffer-size (e.g. 64k, 1M) bounds the memory used to move data around,\n"
+ "      whatever the size of the sections (default 1M, 4M for direct writes).\n"
+ "\n"
+ "      --io (also for -i, -u and --create) selects how data is moved: auto (the\n"
+ "      default: reflinks, copy_file_range or sendfile, then mapped or buffered\n"
+ "      writes), buffered (read and write, nothing mapped), mmap (writes from\n"
+ "      mapped inputs), copy (copy_file_range or sendfile only) or direct (as\n"
+ "      --direct). See abootimg-bench, built by make bench, to compare them.\n"
+ "\n"
+ "      --stats (also for -u, --create and --apply-delta) prints, once done, the\n"
+ "      wall and CPU time, the syscalls and the bytes read and written of each\n"
+ "      phase, the bytes of each section, the zero padding written and the peak\n"
+ "      heap and RSS, as a table, or as one JSON object with --stats=json. CPU\n"
+ "      time, heap and RSS are of the whole process, other jobs of --batch and\n"
+ "      --serve included.\n"
  "\n"
- " abootimg -u <bootimg> [-c \"param=value\"] [-f <bootimg.cfg>] [-k <kernel>] [-r <ramdisk>] [-s <secondstage>]\n"
+ "      with --unpack-ramdisk, the ramdisk is uncompressed and its cpio archive\n"
+ "      extracted in dir (which must not exist), instead of writing the ramdisk image.\n"
+ "\n"
+ " abootimg -u <bootimg> [-c \"param=value\"] [-f <bootimg.cfg>] [-k <kernel>] [-r <ramdisk>] [-s <secondstage>] [--compare] [--direct]\n"
+ "             [--recovery-dtbo <file>] [--dtb <file>] [--signature <file>] [--buffer-size <size>] [--pack-ramdisk <dir> [--ramdisk-cache <cachedir>]]\n"
+ "             [--ramdisk-add <path> <file>] [--ramdisk-replace <path> <file>] [--ramdisk-delete <path>]\n"
+ "             [--ramdisk-codec <codec>] [--io <engine>] [--stats[=json]]\n"
  "\n"
  "      update a current boot image with objects given in command line\n"
  "      - header informations given in arguments (several can be provided)\n"
@@ -160,26 +647,194 @@ void print_usage(void)
  "      - kernel image\n"
  "      - ramdisk image\n"
  "      - second stage image\n"
+ "      - recovery dtbo, dtb and boot signature images, for the header versions\n"
+ "        which have them (set with -c headerversion=N, 0 to 4)\n"
+ "      kernel, ramdisk and second stage can be pipes, or - for stdin.\n"
+ "      with --pack-ramdisk, the ramdisk is built from the content of dir, as a\n"
+ "      cpio archive compressed with gzip on all CPUs, instead of being read with -r\n"
+ "      (packed in a temporary file first by -u, the image being left as it was if\n"
+ "      the pack fails or does not fit).\n"
+ "      with --ramdisk-cache, the files are compressed separately and kept in cachedir,\n"
+ "      to be reused as is by the next packs while they do not change (gzip only).\n"
+ "      --ramdisk-codec (gzip, lz4 or zstd) selects how the packed or edited ramdisk\n"
+ "      is compressed, gzip by default for --pack-ramdisk, the current one for edits.\n"
+ "      --ramdisk-add, --ramdisk-replace and --ramdisk-delete edit single files of the\n"
+ "      current ramdisk in place of -r (several can be given, a deleted directory goes\n"
+ "      with its content).\n"
  "\n"
  "      bootimg has to be valid Android Boot Image, or the update will abort.\n"
  "\n"
- " abootimg --create <bootimg> [-c \"param=value\"] [-f <bootimg.cfg>] -k <kernel> -r <ramdisk> [-s <secondstage>]\n"
+ "      with --compare, each page is read back and only rewritten if it differs\n"
+ "      (useful on flash block devices).\n"
+ "      with --direct, the image is written with large O_DIRECT writes and synced,\n"
+ "      as always done for block devices.\n"
+ "\n"
+ " abootimg --create <bootimg> [-c \"param=value\"] [-f <bootimg.cfg>] -k <kernel> -r <ramdisk> [-s <secondstage>] [--compare] [--direct]\n"
+ "             [--recovery-dtbo <file>] [--dtb <file>] [--signature <file>] [--buffer-size <size>] [--sparse] [--pack-ramdisk <dir> [--ramdisk-cache <cachedir>]]\n"
+ "             [--ramdisk-codec <codec>] [--io <engine>] [--stats[=json]]\n"
  "\n"
  "      create a new image from scratch.\n"
  "      if the boot image file is a block device, sanity check will be performed to avoid overwriting a existing\n"
  "      filesystem.\n"
  "\n"
  "      argurments are the same than for -u.\n"
- "      kernel and ramdisk are mandatory.\n"
+ "      kernel and ramdisk (-r or --pack-ramdisk) are mandatory.\n"
+ "\n"
+ "      with --sparse, the image is written in Android sparse format, ready\n"
+ "      to be flashed with fastboot.\n"
+ "\n"
+ " abootimg --verify <bootimg>\n"
+ "\n"
+ "      check that the id of the header is the SHA-1 of the sections, as written by\n"
+ "      mkbootimg, and by --create and -u when they replace a section (header\n"
+ "      versions 0 to 2, the later ones have no id).\n"
+ "\n"
+ " abootimg --diff <bootimg> <bootimg> [--index <file>]\n"
+ "\n"
+ "      compare two images: the header fields which differ, then for each section\n"
+ "      whether it differs, and the byte ranges which do (offsets in the section,\n"
+ "      ranges less than 32 bytes apart being merged). Nothing is extracted.\n"
+ "      With --index, sections known to have the same hashes are not read, and\n"
+ "      the hashes of the images are added to it. Exits with 1 if they differ.\n"
+ "\n"
+ " abootimg --make-delta <old bootimg> <new bootimg> <patch>\n"
+ " abootimg --apply-delta <bootimg> <patch> [--direct] [--buffer-size <size>] [--stats[=json]]\n"
+ "\n"
+ "      --make-delta writes in patch what turns the old image into the new one:\n"
+ "      the new header, and the changed sections as copies of old bytes (from any\n"
+ "      section, at any offset), differences to them and new data, compressed with\n"
+ "      gzip. --apply-delta updates an image in place with it, after checking that\n"
+ "      it is the old image: the changed sections are rebuilt in temporary files,\n"
+ "      and only the pages which differ are rewritten.\n"
+ "\n"
+ " abootimg --batch <manifest> [--jobs <n>]\n"
+ "\n"
+ "      run the commands (-i, -x, -u, --create, --verify, --diff, --make-delta or\n"
+ "      --apply-delta, with their arguments) listed in manifest (- for stdin), one\n"
+ "      per line, shell quoted or as a JSON array of strings, on n threads (default\n"
+ "      one per CPU). The output of each job is\n"
+ "      printed after a \"== line N\" banner, failures do not stop the others.\n"
+ "\n"
+ " abootimg --serve <socket> [--jobs <n>] [--index <file>]\n"
+ "\n"
+ "      run the commands sent on a Unix socket by any number of clients, one per\n"
+ "      line as in a batch manifest, on n worker threads (default one per CPU),\n"
+ "      until killed. Each command is answered with one line, a JSON object:\n"
+ "      {\"status\": 0, \"output\": \"...\"}, with \"error\" when it failed. The\n"
+ "      workers keep their buffers from one command to the next, and the commands\n"
+ "      which give no --index use the one of --serve.\n"
+ "\n"
+ " abootimg --find <file>\n"
+ "\n"
+ "      look for boot images inside a large file or block device (a flash dump,\n"
+ "      a firmware bundle), at any offset. One line is printed per image whose\n"
+ "      header is valid: offset, size (header and sections), header version, page\n"
+ "      size, kernel, ramdisk and second stage sizes, and name (tab separated).\n"
+ "      Exits with 1 if none is found.\n"
+ "\n"
+ " abootimg --scan <dir|list> [--jobs <n>] [--format=text|json|csv] [--fields=<field,...>]\n"
+ "             [--index <file>]\n"
+ "\n"
+ "      check the header of every image found in dir (recursively), or listed in\n"
+ "      a file (- for stdin), one path per line. One line is printed per image:\n"
+ "      path, then ok, image size, page size, kernel, ramdisk and second stage\n"
+ "      sizes, or the reason why it is not a valid boot image (tab separated).\n"
  "\n"
     );
 }
 
 
+/*
+ * Parse a size given on the command line, with an optional k or M suffix.
+ */
+int parse_size(char* str, size_t* size)
+{
+  char* end;
+  unsigned long long v = strtoull(str, &end, 0);
+
+  if ((*end == 'k') || (*end == 'K')) {
+    v *= 1024;
+    end++;
+  }
+  else if ((*end == 'm') || (*end == 'M')) {
+    v *= 1024*1024;
+    end++;
+  }
+  if ((end == str) || *end)
+    return 1;
+
+  *size = v;
+  return 0;
+}
+
+
+
+int parse_io_engine(t_abootimg* img, char* name)
+{
+  unsigned i;
+
+  for (i=0; i<sizeof(io_engine_names)/sizeof(io_engine_names[0]); i++)
+    if (!strcmp(name, io_engine_names[i])) {
+      img->io = i;
+      // the direct writer is the same as with --direct
+      if (img->io == io_direct)
+        img->direct = 1;
+      return 0;
+    }
+  return 1;
+}
+
+
+
+int parse_offset(t_abootimg* img, char* str)
+{
+  size_t offset;
+
+  if (parse_size(str, &offset))
+    return 1;
+  img->offset = offset;
+  return 0;
+}
+
+
+
+/* --stats, or --stats=<format> */
+int parse_stats(t_abootimg* img, char* arg)
+{
+  if (!img->stats)
+    img->stats = new_stats();
+  return arg[7] ? parse_stats_format(img->stats, arg + 8) : 0;
+}
+
+
+
+int parse_buffer_size(t_abootimg* img, char* str)
+{
+  if (parse_size(str, &img->buffer_size) || (img->buffer_size < 4096))
+    return 1;
+  img->buffer_size_set = 1;
+  return 0;
+}
+
+
+
+/* the section whose file an option of -u, --create or -x gives, -1 if none */
+int parse_section_option(char* arg, enum command cmd)
+{
+  int i;
+
+  for (i=0; i<bootimg_nb_sections; i++)
+    if (!strcmp(arg, section_files[i].option) && ((cmd != extract) || (section_files[i].option[1] == '-')))
+      return i;
+  return -1;
+}
+
+
+
 enum command parse_args(int argc, char** argv, t_abootimg* img)
 {
   enum command cmd = none;
-  int i;
+  int i, s;
 
   if (argc<2)
     return none;
@@ -199,6 +854,30 @@ enum command parse_args(int argc, char** argv, t_abootimg* img)
   else if (!strcmp(argv[1], "--create")) {
     cmd=create;
   }
+  else if (!strcmp(argv[1], "--batch")) {
+    cmd=batch;
+  }
+  else if (!strcmp(argv[1], "--scan")) {
+    cmd=scan;
+  }
+  else if (!strcmp(argv[1], "--verify")) {
+    cmd=verify;
+  }
+  else if (!strcmp(argv[1], "--diff")) {
+    cmd=diff;
+  }
+  else if (!strcmp(argv[1], "--make-delta")) {
+    cmd=make_patch;
+  }
+  else if (!strcmp(argv[1], "--apply-delta")) {
+    cmd=apply_patch;
+  }
+  else if (!strcmp(argv[1], "--find")) {
+    cmd=find;
+  }
+  else if (!strcmp(argv[1], "--serve")) {
+    cmd=serve;
+  }
   else
     return none;
 
@@ -207,107 +886,295 @@ enum command parse_args(int argc, char** argv, t_abootimg* img)
     case help:
 	    break;
 
-    case info:
-      if (argc != 3)
-        return none;
-      img->fname = argv[2];
-      break;
-      
-    case extract:
-      if ((argc < 3) || (argc > 7))
+    case batch:
+      if (argc < 3)
         return none;
-      img->fname = argv[2];
-      if (argc >= 4)
-        img->config_fname = argv[3];
-      if (argc >= 5)
-        img->kernel_fname = argv[4];
-      if (argc >= 6)
-        img->ramdisk_fname = argv[5];
-      if (argc >= 7)
-        img->second_fname = argv[6];
+      img->batch_fname = argv[2];
+      for(i=3; i<argc; i++) {
+        if (!strcmp(argv[i], "--jobs")) {
+          char* end;
+          if (++i >= argc)
+            return none;
+          img->jobs = strtol(argv[i], &end, 0);
+          if ((end == argv[i]) || *end || (img->jobs <= 0))
+            return none;
+        }
+        else
+          return none;
+      }
       break;
 
-    case update:
-    case create:
+    case serve:
       if (argc < 3)
         return none;
-      img->fname = argv[2];
-      img->config_fname = NULL;
-      img->kernel_fname = NULL;
-      img->ramdisk_fname = NULL;
-      img->second_fname = NULL;
+      img->socket_fname = argv[2];
       for(i=3; i<argc; i++) {
-        if (!strcmp(argv[i], "-c")) {
+        if (!strcmp(argv[i], "--jobs")) {
+          char* end;
           if (++i >= argc)
             return none;
-          unsigned len = strlen(argv[i]);
-          if (strlen(config_args)+len+1 >= MAX_CONF_LEN)
-            abort_printf("too many config parameters.\n");
-          strcat(config_args, argv[i]);
-          strcat(config_args, "\n");
+          img->jobs = strtol(argv[i], &end, 0);
+          if ((end == argv[i]) || *end || (img->jobs <= 0))
+            return none;
         }
-        else if (!strcmp(argv[i], "-f")) {
-          if (++i >= argc)
+        else if (!strncmp(argv[i], "--index", 7) && (!argv[i][7] || (argv[i][7] == '='))) {
+          img->index_fname = argv[i][7] ? argv[i] + 8 : (++i < argc) ? argv[i] : NULL;
+          if (!img->index_fname || !img->index_fname[0])
             return none;
-          img->config_fname = argv[i];
         }
-        else if (!strcmp(argv[i], "-k")) {
-          if (++i >= argc)
+        else
+          return none;
+      }
+      break;
+
+    case info:
+    case scan:
+      for(i=2; i<argc; i++) {
+        if (!strncmp(argv[i], "--format", 8) && (!argv[i][8] || (argv[i][8] == '='))) {
+          char* name = argv[i][8] ? argv[i] + 9 : (++i < argc) ? argv[i] : NULL;
+          if (!name || parse_info_format(&img->info, name))
             return none;
-          img->kernel_fname = argv[i];
         }
-        else if (!strcmp(argv[i], "-r")) {
-          if (++i >= argc)
+        else if (!strncmp(argv[i], "--fields", 8) && (!argv[i][8] || (argv[i][8] == '='))) {
+          char* list = argv[i][8] ? argv[i] + 9 : (++i < argc) ? argv[i] : NULL;
+          if (!list || img->info.nb_fields || parse_info_fields(&img->info, list))
             return none;
-          img->ramdisk_fname = argv[i];
         }
-        else if (!strcmp(argv[i], "-s")) {
+        else if (!strncmp(argv[i], "--index", 7) && (!argv[i][7] || (argv[i][7] == '='))) {
+          img->index_fname = argv[i][7] ? argv[i] + 8 : (++i < argc) ? argv[i] : NULL;
+          if (!img->index_fname || !img->index_fname[0])
+            return none;
+        }
+        else if (!strcmp(argv[i], "--jobs") && (cmd == scan)) {
+          char* end;
           if (++i >= argc)
             return none;
-          img->second_fname = argv[i];
+          img->jobs = strtol(argv[i], &end, 0);
+          if ((end == argv[i]) || *end || (img->jobs <= 0))
+            return none;
+        }
+        else if (!strcmp(argv[i], "--io") && (cmd == info)) {
+          if ((++i >= argc) || parse_io_engine(img, argv[i]))
+            return none;
+        }
+        else if (!strcmp(argv[i], "--offset") && (cmd == info)) {
+          if ((++i >= argc) || parse_offset(img, argv[i]))
+            return none;
         }
+        else if (!img->fname)
+          img->fname = argv[i];
         else
           return none;
       }
+      if (!img->fname)
+        return none;
+      // the index knows files, not the images they hold
+      if (img->offset && img->index_fname)
+        return none;
+      if (cmd == scan)
+        img->scan_path = img->fname;
       break;
-  }
-  
-  return cmd;
-}
-
 
+    case verify:
+    case find:
+      if (argc != 3)
+        return none;
+      img->fname = argv[2];
+      break;
 
-int check_boot_img_header(t_abootimg* img)
-{
-  if (strncmp((char*)(img->header.magic), BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
-    fprintf(stderr, "%s: no Android Magic Value\n", img->fname);
-    return 1;
-  }
+    case diff:
+      for(i=2; i<argc; i++) {
+        if (!strncmp(argv[i], "--index", 7) && (!argv[i][7] || (argv[i][7] == '='))) {
+          img->index_fname = argv[i][7] ? argv[i] + 8 : (++i < argc) ? argv[i] : NULL;
+          if (!img->index_fname || !img->index_fname[0])
+            return none;
+        }
+        else if (!img->fname)
+          img->fname = argv[i];
+        else if (!img->diff_fname)
+          img->diff_fname = argv[i];
+        else
+          return none;
+      }
+      if (!img->diff_fname)
+        return none;
+      break;
 
-  if (!(img->header.kernel_size)) {
-    fprintf(stderr, "%s: kernel size is null\n", img->fname);
-    return 1;
-  }
+    case make_patch:
+      if (argc != 5)
+        return none;
+      img->fname = argv[2];
+      img->diff_fname = argv[3];
+      img->delta_fname = argv[4];
+      break;
 
-  if (!(img->header.ramdisk_size)) {
-    fprintf(stderr, "%s: ramdisk size is null\n", img->fname);
-    return 1;
-  }
+    case apply_patch:
+      if (argc < 4)
+        return none;
+      img->fname = argv[2];
+      img->delta_fname = argv[3];
+      for (s=0; s<bootimg_nb_sections; s++)
+        img->section_fnames[s] = NULL;
+      for(i=4; i<argc; i++) {
+        if (!strcmp(argv[i], "--direct")) {
+          img->direct = 1;
+        }
+        else if (!strcmp(argv[i], "--buffer-size")) {
+          if ((++i >= argc) || parse_buffer_size(img, argv[i]))
+            return none;
+        }
+        else if (!strncmp(argv[i], "--stats", 7) && (!argv[i][7] || (argv[i][7] == '='))) {
+          if (parse_stats(img, argv[i]))
+            return none;
+        }
+        else
+          return none;
+      }
+      break;
+      
+    case extract:
+      {
+        int npos = 0;
+        for(i=2; i<argc; i++) {
+          if (!strcmp(argv[i], "--buffer-size")) {
+            if ((++i >= argc) || parse_buffer_size(img, argv[i]))
+              return none;
+          }
+          else if (!strcmp(argv[i], "--io")) {
+            if ((++i >= argc) || parse_io_engine(img, argv[i]))
+              return none;
+          }
+          else if (!strncmp(argv[i], "--stats", 7) && (!argv[i][7] || (argv[i][7] == '='))) {
+            if (parse_stats(img, argv[i]))
+              return none;
+          }
+          else if (!strcmp(argv[i], "--offset")) {
+            if ((++i >= argc) || parse_offset(img, argv[i]))
+              return none;
+          }
+          else if (!strcmp(argv[i], "--unpack-ramdisk")) {
+            if (++i >= argc)
+              return none;
+            img->unpack_dir = argv[i];
+          }
+          else if ((s = parse_section_option(argv[i], cmd)) != -1) {
+            if (++i >= argc)
+              return none;
+            img->section_fnames[s] = argv[i];
+          }
+          else if (npos == 0)
+            img->fname = argv[i], npos++;
+          else if (npos == 1)
+            img->config_fname = argv[i], npos++;
+          else if (npos - 2 <= bootimg_second)
+            img->section_fnames[npos++ - 2] = argv[i];
+          else
+            return none;
+        }
+        if (!npos)
+          return none;
+      }
+      break;
 
-  unsigned page_size = img->header.page_size;
-  if (!page_size) {
-    fprintf(stderr, "%s: Image page size is null\n", img->fname);
-    return 1;
+    case update:
+    case create:
+      if (argc < 3)
+        return none;
+      img->fname = argv[2];
+      img->config_fname = NULL;
+      for (s=0; s<bootimg_nb_sections; s++)
+        img->section_fnames[s] = NULL;
+      for(i=3; i<argc; i++) {
+        if (!strcmp(argv[i], "-c")) {
+          if (++i >= argc)
+            return none;
+          unsigned len = strlen(argv[i]);
+          if (strlen(img->config_args)+len+1 >= MAX_CONF_LEN)
+            abort_printf("too many config parameters.\n");
+          strcat(img->config_args, argv[i]);
+          strcat(img->config_args, "\n");
+        }
+        else if (!strcmp(argv[i], "-f")) {
+          if (++i >= argc)
+            return none;
+          img->config_fname = argv[i];
+        }
+        else if ((s = parse_section_option(argv[i], cmd)) != -1) {
+          if (++i >= argc)
+            return none;
+          img->section_fnames[s] = argv[i];
+        }
+        else if (!strcmp(argv[i], "--sparse") && (cmd == create)) {
+          img->sparse = 1;
+        }
+        else if (!strcmp(argv[i], "--compare")) {
+          img->compare = 1;
+        }
+        else if (!strcmp(argv[i], "--direct")) {
+          img->direct = 1;
+        }
+        else if (!strcmp(argv[i], "--buffer-size")) {
+          if ((++i >= argc) || parse_buffer_size(img, argv[i]))
+            return none;
+        }
+        else if (!strcmp(argv[i], "--io")) {
+          if ((++i >= argc) || parse_io_engine(img, argv[i]))
+            return none;
+        }
+        else if (!strncmp(argv[i], "--stats", 7) && (!argv[i][7] || (argv[i][7] == '='))) {
+          if (parse_stats(img, argv[i]))
+            return none;
+        }
+        else if (!strcmp(argv[i], "--pack-ramdisk")) {
+          if (++i >= argc)
+            return none;
+          img->pack_dir = argv[i];
+        }
+        else if (!strcmp(argv[i], "--ramdisk-cache")) {
+          if (++i >= argc)
+            return none;
+          img->pack_cache = argv[i];
+        }
+        else if (!strcmp(argv[i], "--ramdisk-codec")) {
+          if ((++i >= argc) || ((img->ramdisk_codec = parse_codec(argv[i])) == codec_unknown))
+            return none;
+        }
+        else if ((!strcmp(argv[i], "--ramdisk-add") || !strcmp(argv[i], "--ramdisk-replace") ||
+                  !strcmp(argv[i], "--ramdisk-delete")) && (cmd == update)) {
+          enum ramdisk_op op = !strcmp(argv[i], "--ramdisk-add") ? ramdisk_add :
+                               !strcmp(argv[i], "--ramdisk-replace") ? ramdisk_replace : ramdisk_delete;
+          int nargs = (op == ramdisk_delete) ? 1 : 2;
+          if (i + nargs >= argc)
+            return none;
+          img->ramdisk_edits = realloc(img->ramdisk_edits, (img->nb_ramdisk_edits+1) * sizeof(t_ramdisk_edit));
+          if (!img->ramdisk_edits)
+            abort_perror(NULL);
+          t_ramdisk_edit* edit = &img->ramdisk_edits[img->nb_ramdisk_edits++];
+          edit->op = op;
+          edit->path = argv[++i];
+          edit->fname = (nargs == 2) ? argv[++i] : NULL;
+        }
+        else
+          return none;
+      }
+      if ((img->pack_dir && img->section_fnames[bootimg_ramdisk]) || (img->pack_cache && !img->pack_dir) ||
+          (img->nb_ramdisk_edits && (img->pack_dir || img->section_fnames[bootimg_ramdisk])) ||
+          ((img->ramdisk_codec != codec_unknown) && !img->pack_dir && !img->nb_ramdisk_edits) ||
+          (img->pack_cache && (img->ramdisk_codec != codec_unknown) && (img->ramdisk_codec != codec_gzip)))
+        return none;
+      break;
   }
+  
+  return cmd;
+}
 
-  unsigned n = (img->header.kernel_size + page_size - 1) / page_size;
-  unsigned m = (img->header.ramdisk_size + page_size - 1) / page_size;
-  unsigned o = (img->header.second_size + page_size - 1) / page_size;
 
-  unsigned total_size = (1+n+m+o)*page_size;
 
-  if (total_size > img->size) {
-    fprintf(stderr, "%s: sizes mismatches in boot image\n", img->fname);
+int check_boot_img_header(t_abootimg* img)
+{
+  enum bootimg_status status = bootimg_check_header(&img->header, img->size);
+  if (status) {
+    fprintf(stderr, "%s: %s\n", img->fname, bootimg_strerror(status));
     return 1;
   }
 
@@ -320,584 +1187,2945 @@ void check_if_block_device(t_abootimg* img)
 {
   struct stat st;
 
-  if (stat(img->fname, &st))
+  if (stat(img->fname, &st)) {
     if (errno != ENOENT) {
-      printf("errno=%d\n", errno);
+      print_msg("errno=%d\n", errno);
       abort_perror(img->fname);
     }
+    return;
+  }
 
-#ifdef HAS_BLKID
+  // written as a device whether or not its content can be probed
   if (S_ISBLK(st.st_mode)) {
     img->is_blkdev = 1;
 
+#ifdef HAS_BLKID
     char* type = blkid_get_tag_value(NULL, "TYPE", img->fname);
     if (type)
       abort_printf("%s: refuse to write on a valid partition type (%s)\n", img->fname, type);
+#endif
 
     int fd = open(img->fname, O_RDONLY);
     if (fd == -1)
       abort_perror(img->fname);
     
     unsigned long long bsize = 0;
-    if (blkgetsize(fd, &bsize))
+    if (bootimg_image_size(fd, &bsize))
       abort_perror(img->fname);
     img->size = bsize;
 
     close(fd);
   }
-#endif
 }
 
 
 
 void open_bootimg(t_abootimg* img, char* mode)
 {
+  if (is_remote(img->fname)) {
+    if (strcmp(mode, "r"))
+      abort_printf("%s: remote images are read only\n", img->fname);
+    img->remote = remote_open(img->fname);
+    return;
+  }
+
   img->stream = fopen(img->fname, mode);
   if (!img->stream)
     abort_perror(img->fname);
+  img->is_new = (mode[0] == 'w');
 }
 
 
 
-void read_header(t_abootimg* img)
+void map_bootimg(t_abootimg* img)
 {
-  size_t rb = fread(&img->header, sizeof(boot_img_hdr), 1, img->stream);
-  if ((rb!=1) || ferror(img->stream))
-    abort_perror(img->fname);
-  else if (feof(img->stream))
-    abort_printf("%s: cannot read image header\n", img->fname);
+  if (img->remote)
+    return;
 
-  struct stat s;
   int fd = fileno(img->stream);
-  if (fstat(fd, &s))
+  unsigned long long size;
+  if (bootimg_image_size(fd, &size))
     abort_perror(img->fname);
 
-  if (S_ISBLK(s.st_mode)) {
-    unsigned long long bsize = 0;
+  if (!size || (size > SIZE_MAX) || (img->io == io_buffered) || img->offset)
+    return;
+
+  // the read-only view is optional: if the image cannot be mapped
+  // (pipe, unsupported device, ...), we fall back to stdio reads
+  void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return;
+
+  img->map = p;
+  img->map_size = size;
+}
+
+
+
+/*
+ * The header of a remote image is read with a single range, its first
+ * bytes, the size of the image coming with the response.
+ */
+void read_remote_header(t_abootimg* img)
+{
+  if (remote_read(img->remote, &img->header, sizeof(boot_img_hdr), img->offset) < sizeof(boot_img_hdr))
+    abort_printf("%s: cannot read image header\n", img->fname);
+
+  unsigned long long size = remote_size(img->remote);
+  img->size = size > img->offset ? size - img->offset : 0;
+}
 
-    if (blkgetsize(fd, &bsize))
+
+
+void read_header(t_abootimg* img)
+{
+  if (img->remote)
+    read_remote_header(img);
+  else if (img->map) {
+    if (img->map_size < sizeof(boot_img_hdr))
+      abort_printf("%s: cannot read image header\n", img->fname);
+    memcpy(&img->header, img->map, sizeof(boot_img_hdr));
+    stats_mapped(sizeof(boot_img_hdr));
+  }
+  else {
+    if (img->offset && fseeko(img->stream, img->offset, SEEK_SET))
       abort_perror(img->fname);
-    img->size = bsize;
-    img->is_blkdev = 1;
+    size_t rb = fread(&img->header, sizeof(boot_img_hdr), 1, img->stream);
+    stats_read(sizeof(boot_img_hdr));
+    if ((rb!=1) || ferror(img->stream))
+      abort_perror(img->fname);
+    else if (feof(img->stream))
+      abort_printf("%s: cannot read image header\n", img->fname);
+  }
+
+  if (!img->remote) {
+    struct stat s;
+    int fd = fileno(img->stream);
+    if (fstat(fd, &s))
+      abort_perror(img->fname);
+
+    unsigned long long size;
+    if (bootimg_image_size(fd, &size))
+      abort_perror(img->fname);
+    img->size = size > img->offset ? size - img->offset : 0;
+    img->is_blkdev = S_ISBLK(s.st_mode);
+  }
+
+  if (check_boot_img_header(img))
+    abort_printf("%s: not a valid Android Boot Image.\n", img->fname);
+
+  // an embedded image ends with its last section
+  if (img->offset) {
+    t_bootimg_layout layout;
+    bootimg_get_layout(&img->header, &layout);
+    img->size = layout.total_size;
+  }
+
+  img->orig_header = img->header;
+}
+
+
+
+/* the image size is 64-bit, the header fields are 32-bit */
+unsigned header_value(char* token, unsigned long long value)
+{
+  if (value > UINT_MAX)
+    abort_printf("%s: value too big (0x%llx)\n", token, value);
+  return value;
+}
+
+
+
+/* for the fields which moved to vendor_boot with version 3 */
+void check_legacy_field(t_abootimg* img, char* token)
+{
+  if (!bootimg_has_legacy_fields(&img->header))
+    abort_printf("%s: not in a version %u header\n", token, bootimg_header_version(&img->header));
+}
+
+
+
+void update_header_entry(t_abootimg* img, char* cmd)
+{
+  char *p;
+  char *token;
+  char *endtoken;
+  char *value;
+
+  p = strchr(cmd, '\n');
+  if (p)
+    *p  = '\0';
+
+  p = cmd;
+  p += strspn(p, " \t");
+  token = p;
+  
+  p += strcspn(p, " =\t");
+  endtoken = p;
+  p += strspn(p, " \t");
+
+  if (*p++ != '=')
+    goto err;
+
+  p += strspn(p, " \t");
+  value = p;
+
+  *endtoken = '\0';
+
+  unsigned long long valuenum = strtoull(value, NULL, 0);
+  unsigned version = bootimg_header_version(&img->header);
+  enum bootimg_status status;
+  
+  if (!strcmp(token, "cmdline")) {
+    if (bootimg_set_cmdline(&img->header, value))
+      abort_printf("cmdline length (%zu) is too long for a version %u header", strlen(value), version);
+  }
+  else if (!strncmp(token, "name", 4)) {
+    check_legacy_field(img, token);
+    strncpy((char*)(img->header.name), value, BOOT_NAME_SIZE);
+    img->header.name[BOOT_NAME_SIZE-1] = '\0';
+  }
+  else if (!strncmp(token, "headerversion", 13)) {
+    status = bootimg_set_header_version(&img->header, header_value(token, valuenum));
+    if (status == bootimg_err_section)
+      abort_printf("%s: the image has sections a version %llu header cannot hold\n", token, valuenum);
+    else if (status)
+      abort_printf("%s: %s\n", token, bootimg_strerror(status));
+  }
+  else if (!strncmp(token, "osversion", 9)) {
+    bootimg_set_os_version(&img->header, header_value(token, valuenum));
+  }
+  else if (!strncmp(token, "bootsize", 8)) {
+    if (img->is_blkdev && (img->size != valuenum))
+      abort_printf("%s: cannot change Boot Image size for a block device\n", img->fname);
+    img->size = valuenum;
+  }
+  else if (!strncmp(token, "pagesize", 8)) {
+    if (bootimg_set_page_size(&img->header, header_value(token, valuenum)))
+      abort_printf("%s: a version %u header has %u byte pages\n", token, version,
+                   bootimg_page_size(&img->header));
+  }
+  else if (!strncmp(token, "kerneladdr", 10)) {
+    check_legacy_field(img, token);
+    img->header.kernel_addr = header_value(token, valuenum);
+  }
+  else if (!strncmp(token, "ramdiskaddr", 11)) {
+    check_legacy_field(img, token);
+    img->header.ramdisk_addr = header_value(token, valuenum);
+  }
+  else if (!strncmp(token, "secondaddr", 10)) {
+    check_legacy_field(img, token);
+    img->header.second_addr = header_value(token, valuenum);
+  }
+  else if (!strncmp(token, "tagsaddr", 8)) {
+    check_legacy_field(img, token);
+    img->header.tags_addr = header_value(token, valuenum);
+  }
+  else if (!strncmp(token, "dtbaddr", 7)) {
+    // 64-bit, as its field
+    if (!bootimg_has_section(&img->header, bootimg_dtb))
+      abort_printf("%s: not in a version %u header\n", token, version);
+    img->header.dtb_addr = valuenum;
+  }
+  else
+    goto err;
+  return;
+
+err:
+  abort_printf("%s: bad config entry\n", token);
+}
+
+
+void update_header(t_abootimg* img)
+{
+  if (img->config_fname) {
+    FILE* config_file = fopen(img->config_fname, "r");
+    if (!config_file)
+      abort_perror(img->config_fname);
+
+    print_msg("reading config file %s\n", img->config_fname);
+
+    char* line = NULL;
+    size_t len = 0;
+    int read;
+
+    while ((read = getline(&line, &len, config_file)) != -1) {
+      update_header_entry(img, line);
+      free(line);
+      line = NULL;
+    }
+    if (ferror(config_file))
+      abort_perror(img->config_fname);
+    fclose(config_file);
+  }
+
+  unsigned len = strlen(img->config_args);
+  if (len) {
+    FILE* config_file = fmemopen(img->config_args, len, "r");
+    if  (!config_file)
+      abort_perror("-c args");
+
+    print_msg("reading config args\n");
+
+    char* line = NULL;
+    size_t len = 0;
+    int read;
+
+    while ((read = getline(&line, &len, config_file)) != -1) {
+      update_header_entry(img, line);
+      free(line);
+      line = NULL;
+    }
+    if (ferror(config_file))
+      abort_perror("-c args");
+    fclose(config_file);
+  }
+}
+
+
+
+/*
+ * The copy buffer of the image: every transfer going through userspace is
+ * done in chunks of img->buffer_size, whatever the size of the sections.
+ */
+char* io_buffer(t_abootimg* img)
+{
+  if (!img->buffer) {
+    img->buffer = malloc(img->buffer_size);
+    if (!img->buffer)
+      abort_perror(NULL);
+  }
+  return img->buffer;
+}
+
+
+
+/*
+ * Open a section input file, "-" being the standard input.
+ * Regular files are sized with fstat(). Pipes and other streams are
+ * flagged as streamed: their size is only known once read up to EOF.
+ */
+int open_input(char* fname, unsigned* size, int* streamed)
+{
+  if (!strcmp(fname, "-") && serving)
+    abort_printf("-: no standard input for the commands of --serve\n");
+  int fd = strcmp(fname, "-") ? open(fname, O_RDONLY) : STDIN_FILENO;
+  if (fd == -1)
+    abort_perror(fname);
+
+  struct stat st;
+  if (fstat(fd, &st))
+    abort_perror(fname);
+
+  if (S_ISREG(st.st_mode)) {
+    *size = st.st_size;
+    *streamed = 0;
   }
   else {
-    img->size = s.st_size;
-    img->is_blkdev = 0;
+    *size = 0;
+    *streamed = 1;
   }
+  return fd;
+}
+
+
+
+int open_tmpfile(void)
+{
+  FILE* tmp = tmpfile();
+  if (!tmp)
+    abort_perror("tmpfile");
+  int fd = dup(fileno(tmp));
+  if (fd == -1)
+    abort_perror("tmpfile");
+  fclose(tmp);
+  return fd;
+}
+
+
+
+/*
+ * Copy a streamed input into an anonymous temporary file, for the cases
+ * where its size has to be known before the image is written.
+ */
+int spool_input(t_abootimg* img, int fd, char* fname, unsigned* size)
+{
+  char* buf = io_buffer(img);
+  int tmp_fd = open_tmpfile();
+
+  unsigned long long total = 0;
+  for (;;) {
+    ssize_t rb = read(fd, buf, img->buffer_size);
+    if (rb < 0) {
+      if (errno == EINTR)
+        continue;
+      abort_perror(fname);
+    }
+    stats_read(rb);
+    if (!rb)
+      break;
+    write_all(tmp_fd, buf, rb, total, "tmpfile");
+    total += rb;
+    if (total > UINT_MAX)
+      abort_printf("%s: too big\n", fname);
+  }
+
+  if (fd != STDIN_FILENO)
+    close(fd);
+  *size = total;
+  return tmp_fd;
+}
+
+
+
+#ifdef HAS_ZLIB
+/*
+ * Errors are reported to the writer of the image, which stops at the end
+ * of the pipe the same way as when the ramdisk is complete.
+ */
+static void* pack_ramdisk_thread(void* arg)
+{
+  t_abootimg* img = arg;
+  t_job_context ctx;
+
+  ctx.out = img->pack_out;
+  ctx.nb_cleanups = 0;
+  job_context = &ctx;
+  stats_attach(img->stats);
+  stats_section(bootimg_ramdisk);
+  if (setjmp(ctx.env)) {
+    strcpy(img->pack_error, ctx.error);
+    close(img->pack_fd);
+    return NULL;
+  }
+
+  enum codec codec = (img->ramdisk_codec == codec_unknown) ? codec_gzip : img->ramdisk_codec;
+  pack_ramdisk(img->pack_dir, img->pack_fd, img->pack_dir, codec, 0, img->pack_cache);
+  if (close(img->pack_fd))
+    abort_perror(img->pack_dir);
+  return NULL;
+}
+#endif
+
+
+
+/*
+ * Build the ramdisk from a directory in a separate thread. The compressed
+ * archive is read from a pipe as any streamed ramdisk, so that it is
+ * written to the image while being produced.
+ */
+void start_pack_ramdisk(t_abootimg* img)
+{
+#ifdef HAS_ZLIB
+  int fds[2];
+  if (pipe(fds))
+    abort_perror("pipe");
+#ifdef F_SETPIPE_SZ
+  fcntl(fds[1], F_SETPIPE_SZ, COPY_BUFFER_SIZE);
+#endif
+
+  img->section_fnames[bootimg_ramdisk] = img->pack_dir;
+  img->section_fds[bootimg_ramdisk] = fds[0];
+  img->section_streamed[bootimg_ramdisk] = 1;
+  img->pack_fd = fds[1];
+  img->pack_out = job_context ? job_context->out : stdout;
+  if ((errno = pthread_create(&img->pack_thread, NULL, pack_ramdisk_thread, img)))
+    abort_perror("pthread_create");
+  img->pack_running = 1;
+#else
+  abort_printf("--pack-ramdisk: not supported in this build\n");
+#endif
+}
+
+
+
+/*
+ * Apply the --ramdisk-* edits to the ramdisk of the image. The result goes
+ * to a temporary file first, the ramdisk being read from the very place
+ * it is to be written.
+ */
+void edit_bootimg_ramdisk(t_abootimg* img)
+{
+#ifdef HAS_ZLIB
+  t_bootimg_layout layout;
+  bootimg_get_layout(&img->orig_header, &layout);
+
+  print_msg("editing ramdisk\n");
+
+  int fd = open_tmpfile();
+  stats_section(bootimg_ramdisk);
+  edit_ramdisk(fileno(img->stream), layout.sections[bootimg_ramdisk].offset,
+               layout.sections[bootimg_ramdisk].size, img->fname,
+               img->ramdisk_edits, img->nb_ramdisk_edits, fd, "tmpfile", img->ramdisk_codec, 0);
+  stats_section(-1);
+
+  struct stat st;
+  if (fstat(fd, &st))
+    abort_perror("tmpfile");
+  if (st.st_size > UINT_MAX)
+    abort_printf("%s: edited ramdisk too big\n", img->fname);
+  bootimg_set_section_size(&img->header, bootimg_ramdisk, st.st_size);
+  img->section_fds[bootimg_ramdisk] = fd;
+  img->section_fnames[bootimg_ramdisk] = "ramdisk";
+#else
+  abort_printf("--ramdisk-add/replace/delete: not supported in this build\n");
+#endif
+}
+
+
+
+/*
+ * Rebuild the sections changed by the --apply-delta patch in temporary
+ * files, as they are made from the image they are to be written to, and
+ * take the new header from it. The sections kept are only moved if their
+ * offset changes, and the pages already holding the right bytes are not
+ * rewritten.
+ */
+void patch_bootimg(t_abootimg* img)
+{
+  int fd = fileno(img->stream);
+  t_delta d;
+  int i;
+
+  delta_open(&d, img->delta_fname);
+  delta_check_image(&d, fd, img->fname, &img->orig_header, io_buffer(img), img->buffer_size);
+
+  img->header = d.header.new_header;
+  img->keep_id = 1;
+  for (i=0; i<bootimg_nb_sections; i++) {
+    if (d.header.kept & (1 << i))
+      continue;
+    print_msg("patching %s\n", section_files[i].description);
+    img->section_fds[i] = open_tmpfile();
+    img->section_fnames[i] = section_files[i].description;
+    stats_section(i);
+    delta_build_section(&d, i, fd, img->fname, img->section_fds[i], "tmpfile", io_buffer(img),
+                        img->buffer_size);
+  }
+  stats_section(-1);
+  delta_close(&d);
+
+  // a file becomes the new image, down to its size, a device keeps its own
+  if (!img->is_blkdev)
+    img->size = d.header.new_image_size;
+
+  t_bootimg_layout layout;
+  if (bootimg_get_layout(&img->header, &layout))
+    abort_printf("%s: corrupted patch\n", img->delta_fname);
+  if (layout.total_size > img->size)
+    abort_printf("%s: updated is too big for the Boot Image (%llu vs %llu bytes)\n", img->fname,
+                 layout.total_size, img->size);
+  img->compare = 1;
+}
+
+
+
+void join_pack_ramdisk(t_abootimg* img)
+{
+#ifdef HAS_ZLIB
+  if (img->pack_running) {
+    pthread_join(img->pack_thread, NULL);
+    img->pack_running = 0;
+  }
+#endif
+}
+
+
+
+/*
+ * Once the packed ramdisk has been read up to its end, make sure it is
+ * actually complete.
+ */
+void wait_pack_ramdisk(t_abootimg* img)
+{
+  join_pack_ramdisk(img);
+#ifdef HAS_ZLIB
+  if (img->pack_error[0])
+    abort_printf("%s\n", img->pack_error);
+#endif
+}
+
+
+
+/* the size of a streamed section is only known once read up to its end */
+int has_streamed_section(t_abootimg* img)
+{
+  int i;
+
+  for (i=0; i<bootimg_nb_sections; i++)
+    if (img->section_streamed[i])
+      return 1;
+  return 0;
+}
+
+
+
+void update_images(t_abootimg *img)
+{
+  unsigned version = bootimg_header_version(&img->header);
+  unsigned size;
+  int i;
+
+  t_bootimg_layout layout;
+  enum bootimg_status status = bootimg_get_layout(&img->header, &layout);
+  if (status)
+    abort_printf("%s: %s\n", img->fname, bootimg_strerror(status));
+
+  for (i=0; i<bootimg_nb_sections; i++) {
+    char* fname = img->section_fnames[i];
+    if (fname) {
+      if (!bootimg_has_section(&img->header, i))
+        abort_printf("%s: no %s in a version %u header\n", fname, section_files[i].description, version);
+      print_msg("reading %s from %s\n", section_files[i].description, fname);
+      img->section_fds[i] = open_input(fname, &size, &img->section_streamed[i]);
+      bootimg_set_section_size(&img->header, i, size);
+    }
+    else if ((i == bootimg_ramdisk) && img->pack_dir) {
+      print_msg("packing ramdisk from %s\n", img->pack_dir);
+      start_pack_ramdisk(img);
+    }
+    else if ((i == bootimg_ramdisk) && img->nb_ramdisk_edits)
+      edit_bootimg_ramdisk(img);
+  }
+
+  // Streamed inputs are written to a new image as they are read, and
+  // their size patched in the header at the end. An image updated in
+  // place would be overwritten before knowing whether they fit, so they
+  // are spooled first. So they are when a following section is kept from
+  // the original image, as it has to be moved first, and for sparse
+  // images, which need all sizes beforehand.
+  int kept_after = 0;
+  for (i=bootimg_nb_sections-1; i>=0; i--) {
+    if (img->section_streamed[i] && (img->sparse || kept_after || !img->is_new)) {
+      img->section_fds[i] = spool_input(img, img->section_fds[i], img->section_fnames[i], &size);
+      bootimg_set_section_size(&img->header, i, size);
+      img->section_streamed[i] = 0;
+    }
+    kept_after |= (img->section_fds[i] == -1) && bootimg_section_size(&img->header, i);
+  }
+  if (!img->section_streamed[bootimg_ramdisk])
+    wait_pack_ramdisk(img);
+
+  if (has_streamed_section(img))
+    return; // checked by write_bootimg() once streamed
+
+  bootimg_get_layout(&img->header, &layout);
+
+  if (!img->size)
+    img->size = layout.total_size;
+  else if (layout.total_size > img->size)
+    abort_printf("%s: updated is too big for the Boot Image (%llu vs %llu bytes)\n", img->fname,
+                 layout.total_size, img->size);
+}
+
+
+
+int open_direct_reader(t_abootimg* img)
+{
+  if (img->direct_fd == -1) {
+#ifdef O_DIRECT
+    img->direct_fd = open(img->fname, O_RDONLY|O_DIRECT);
+#endif
+    if (img->direct_fd == -1)
+      img->direct_fd = fileno(img->stream);
+  }
+  return img->direct_fd;
+}
+
+
+
+/*
+ * Read up to size bytes at offset, bypassing the page cache when possible.
+ * Returns the number of bytes read, which is short at the end of the image.
+ */
+size_t read_direct(t_abootimg* img, char* buf, size_t size, off_t offset)
+{
+  int fd = open_direct_reader(img);
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t rb = pread(fd, buf + done, size - done, offset + done);
+    if (rb < 0) {
+      if (errno == EINTR)
+        continue;
+      if ((errno == EINVAL) && (fd != fileno(img->stream))) {
+        // O_DIRECT not usable with these offsets, go through the cache
+        close(fd);
+        fd = img->direct_fd = fileno(img->stream);
+        continue;
+      }
+      abort_perror(img->fname);
+    }
+    stats_read(rb);
+    if (!rb)
+      break;
+    done += rb;
+  }
+
+  return done;
+}
+
+
+
+double elapsed(struct timespec* start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+
+void print_progress(t_abootimg* img, int done)
+{
+  double t = elapsed(&img->write_start);
+  double mb = (double)img->bytes_written / 0x100000;
+  int tty = !job_context && isatty(1);
+
+  if (done)
+    print_msg("%s%.2f MB written in %.2f s (%.1f MB/s)\n", tty ? "\r" : "",
+            mb, t, t > 0 ? mb / t : 0);
+  else if (tty) {
+    print_msg("\r%.2f / %.2f MB (%.1f MB/s)", mb, (double)img->bytes_total / 0x100000,
+            t > 0 ? mb / t : 0);
+    fflush(stdout);
+  }
+}
+
+
+
+/*
+ * Write the pending data of the direct writer.
+ *
+ * The stage buffer starts at an aligned image offset: partial blocks at
+ * both ends are completed with their current content before the write.
+ */
+void flush_stage(t_abootimg* img)
+{
+  unsigned align = img->direct_align;
+  char* tmp = img->stage_buf + img->stage_size;
+
+  if (!img->stage_len)
+    return;
+
+  size_t len = ((img->stage_len + align - 1) / align) * align;
+  size_t tail = img->stage_len % align;
+
+  if (img->stage_head) {
+    memset(tmp, 0, align);
+    read_direct(img, tmp, align, img->stage_offset);
+    memcpy(img->stage_buf, tmp, img->stage_head);
+  }
+  if (tail) {
+    if (img->stage_head && (len == align))
+      ; // same block as the head, already read
+    else {
+      memset(tmp, 0, align);
+      read_direct(img, tmp, align, img->stage_offset + len - align);
+    }
+    memcpy(img->stage_buf + img->stage_len, tmp + tail, align - tail);
+  }
+
+  const char* p = img->stage_buf;
+  off_t offset = img->stage_offset;
+  while (len) {
+    ssize_t wb = pwrite(img->direct_wfd, p, len, offset);
+    if (wb < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EINVAL) {
+        // alignment refused: finish the job through the page cache
+        write_all(fileno(img->stream), p, len, offset, img->fname);
+        close(img->direct_wfd);
+        img->direct_wfd = -1;
+        img->direct = 0;
+        break;
+      }
+      abort_perror(img->fname);
+    }
+    stats_write(0); // the bytes were counted by stage_write()
+    p += wb;
+    offset += wb;
+    len -= wb;
+  }
+
+  img->bytes_written += img->stage_len - img->stage_head;
+  img->stage_len = img->stage_head = 0;
+  print_progress(img, 0);
+}
+
+
+
+/*
+ * Flush the pending writes which overlap a range about to be read.
+ */
+void sync_stage(t_abootimg* img, off_t offset, size_t size)
+{
+  if (img->stage_len && (offset < img->stage_offset + (off_t)img->stage_len + img->direct_align)
+                     && (offset + (off_t)size > img->stage_offset))
+    flush_stage(img);
+}
+
+
+
+/*
+ * Queue size bytes at offset in the direct writer. Contiguous writes are
+ * batched in an aligned buffer and written in large O_DIRECT requests,
+ * which keeps the target out of the page cache.
+ */
+void stage_write(t_abootimg* img, const void* buf, size_t size, off_t offset)
+{
+  const char* p = buf;
+
+  while (size) {
+    if (img->stage_len && ((offset != img->stage_offset + (off_t)img->stage_len) ||
+                           (img->stage_len == img->stage_size)))
+      flush_stage(img);
+
+    if (!img->direct) {
+      write_all(fileno(img->stream), p, size, offset, img->fname);
+      return;
+    }
+
+    if (!img->stage_len) {
+      img->stage_offset = offset - (offset % img->direct_align);
+      img->stage_head = img->stage_len = offset % img->direct_align;
+    }
+
+    size_t len = img->stage_size - img->stage_len;
+    if (len > size)
+      len = size;
+    memcpy(img->stage_buf + img->stage_len, p, len);
+    stats_staged(len);
+    img->stage_len += len;
+    p += len;
+    size -= len;
+    offset += len;
+  }
+}
+
+
+
+/*
+ * Set up the direct writer, or silently keep buffered writes when the
+ * target does not support O_DIRECT, synced at the end all the same.
+ */
+void open_direct_writer(t_abootimg* img)
+{
+  unsigned align = bootimg_page_size(&img->header);
+  void* b;
+
+  if (!img->direct)
+    return;
+  img->direct_sync = 1;
+
+#ifdef O_DIRECT
+  img->direct_wfd = open(img->fname, O_WRONLY|O_DIRECT);
+#endif
+  if (img->direct_wfd == -1) {
+    img->direct = 0;
+    return;
+  }
+
+#ifdef BLKSSZGET
+  int ssize;
+  if (img->is_blkdev && !ioctl(img->direct_wfd, BLKSSZGET, &ssize) && (ssize > 0) && !(align % ssize))
+    align = ssize;
+#endif
+  if (align < 512)
+    align = 512;
+  img->direct_align = align;
+
+  // batches are as big as the user buffer size when one is given
+  size_t size = img->buffer_size_set ? img->buffer_size : DIRECT_BUFFER_SIZE;
+  img->stage_size = ((size + align - 1) / align) * align;
+
+  int err = posix_memalign(&b, align > 4096 ? align : 4096, img->stage_size + align);
+  if (err) {
+    errno = err;
+    abort_perror(NULL);
+  }
+  img->stage_buf = b;
+  clock_gettime(CLOCK_MONOTONIC, &img->write_start);
+}
+
+
+
+/*
+ * Complete all writes, and make sure the data reached the device.
+ */
+void close_direct_writer(t_abootimg* img)
+{
+  flush_stage(img);
+
+  int fd = img->direct_wfd != -1 ? img->direct_wfd : fileno(img->stream);
+  if ((img->direct_sync || img->is_blkdev) && fdatasync(fd))
+    abort_perror(img->fname);
+
+  if (img->direct_wfd != -1) {
+    print_progress(img, 1);
+    close(img->direct_wfd);
+    img->direct_wfd = -1;
+  }
+}
+
+
+
+/*
+ * Write size bytes at offset in the image.
+ *
+ * In compare mode, the destination is read back first and compared page
+ * by page (memcmp, which the C library vectorizes), and only the pages
+ * which actually differ are written. This saves writes, and flash wear,
+ * for block devices which mostly already hold the same content.
+ */
+void write_image(t_abootimg* img, const void* buf, size_t size, off_t offset)
+{
+  const char* p = buf;
+
+  if (!img->compare) {
+    stage_write(img, buf, size, offset);
+    return;
+  }
+
+  unsigned bsize = bootimg_page_size(&img->header);
+
+  if (!img->compare_buf) {
+    void* b;
+    int err = posix_memalign(&b, bsize > 4096 ? bsize : 4096, img->buffer_size + 2*bsize);
+    if (err) {
+      errno = err;
+      abort_perror(NULL);
+    }
+    img->compare_buf = b;
+  }
+
+  while (size) {
+    size_t len = size < img->buffer_size ? size : img->buffer_size;
+    off_t start = offset - (offset % bsize);
+    off_t end = offset + len;
+    size_t rlen = ((end - start + bsize - 1) / bsize) * bsize;
+    sync_stage(img, start, rlen);
+    size_t got = read_direct(img, img->compare_buf, rlen, start);
+
+    off_t pos = offset;
+    off_t dirty = -1; // start of the current run of differing pages
+    while (pos < end) {
+      off_t next = (pos / bsize + 1) * bsize;
+      if (next > end)
+        next = end;
+
+      int same = ((size_t)(next - start) <= got) &&
+                 !memcmp(img->compare_buf + (pos - start), p + (pos - offset), next - pos);
+      // a page written in pieces, as the end of a section and its
+      // padding, only counts once, as rewritten if any piece is
+      off_t page = pos / bsize;
+      if (page != img->compare_page) {
+        if (same)
+          img->blocks_skipped++;
+        else
+          img->blocks_written++;
+        img->compare_page = page;
+        img->compare_page_same = same;
+      }
+      else if (img->compare_page_same && !same) {
+        img->blocks_skipped--;
+        img->blocks_written++;
+        img->compare_page_same = 0;
+      }
+
+      if (same) {
+        if (dirty != -1)
+          stage_write(img, p + (dirty - offset), pos - dirty, dirty);
+        dirty = -1;
+      }
+      else if (dirty == -1)
+        dirty = pos;
+      pos = next;
+    }
+    if (dirty != -1)
+      stage_write(img, p + (dirty - offset), end - dirty, dirty);
+
+    p += len;
+    size -= len;
+    offset += len;
+  }
+}
+
+
+
+static void* section_copy_thread(void* arg)
+{
+  t_section_copy* c = arg;
+  t_job_context ctx;
+
+  ctx.out = c->out;
+  ctx.nb_cleanups = 0;
+  job_context = &ctx;
+  stats_attach(c->stats);
+  stats_section(c->section);
+  if (setjmp(ctx.env)) {
+    strcpy(c->error, ctx.error);
+    return NULL;
+  }
+
+  if (!(c->buf = malloc(c->buf_size)))
+    abort_perror(NULL);
+  copy_range(c->in_fd, c->in_offset, c->in_map, c->in_fname, c->out_fd, c->out_offset,
+             c->out_fname, c->size, c->buf, c->buf_size, c->engine);
+  return NULL;
+}
+
+
+
+/*
+ * Start copying size bytes of in_fd at in_offset to out_fd at out_offset,
+ * as copy_range() does, on a new thread. out_fd is closed with the copy if
+ * close_out is set. The I/O is counted for section.
+ */
+void start_section_copy(t_abootimg* img, enum bootimg_section section,
+                        int in_fd, off_t in_offset, const char* in_map, char* in_fname,
+                        int out_fd, off_t out_offset, char* out_fname, size_t size, int close_out)
+{
+  t_section_copy* c = &img->copies[img->nb_copies++];
+
+  memset(c, 0, sizeof(*c));
+  c->in_fd = in_fd;
+  c->in_offset = in_offset;
+  c->in_map = in_map;
+  c->in_fname = in_fname;
+  c->out_fd = out_fd;
+  c->out_offset = out_offset;
+  c->out_fname = out_fname;
+  c->size = size;
+  c->close_out = close_out;
+  c->buf_size = img->buffer_size;
+  c->engine = img->io;
+  c->stats = img->stats;
+  c->section = section;
+  c->out = job_context ? job_context->out : stdout;
+
+  if ((errno = pthread_create(&c->thread, NULL, section_copy_thread, c)))
+    abort_perror("pthread_create");
+  c->running = 1;
+}
+
+
+
+/* wait for the copies, on errors as well: they use the fds of the image */
+void join_section_copies(t_abootimg* img)
+{
+  int i;
+
+  for (i=0; i<img->nb_copies; i++) {
+    t_section_copy* c = &img->copies[i];
+    if (c->running)
+      pthread_join(c->thread, NULL);
+    c->running = 0;
+    free(c->buf);
+    c->buf = NULL;
+    if (c->close_out && (c->out_fd != -1) && close(c->out_fd) && !c->error[0])
+      snprintf(c->error, sizeof(c->error), "%s: %s", c->out_fname, strerror(errno));
+    c->out_fd = -1;
+  }
+}
+
+
+
+/* once they are all done, report the first copy which failed */
+void wait_section_copies(t_abootimg* img)
+{
+  int i;
+
+  join_section_copies(img);
+  int n = img->nb_copies;
+  img->nb_copies = 0;
+  for (i=0; i<n; i++)
+    if (img->copies[i].error[0])
+      abort_printf("%s\n", img->copies[i].error);
+}
+
+
+
+/*
+ * copy_range() for an input whose bytes are hashed on the way. They are
+ * hashed from a map of the input, which leaves the copy itself to the
+ * kernel, or through the copy buffer if the input cannot be mapped.
+ */
+void copy_hashed(t_abootimg* img, int in_fd, off_t in_offset, char* in_fname,
+                 int out_fd, off_t out_offset, size_t size, t_sha1* sha1)
+{
+  char* buf = io_buffer(img);
+
+  if (!size)
+    return;
+
+  void* map = (img->io == io_buffered) ? MAP_FAILED :
+              mmap(NULL, in_offset + size, PROT_READ, MAP_SHARED, in_fd, 0);
+  if (map != MAP_FAILED) {
+    madvise(map, in_offset + size, MADV_SEQUENTIAL);
+    stats_mapped(size);
+    sha1_update(sha1, (char*)map + in_offset, size);
+    copy_range(in_fd, in_offset, map, in_fname, out_fd, out_offset, img->fname, size,
+               buf, img->buffer_size, img->io);
+    munmap(map, in_offset + size);
+    return;
+  }
+
+  while (size) {
+    size_t len = size < img->buffer_size ? size : img->buffer_size;
+    read_all(in_fd, buf, len, in_offset, in_fname);
+    sha1_update(sha1, buf, len);
+    write_all(out_fd, buf, len, out_offset, img->fname);
+    size -= len;
+    in_offset += len;
+    out_offset += len;
+  }
+}
+
+
+
+/*
+ * Copy size bytes of in_fd at in_offset into the image at offset.
+ */
+void copy_to_image(t_abootimg* img, int in_fd, off_t in_offset, char* in_fname, off_t offset, size_t size)
+{
+  char* buf = io_buffer(img);
+
+  if (!img->compare && !img->direct && img->id_hash) {
+    copy_hashed(img, in_fd, in_offset, in_fname, fileno(img->stream), offset, size, img->id_hash);
+    return;
+  }
+  if (!img->compare && !img->direct) {
+    copy_range(in_fd, in_offset, NULL, in_fname, fileno(img->stream), offset, img->fname, size,
+               buf, img->buffer_size, img->io);
+    return;
+  }
+
+  while (size) {
+    size_t len = size < img->buffer_size ? size : img->buffer_size;
+    read_all(in_fd, buf, len, in_offset, in_fname);
+    if (img->id_hash)
+      sha1_update(img->id_hash, buf, len);
+    write_image(img, buf, len, offset);
+    size -= len;
+    in_offset += len;
+    offset += len;
+  }
+}
+
+
+
+/*
+ * Copy a streamed input into the image at offset, up to EOF, and return
+ * its size. When the image size is known, the input must fit in it.
+ */
+unsigned stream_to_image(t_abootimg* img, int in_fd, char* in_fname, off_t offset)
+{
+  unsigned long long limit = img->size > offset ? img->size - offset : 0;
+  unsigned long long size = 0;
+
+  if (img->size && !limit)
+    abort_printf("%s: no room left in the Boot Image for %s\n", img->fname, in_fname);
+
+#ifdef SPLICE_F_MOVE
+  // pipes can be moved to the image page by page, without a copy
+  if (!img->compare && !img->direct && !img->id_hash) {
+    int out_fd = fileno(img->stream);
+    for (;;) {
+      // never past the limit: once reached, read() tells whether more follows
+      size_t len = img->buffer_size;
+      if (limit && (len > limit - size))
+        len = limit - size;
+      if (!len)
+        break;
+      loff_t pos = offset + size;
+      ssize_t cb = splice(in_fd, NULL, out_fd, &pos, len, SPLICE_F_MOVE);
+      if (cb < 0) {
+        if (errno == EINTR)
+          continue;
+        if ((errno == EINVAL) && !size)
+          break; // not a pipe, use read()
+        abort_perror(in_fname);
+      }
+      if (!cb)
+        goto done;
+      stats_copy(cb);
+      size += cb;
+    }
+  }
+#endif
+
+  char* buf = io_buffer(img);
+  for (;;) {
+    ssize_t rb = read(in_fd, buf, img->buffer_size);
+    if (rb < 0) {
+      if (errno == EINTR)
+        continue;
+      abort_perror(in_fname);
+    }
+    stats_read(rb);
+    if (!rb)
+      break;
+    if (limit && (size + rb > limit))
+      abort_printf("%s: %s is too big for the Boot Image\n", img->fname, in_fname);
+    if (img->id_hash)
+      sha1_update(img->id_hash, buf, rb);
+    write_image(img, buf, rb, offset + size);
+    size += rb;
+  }
+
+#ifdef SPLICE_F_MOVE
+done:
+#endif
+  if (size > UINT_MAX)
+    abort_printf("%s: too big\n", in_fname);
+  return size;
+}
+
+
+
+/*
+ * Hash size bytes of the image at offset, from its map if there is one.
+ * Pending direct writes are flushed first.
+ */
+void hash_range(t_abootimg* img, off_t offset, size_t size, t_sha1* sha1)
+{
+  if (img->map && (offset + size <= img->map_size)) {
+    unsigned align = offset % getpagesize();
+    madvise(img->map + offset - align, size + align, MADV_SEQUENTIAL);
+    stats_mapped(size);
+    sha1_update(sha1, img->map + offset, size);
+    return;
+  }
+
+  char* buf = io_buffer(img);
+  sync_stage(img, offset, size);
+  while (size) {
+    size_t len = size < img->buffer_size ? size : img->buffer_size;
+    if (img->remote) {
+      if (remote_read(img->remote, buf, len, offset) < len)
+        abort_printf("%s: file truncated\n", img->fname);
+    }
+    else
+      read_all(fileno(img->stream), buf, len, offset, img->fname);
+    sha1_update(sha1, buf, len);
+    size -= len;
+    offset += len;
+  }
+}
+
+
+
+/* hash size bytes of an input file, from its start */
+void hash_input(t_abootimg* img, int fd, char* fname, size_t size, t_sha1* sha1)
+{
+  if (!size)
+    return;
+
+  void* map = (img->io == io_buffered) ? MAP_FAILED : mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map != MAP_FAILED) {
+    madvise(map, size, MADV_SEQUENTIAL);
+    stats_mapped(size);
+    sha1_update(sha1, map, size);
+    munmap(map, size);
+    return;
+  }
+
+  char* buf = io_buffer(img);
+  off_t offset = 0;
+  while (size) {
+    size_t len = size < img->buffer_size ? size : img->buffer_size;
+    read_all(fd, buf, len, offset, fname);
+    sha1_update(sha1, buf, len);
+    size -= len;
+    offset += len;
+  }
+}
+
+
+
+/*
+ * The id of mkbootimg is the SHA-1 of each section followed by its size,
+ * a little endian 32 bits word.
+ */
+void hash_size(t_sha1* sha1, unsigned size)
+{
+  unsigned char le[4] = { size, size >> 8, size >> 16, size >> 24 };
+
+  sha1_update(sha1, le, sizeof(le));
+}
+
+
+
+void set_id(boot_img_hdr* header, t_sha1* sha1)
+{
+  unsigned char digest[SHA1_DIGEST_SIZE];
+
+  sha1_final(sha1, digest);
+  memset(header->id, 0, sizeof(header->id));
+  memcpy(header->id, digest, sizeof(digest));
+}
+
+
+
+/* versions 1 and 2 tell where the recovery dtbo is, as mkbootimg does */
+void set_recovery_dtbo_offset(boot_img_hdr* header, const t_bootimg_layout* layout)
+{
+  const t_bootimg_extent* e = &layout->sections[bootimg_recovery_dtbo];
+
+  if (bootimg_has_section(header, bootimg_recovery_dtbo))
+    header->recovery_dtbo_offset = e->size ? e->offset : 0;
+}
+
+
+
+/*
+ * Move size bytes from src to dst within the image, the two ranges may
+ * overlap. Non overlapping moves go through copy_to_image(), the others
+ * are done chunk by chunk in the direction which never overwrites bytes
+ * not moved yet.
+ */
+void move_range(t_abootimg* img, off_t src, off_t dst, size_t size)
+{
+  int fd = fileno(img->stream);
+
+  if (src == dst)
+    return;
+
+  off_t distance = dst > src ? dst - src : src - dst;
+  if (distance >= (off_t)size) {
+    copy_to_image(img, fd, src, img->fname, dst, size);
+    return;
+  }
+
+  char* buf = io_buffer(img);
+
+  size_t done = 0;
+  while (done < size) {
+    size_t len = size - done < img->buffer_size ? size - done : img->buffer_size;
+    // moving up, start from the end
+    off_t pos = dst > src ? (off_t)(size - done - len) : (off_t)done;
+
+    sync_stage(img, src + pos, len);
+    read_all(fd, buf, len, src + pos, img->fname);
+    write_image(img, buf, len, dst + pos);
+    done += len;
+  }
+}
+
+
+
+/*
+ * Zero size bytes of padding at offset.
+ *
+ * Regular files are kept sparse: a freshly created image already reads as
+ * zeros there, and an existing one gets a hole punched instead.
+ * Block devices (or filesystems without hole punching) get real zeros.
+ */
+void write_padding(t_abootimg* img, unsigned long long offset, unsigned long long size, char* padding)
+{
+  int fd = fileno(img->stream);
+  unsigned psize = bootimg_page_size(&img->header);
+
+  if (!size)
+    return;
+
+  if (!img->is_blkdev) {
+    if (img->is_new)
+      return;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, size))
+      return;
+#endif
+  }
+
+  while (size) {
+    unsigned len = size < psize ? size : psize;
+    write_image(img, padding, len, offset);
+    stats_padding(len);
+    offset += len;
+    size -= len;
+  }
+}
+
+
+
+/* size rounded up to whole pages, without wrapping around */
+unsigned long long page_align(unsigned long long size, unsigned psize)
+{
+  return ((size + psize - 1) / psize) * psize;
+}
+
+
+
+void write_bootimg(t_abootimg* img)
+{
+  unsigned psize;
+  char* padding;
+
+  print_msg("Writing Boot Image %s\n", img->fname);
+
+  psize = bootimg_page_size(&img->header);
+  padding = calloc(psize, 1);
+  if (!padding)
+    abort_perror("");
+
+  t_bootimg_layout layout, old_layout;
+  bootimg_get_layout(&img->header, &layout);
+  unsigned long long total_size = layout.total_size;
+
+  // original layout, all null for a new image
+  memset(&old_layout, 0, sizeof(old_layout));
+  if (bootimg_page_size(&img->orig_header))
+    bootimg_get_layout(&img->orig_header, &old_layout);
+
+  struct {
+    int fd;
+    int streamed;
+    char* fname;
+    unsigned size;
+    unsigned long long offset;
+    unsigned long long old_offset;
+    int in_id;
+  } sections[bootimg_nb_sections];
+  const int nb_sections = bootimg_nb_sections;
+  int i;
+
+  // the id covers the sections of the version, empty ones included
+  for (i=0; i<nb_sections; i++) {
+    sections[i].fd = img->section_fds[i];
+    sections[i].streamed = img->section_streamed[i];
+    sections[i].fname = img->section_fnames[i];
+    sections[i].size = layout.sections[i].size;
+    sections[i].offset = layout.sections[i].offset;
+    sections[i].old_offset = old_layout.sections[i].offset;
+    sections[i].in_id = bootimg_has_section(&img->header, i);
+  }
+
+  int fd = fileno(img->stream);
+
+#ifdef __linux__
+  // reserve the header and the sections, their padding and the tail up
+  // to the image size are left unallocated
+  if (img->is_new && !img->is_blkdev) {
+    fallocate(fd, 0, 0, layout.header_size);
+    for (i=0; i<nb_sections; i++)
+      if (sections[i].size && !sections[i].streamed)
+        fallocate(fd, 0, sections[i].offset, sections[i].size);
+  }
+#endif
+
+  // block devices are always written through the direct writer
+  if (img->is_blkdev)
+    img->direct = 1;
+  open_direct_writer(img);
+
+  img->bytes_total = psize;
+  for (i=0; i<nb_sections; i++)
+    if ((sections[i].fd != -1) || (sections[i].offset != sections[i].old_offset))
+      img->bytes_total += page_align(sections[i].size, psize);
+
+  // Sections which are kept from the original image are only touched when
+  // their offset shifts. Moving down is done in increasing offset order,
+  // moving up in decreasing order, so that a section is never overwritten
+  // before being moved itself. Replaced sections are written afterwards.
+  for (i=0; i<nb_sections; i++)
+    if ((sections[i].fd == -1) && sections[i].size && (sections[i].offset < sections[i].old_offset)) {
+      print_msg("moving %s\n", section_files[i].description);
+      stats_section(i);
+      move_range(img, sections[i].old_offset, sections[i].offset, sections[i].size);
+      write_padding(img, sections[i].offset + sections[i].size,
+                    page_align(sections[i].size, psize) - sections[i].size, padding);
+    }
+  for (i=nb_sections-1; i>=0; i--)
+    if ((sections[i].fd == -1) && sections[i].size && (sections[i].offset > sections[i].old_offset)) {
+      print_msg("moving %s\n", section_files[i].description);
+      stats_section(i);
+      move_range(img, sections[i].old_offset, sections[i].offset, sections[i].size);
+      write_padding(img, sections[i].offset + sections[i].size,
+                    page_align(sections[i].size, psize) - sections[i].size, padding);
+    }
+
+  // The id is computed as the sections are written. When none is replaced
+  // and the version is kept, it does not change, nor when it is given by
+  // a patch. There is none from version 3 on.
+  t_sha1 id;
+  int id_changed = bootimg_page_size(&img->orig_header) &&
+    (bootimg_header_version(&img->header) != bootimg_header_version(&img->orig_header));
+  for (i=0; i<nb_sections; i++)
+    id_changed |= (sections[i].fd != -1);
+  if (id_changed && !img->keep_id && bootimg_has_legacy_fields(&img->header))
+    img->id_hash = &id;
+  if (img->id_hash)
+    sha1_init(&id);
+
+  // When all offsets are known and the writes need no read back, the
+  // replaced sections are copied all at once, one thread each, the id
+  // being computed from the inputs meanwhile.
+  int nb_replaced = 0, parallel = !img->compare && !img->direct;
+  for (i=0; i<nb_sections; i++) {
+    nb_replaced += (sections[i].fd != -1);
+    parallel &= !sections[i].streamed;
+  }
+  parallel &= (nb_replaced > 1);
+  for (i=0; parallel && (i<nb_sections); i++)
+    if (sections[i].fd != -1) {
+      int out_fd = open(img->fname, O_WRONLY);
+      if (out_fd == -1)
+        abort_perror(img->fname);
+      start_section_copy(img, i, sections[i].fd, 0, NULL, sections[i].fname, out_fd,
+                         sections[i].offset, img->fname, sections[i].size, 1);
+    }
+
+  for (i=0; i<nb_sections; i++) {
+    stats_section(i);
+    // only differs from the planned offset after a streamed section
+    if (i)
+      sections[i].offset = sections[i-1].offset + page_align(sections[i-1].size, psize);
+
+    if (sections[i].streamed) {
+      sections[i].size = stream_to_image(img, sections[i].fd, sections[i].fname, sections[i].offset);
+      bootimg_set_section_size(&img->header, i, sections[i].size);
+    }
+    else if ((sections[i].fd != -1) && parallel) {
+      if (img->id_hash)
+        hash_input(img, sections[i].fd, sections[i].fname, sections[i].size, &id);
+    }
+    else if (sections[i].fd != -1)
+      copy_to_image(img, sections[i].fd, 0, sections[i].fname, sections[i].offset, sections[i].size);
+    else if (img->id_hash)
+      hash_range(img, sections[i].offset, sections[i].size, &id);
+
+    if (img->id_hash && sections[i].in_id)
+      hash_size(&id, sections[i].size);
+
+    // kept sections are padded as they are moved
+    if (sections[i].fd == -1)
+      continue;
+
+    unsigned size = sections[i].size;
+    write_padding(img, sections[i].offset + size, (psize - (size % psize)) % psize, padding);
+  }
+
+  stats_section(-1);
+  wait_section_copies(img);
+  if (img->id_hash)
+    set_id(&img->header, &id);
+  img->id_hash = NULL;
+
+  // streamed sections are only sized now
+  bootimg_get_layout(&img->header, &layout);
+  total_size = layout.total_size;
+  if (!img->size)
+    img->size = total_size;
+
+  set_recovery_dtbo_offset(&img->header, &layout);
+
+  // The header goes last: a new image only becomes valid once complete.
+  // An image updated in place keeps its old header meanwhile, and reads
+  // as valid if interrupted while its sections are rewritten.
+  wait_pack_ramdisk(img);
+  if (check_boot_img_header(img))
+    abort_printf("%s: Sanity cheks failed", img->fname);
+  write_image(img, &img->header, layout.header_size, 0);
+  write_padding(img, layout.header_size, psize - layout.header_size, padding);
+
+  // the tail goes through the writer too, flushed and synced with the rest
+  if (!img->is_blkdev) {
+    if (ftruncate(fd, img->size))
+      abort_perror(img->fname);
+    if (img->size > total_size)
+      write_padding(img, total_size, img->size - total_size, padding);
+  }
+
+  close_direct_writer(img);
+
+  if (img->compare)
+    print_msg("%u of %u pages unchanged, not rewritten\n", img->blocks_skipped,
+            img->blocks_skipped + img->blocks_written);
+
+  free(padding);
+}
+
+
+
+/*
+ * Write the image in Android sparse format.
+ *
+ * The layout is fully known from the header: blocks holding header or
+ * section bytes become RAW chunks, whole blocks of section padding become
+ * FILL chunks, and the unused tail up to the image size a DONT_CARE chunk.
+ * The expanded image is never materialized, RAW data is copied from the
+ * inputs at their final place in the sparse file.
+ */
+void write_sparse_bootimg(t_abootimg* img)
+{
+  print_msg("Writing Android sparse Boot Image %s\n", img->fname);
+
+  if (img->is_blkdev)
+    abort_printf("%s: cannot write a sparse image on a block device\n", img->fname);
+
+  t_bootimg_layout layout;
+  bootimg_get_layout(&img->header, &layout);
+  unsigned psize = layout.page_size;
+  unsigned long long total_size = layout.total_size;
+
+  unsigned bsize = SPARSE_BLOCK_SIZE;
+  if (img->size % bsize)
+    bsize = psize;
+  if ((img->size % bsize) || (bsize % 4))
+    abort_printf("%s: image size is not a multiple of the sparse block size (%u)\n", img->fname, bsize);
+  // block counts are 32-bit in the sparse format
+  if (img->size / bsize > UINT32_MAX)
+    abort_printf("%s: image too big for the sparse format\n", img->fname);
+
+  // the header, then the sections
+  struct {
+    unsigned long long offset;
+    unsigned size;
+    int fd;
+    char* fname;
+    int in_id;
+  } extents[1 + bootimg_nb_sections] = {
+    { 0, layout.header_size, -1, NULL, 0 },
+  };
+  const unsigned nb_extents = sizeof(extents) / sizeof(extents[0]);
+  unsigned e;
+
+  for (e=1; e<nb_extents; e++) {
+    extents[e].offset = layout.sections[e-1].offset;
+    extents[e].size = layout.sections[e-1].size;
+    extents[e].fd = img->section_fds[e-1];
+    extents[e].fname = img->section_fnames[e-1];
+    extents[e].in_id = bootimg_has_legacy_fields(&img->header) && bootimg_has_section(&img->header, e-1);
+  }
+
+  // At most one RAW and one FILL chunk per extent, and the tail. The size
+  // of a RAW chunk, data included, is 32-bit: larger ones are split.
+  unsigned data_blks = (total_size + bsize - 1) / bsize;
+  unsigned total_blks = img->size / bsize;
+  unsigned max_raw_blks = (UINT32_MAX - sizeof(chunk_header_t)) / bsize;
+  chunk_header_t chunks[2*nb_extents+1 + data_blks/max_raw_blks];
+  unsigned nb_chunks = 0;
+  unsigned b;
+
+  for (b=0; b<data_blks; b++) {
+    unsigned long long start = (unsigned long long)b * bsize;
+    unsigned long long end = start + bsize;
+    unsigned type = CHUNK_TYPE_FILL;
+    unsigned i;
+
+    for (i=0; i<nb_extents; i++)
+      if (extents[i].size && (extents[i].offset < end) && (extents[i].offset + extents[i].size > start))
+        type = CHUNK_TYPE_RAW;
+
+    if (nb_chunks && (chunks[nb_chunks-1].chunk_type == type) &&
+        ((type != CHUNK_TYPE_RAW) || (chunks[nb_chunks-1].chunk_sz < max_raw_blks))) {
+      chunks[nb_chunks-1].chunk_sz++;
+      continue;
+    }
+    chunks[nb_chunks].chunk_type = type;
+    chunks[nb_chunks].reserved1 = 0;
+    chunks[nb_chunks].chunk_sz = 1;
+    nb_chunks++;
+  }
+  if (total_blks > data_blks) {
+    chunks[nb_chunks].chunk_type = CHUNK_TYPE_DONT_CARE;
+    chunks[nb_chunks].reserved1 = 0;
+    chunks[nb_chunks].chunk_sz = total_blks - data_blks;
+    nb_chunks++;
+  }
+
+  sparse_header_t sparse = {
+    .magic = SPARSE_HEADER_MAGIC,
+    .major_version = SPARSE_HEADER_MAJOR_VER,
+    .minor_version = SPARSE_HEADER_MINOR_VER,
+    .file_hdr_sz = sizeof(sparse_header_t),
+    .chunk_hdr_sz = sizeof(chunk_header_t),
+    .blk_sz = bsize,
+    .total_blks = total_blks,
+    .total_chunks = nb_chunks,
+    .image_checksum = 0,
+  };
+
+  int fd = fileno(img->stream);
+  off_t pos = 0;
+  write_all(fd, &sparse, sizeof(sparse), pos, img->fname);
+  pos += sizeof(sparse);
+
+  // The sections are hashed for the id as they are copied, in order, and
+  // the header, which starts the first RAW chunk, is patched at the end.
+  off_t header_pos = pos + sizeof(chunk_header_t);
+  unsigned hashed = 1;
+  t_sha1 id;
+  sha1_init(&id);
+
+  unsigned c;
+  unsigned long long start = 0;
+  for (c=0; c<nb_chunks; c++) {
+    chunk_header_t* chunk = &chunks[c];
+    unsigned long long len = (unsigned long long)chunk->chunk_sz * bsize;
+    uint32_t fill = 0;
+
+    chunk->total_sz = sizeof(chunk_header_t);
+    if (chunk->chunk_type == CHUNK_TYPE_RAW)
+      chunk->total_sz += len;
+    else if (chunk->chunk_type == CHUNK_TYPE_FILL)
+      chunk->total_sz += sizeof(fill);
+
+    write_all(fd, chunk, sizeof(chunk_header_t), pos, img->fname);
+    pos += sizeof(chunk_header_t);
+
+    if (chunk->chunk_type == CHUNK_TYPE_RAW) {
+      // padding bytes inside RAW blocks are left as holes of the new file
+      unsigned i;
+      for (i=0; i<nb_extents; i++) {
+        unsigned long long begin = extents[i].offset > start ? extents[i].offset : start;
+        unsigned long long end = extents[i].offset + extents[i].size;
+        if (end > start + len)
+          end = start + len;
+        if (!extents[i].size || (begin >= end))
+          continue;
+        if (!i) {
+          write_all(fd, (char*)&img->header + begin - extents[i].offset, end - begin,
+                    pos + begin - start, img->fname);
+          continue;
+        }
+        for (; hashed < i; hashed++)
+          if (extents[hashed].in_id)
+            hash_size(&id, extents[hashed].size);
+        stats_section(i - 1);
+        copy_hashed(img, extents[i].fd, begin - extents[i].offset, extents[i].fname,
+                    fd, pos + begin - start, end - begin, &id);
+        stats_section(-1);
+      }
+      pos += len;
+    }
+    else if (chunk->chunk_type == CHUNK_TYPE_FILL) {
+      write_all(fd, &fill, sizeof(fill), pos, img->fname);
+      pos += sizeof(fill);
+    }
+
+    start += len;
+  }
+
+  for (; hashed < nb_extents; hashed++)
+    if (extents[hashed].in_id)
+      hash_size(&id, extents[hashed].size);
+  if (bootimg_has_legacy_fields(&img->header))
+    set_id(&img->header, &id);
+  set_recovery_dtbo_offset(&img->header, &layout);
+  write_all(fd, &img->header, layout.header_size, header_pos, img->fname);
+
+  if (ftruncate(fd, pos))
+    abort_perror(img->fname);
+}
+
+
+
+/*
+ * Name the format of a section from its first bytes: compressed data, or
+ * kernel images which decompress themselves.
+ */
+const char* section_format(t_abootimg* img, t_bootimg_extent section)
+{
+  unsigned char buf[1024];
+  unsigned size = section.size;
+
+  if (size > sizeof(buf))
+    size = sizeof(buf);
+  ssize_t rb = img->remote ? (ssize_t)remote_read(img->remote, buf, size, section.offset)
+                           : pread(fileno(img->stream), buf, size, section.offset);
+  if (rb <= 0)
+    return "unknown";
+
+  enum codec codec = detect_codec(buf, rb);
+  if (codec != codec_unknown)
+    return codec_name(codec);
+
+  if ((rb >= 0x28) && (buf[0x24] == 0x18) && (buf[0x25] == 0x28) && (buf[0x26] == 0x6f) && (buf[0x27] == 0x01))
+    return "zImage";
+  if ((rb >= 0x3c) && !memcmp(buf + 0x38, "ARM\x64", 4))
+    return "Image (arm64)";
+  if ((rb >= 0x206) && !memcmp(buf + 0x202, "HdrS", 4))
+    return "bzImage";
+  if ((rb >= 6) && !memcmp(buf, "070701", 6))
+    return "cpio";
+  return "unknown";
+}
+
+
+
+void print_bootimg_info(t_abootimg* img, t_index_entry* entry)
+{
+  boot_img_hdr* h = &img->header;
+  unsigned version = bootimg_header_version(h);
+  unsigned os_version = bootimg_os_version(h);
+  int legacy = bootimg_has_legacy_fields(h);
+  char cmdline[BOOTIMG_CMDLINE_SIZE];
+  t_bootimg_layout layout;
+  int i, width = 17;
+
+  bootimg_get_layout(h, &layout);
+
+  print_msg("\nAndroid Boot Image Info:\n\n");
+
+  print_msg("* file name = %s %s\n\n", img->fname, img->is_blkdev ? "[block device]":"");
+  if (img->offset)
+    print_msg("* offset = %llu bytes (0x%llx)\n\n", img->offset, img->offset);
+
+  print_msg("* image size = %llu bytes (%.2f MB)\n", img->size, (double)img->size/0x100000);
+  print_msg("  page size  = %u bytes\n", layout.page_size);
+  if (version)
+    print_msg("  header version = %u\n", version);
+  // a.b.c, and the year and month of the security patch level
+  if (os_version)
+    print_msg("  os version = %u.%u.%u, patch level %u-%02u\n", os_version >> 25,
+              (os_version >> 18) & 0x7f, (os_version >> 11) & 0x7f,
+              ((os_version >> 4) & 0x7f) + 2000, os_version & 0xf);
+  print_msg("\n");
+
+  if (legacy)
+    print_msg("* Boot Name = \"%s\"\n\n", h->name);
+
+  // kernel and ramdisk always, the other sections when present
+  for (i=0; i<bootimg_nb_sections; i++)
+    if (layout.sections[i].size && ((int)strlen(section_files[i].description) + 5 > width))
+      width = strlen(section_files[i].description) + 5;
+  for (i=0; i<bootimg_nb_sections; i++) {
+    unsigned size = layout.sections[i].size;
+    char label[32];
+    if (!size && (i > bootimg_ramdisk))
+      continue;
+    snprintf(label, sizeof(label), "%s size", section_files[i].description);
+    print_msg("%s%-*s = %u bytes (%.2f MB)\n", i ? "  " : "* ", width, label, size, (double)size/0x100000);
+  }
+
+  print_msg("\n* kernel format  = %s\n", entry->formats[0]);
+  print_msg("  ramdisk format = %s\n", entry->formats[1]);
+ 
+  if (legacy) {
+    print_msg("\n* load addresses:\n");
+    print_msg("  kernel:       0x%08x\n", h->kernel_addr);
+    print_msg("  ramdisk:      0x%08x\n", h->ramdisk_addr);
+    if (layout.sections[bootimg_second].size)
+      print_msg("  second stage: 0x%08x\n", h->second_addr);
+    if (layout.sections[bootimg_dtb].size)
+      print_msg("  dtb:          0x%08llx\n", h->dtb_addr);
+    print_msg("  tags:         0x%08x\n", h->tags_addr);
+  }
+  print_msg("\n");
+
+  bootimg_get_cmdline(h, cmdline);
+  if (cmdline[0])
+    print_msg("* cmdline = %s\n\n", cmdline);
+  else
+    print_msg("* empty cmdline\n");
+
+  if (legacy) {
+    print_msg("* id = ");
+    for (i=0; i<8; i++)
+      print_msg("0x%08x ", h->id[i]);
+    print_msg("\n");
+  }
+  print_msg("\n");
+}
+
+
+
+/* the layout of the image, at its offset in the file */
+void get_image_layout(t_abootimg* img, t_bootimg_layout* layout)
+{
+  int i;
+
+  bootimg_get_layout(&img->header, layout); // checked by read_header()
+  for (i=0; i<bootimg_nb_sections; i++)
+    layout->sections[i].offset += img->offset;
+}
+
+
+
+void hash_section(t_abootimg* img, t_bootimg_extent section, unsigned char digest[SHA1_DIGEST_SIZE])
+{
+  t_sha1 sha1;
+
+  sha1_init(&sha1);
+  hash_range(img, section.offset, section.size, &sha1);
+  sha1_final(&sha1, digest);
+}
+
+
+
+/*
+ * Check the id of the header against the sections, read once.
+ */
+void verify_bootimg(t_abootimg* img)
+{
+  t_bootimg_layout layout;
+  boot_img_hdr header;
+  t_sha1 sha1;
+  int i;
+
+  if (!bootimg_has_legacy_fields(&img->header))
+    abort_printf("%s: no id in a version %u header\n", img->fname, bootimg_header_version(&img->header));
+
+  // the sections of the version, as mkbootimg hashes them
+  get_image_layout(img, &layout);
+  sha1_init(&sha1);
+  for (i=0; i<bootimg_nb_sections; i++)
+    if (bootimg_has_section(&img->header, i)) {
+      hash_range(img, layout.sections[i].offset, layout.sections[i].size, &sha1);
+      hash_size(&sha1, layout.sections[i].size);
+    }
+  set_id(&header, &sha1);
+
+  if (memcmp(header.id, img->header.id, sizeof(header.id))) {
+    for (i=0; (i<8) && !img->header.id[i]; i++)
+      ;
+    if (i == 8)
+      abort_printf("%s: no id in the header\n", img->fname);
+    abort_printf("%s: id mismatch, the sections do not match the header\n", img->fname);
+  }
+
+  print_msg("%s: id ok\n", img->fname);
+}
+
+
+
+/* the index of --index, opened on first use, or the one of --serve */
+t_index* image_index(t_abootimg* img)
+{
+  if (!img->index_fname)
+    return img->shared_index;
+  if (!img->index_opened) {
+    index_open(&img->index, img->index_fname);
+    img->index_opened = 1;
+  }
+  return &img->index;
+}
+
+
+
+/*
+ * Get what -i prints: the header, and the formats or section hashes as
+ * asked by flags. With --index, they come from the index while the image
+ * does not change, otherwise the image is read and indexed.
+ */
+void read_info(t_abootimg* img, t_index_entry* entry, unsigned flags)
+{
+  // the entries of the index are keyed by inode
+  t_index* index = is_remote(img->fname) ? NULL : image_index(img);
+  struct stat st;
+  int i;
+
+  if (index) {
+    if (!stat(img->fname, &st) && !index_lookup(index, &st, entry) &&
+        !entry->status && ((entry->flags & flags) == flags)) {
+      img->header = entry->header;
+      img->size = entry->image_size;
+      return;
+    }
+  }
+
+  open_bootimg(img, "r");
+  map_bootimg(img);
+  read_header(img);
+
+  t_bootimg_layout layout;
+  get_image_layout(img, &layout);
+
+  memset(entry, 0, sizeof(*entry));
+  entry->flags = index_header;
+  entry->status = bootimg_ok;
+  entry->image_size = img->size;
+  entry->header = img->header;
+  // a request each for a remote image, only when asked for
+  if (!img->remote || (flags & index_formats)) {
+    snprintf(entry->formats[0], INDEX_FORMAT_SIZE, "%s", section_format(img, layout.sections[bootimg_kernel]));
+    snprintf(entry->formats[1], INDEX_FORMAT_SIZE, "%s", section_format(img, layout.sections[bootimg_ramdisk]));
+    entry->flags |= index_formats;
+  }
+  if (flags & index_hashes) {
+    for (i=0; i<bootimg_nb_sections; i++)
+      hash_section(img, layout.sections[i], entry->sha1[i]);
+    entry->flags |= index_hashes;
+  }
+
+  if (index) {
+    if (fstat(fileno(img->stream), &st))
+      abort_perror(img->fname);
+    index_store(index, &st, entry);
+  }
+}
+
+
+
+void print_info(t_abootimg* img)
+{
+  t_index_entry entry;
+  int text = (img->info.format == info_text) && !img->info.nb_fields;
+
+  read_info(img, &entry, index_header | (text ? index_formats : 0) |
+                         (info_needs_hashes(&img->info) ? index_hashes : 0));
+
+  if (text)
+    print_bootimg_info(img, &entry);
+  else {
+    default_info_fields(&img->info, 0);
+    print_info_header(msg_stream(), &img->info);
+    print_info_record(msg_stream(), &img->info, img->fname, img->size, &img->header,
+                      (entry.flags & index_hashes) ? entry.sha1 : NULL, "ok");
+  }
+}
+
+
+
+void write_bootimg_config(t_abootimg* img)
+{
+  print_msg("writing boot image config in %s\n", img->config_fname);
+
+  FILE* config_file = fopen(img->config_fname, "w");
+  if (!config_file)
+    abort_perror(img->config_fname);
+
+  boot_img_hdr* h = &img->header;
+  unsigned version = bootimg_header_version(h);
+  char cmdline[BOOTIMG_CMDLINE_SIZE];
+
+  // the version first, the other entries depend on it
+  if (version)
+    fprintf(config_file, "headerversion = %u\n", version);
+  fprintf(config_file, "bootsize = 0x%llx\n", img->size);
+  fprintf(config_file, "pagesize = 0x%x\n", bootimg_page_size(h));
+  if (bootimg_os_version(h))
+    fprintf(config_file, "osversion = 0x%x\n", bootimg_os_version(h));
+
+  if (bootimg_has_legacy_fields(h)) {
+    fprintf(config_file, "kerneladdr = 0x%x\n", h->kernel_addr);
+    fprintf(config_file, "ramdiskaddr = 0x%x\n", h->ramdisk_addr);
+    fprintf(config_file, "secondaddr = 0x%x\n", h->second_addr);
+    fprintf(config_file, "tagsaddr = 0x%x\n", h->tags_addr);
+  }
+  if (bootimg_has_section(h, bootimg_dtb))
+    fprintf(config_file, "dtbaddr = 0x%llx\n", h->dtb_addr);
+
+  if (bootimg_has_legacy_fields(h))
+    fprintf(config_file, "name = %s\n", h->name);
+  bootimg_get_cmdline(h, cmdline);
+  fprintf(config_file, "cmdline = %s\n", cmdline);
+  
+  fclose(config_file);
+}
+
+
+
+void extract_section(t_abootimg* img, char* fname, enum bootimg_section section)
+{
+  t_bootimg_layout layout;
+  get_image_layout(img, &layout);
+  off_t offset = layout.sections[section].offset;
+  unsigned size = layout.sections[section].size;
+
+  int fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if (fd == -1)
+    abort_perror(fname);
+
+  // only the bytes of the section are fetched, in parallel ranges
+  if (img->remote) {
+    stats_section(section);
+    remote_fetch(img->remote, offset, size, fd, 0, fname);
+    stats_section(-1);
+    if (close(fd))
+      abort_perror(fname);
+    return;
+  }
+
+  if (img->map) {
+    // check_boot_img_header() guarantees the section lies within the map
+    unsigned align = offset % getpagesize();
+    madvise(img->map + offset - align, size + align, MADV_SEQUENTIAL);
+  }
+
+  // the sections are extracted concurrently, see wait_section_copies()
+  start_section_copy(img, section, fileno(img->stream), offset, img->map, img->fname, fd, 0, fname, size, 1);
+}
+
+
+
+void unpack_bootimg_ramdisk(t_abootimg* img)
+{
+#ifdef HAS_ZLIB
+  t_bootimg_layout layout;
+  get_image_layout(img, &layout);
+
+  print_msg("unpacking ramdisk in %s\n", img->unpack_dir);
+
+  int fd = img->remote ? -1 : fileno(img->stream);
+  off_t offset = layout.sections[bootimg_ramdisk].offset;
+  unsigned size = layout.sections[bootimg_ramdisk].size;
+  if (img->remote) {
+    // unpack_ramdisk() reads a file: the section is fetched to a temporary one
+    fd = open_tmpfile();
+    remote_fetch(img->remote, offset, size, fd, 0, "temporary file");
+    offset = 0;
+  }
+
+  unpack_ramdisk(fd, offset, size, img->fname, img->unpack_dir);
+  if (img->remote)
+    close(fd);
+#else
+  abort_printf("--unpack-ramdisk: not supported in this build\n");
+#endif
+}
+
+
+
+/* the sections the image holds, the empty ones being not present */
+void extract_sections(t_abootimg* img)
+{
+  int i;
+
+  for (i=0; i<bootimg_nb_sections; i++) {
+    if (!bootimg_section_size(&img->header, i))
+      continue;
+    if ((i == bootimg_ramdisk) && img->unpack_dir) {
+      unpack_bootimg_ramdisk(img);
+      continue;
+    }
+    print_msg("extracting %s in %s\n", section_files[i].description, img->section_fnames[i]);
+    extract_section(img, img->section_fnames[i], i);
+  }
+}
+
+
+
+t_abootimg* new_bootimg()
+{
+  t_abootimg* img;
+  int i;
+
+  img = calloc(sizeof(t_abootimg), 1);
+  if (!img)
+    abort_perror(NULL);
+
+  img->config_fname = "bootimg.cfg";
+  for (i=0; i<bootimg_nb_sections; i++) {
+    img->section_fnames[i] = section_files[i].fname;
+    img->section_fds[i] = -1;
+  }
+  img->direct_fd = -1;
+  img->direct_wfd = -1;
+  img->compare_page = -1;
+
+  img->buffer_size = COPY_BUFFER_SIZE;
+  img->ramdisk_codec = codec_unknown;
+
+  memcpy(img->header.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+  bootimg_set_page_size(&img->header, 2048);  // a sensible default page size
+
+  return img;
+}
+
+
+/*
+ * Release everything held by an image, for batch jobs which run one after
+ * the other in the same process, whether they succeeded or not.
+ */
+void free_bootimg(t_abootimg* img)
+{
+  int i;
+
+  join_section_copies(img);
+
+  // a pack thread still writing gets EPIPE, and ends
+  for (i=0; i<bootimg_nb_sections; i++)
+    if ((img->section_fds[i] != -1) && (img->section_fds[i] != STDIN_FILENO))
+      close(img->section_fds[i]);
+  if (img->direct_wfd != -1)
+    close(img->direct_wfd);
+  join_pack_ramdisk(img);
+
+  if ((img->direct_fd != -1) && (!img->stream || (img->direct_fd != fileno(img->stream))))
+    close(img->direct_fd);
+  if (img->map)
+    munmap(img->map, img->map_size);
+  if (img->stream)
+    fclose(img->stream);
+  remote_close(img->remote);
+  if (img->index_opened)
+    index_close(&img->index);
+
+  free(img->buffer);
+  free(img->compare_buf);
+  free(img->stage_buf);
+  free(img->ramdisk_edits);
+  if (stats_current() == img->stats)
+    stats_attach(NULL);
+  free(img->stats);
+  free(img);
+}
+
+
+
+int create_args_complete(t_abootimg* img)
+{
+  return img->section_fnames[bootimg_kernel] && (img->section_fnames[bootimg_ramdisk] || img->pack_dir);
+}
+
+
+
+void run_command(t_abootimg* img, enum command cmd)
+{
+  t_stats* stats = img->stats;
+
+  stats_attach(stats);
+
+  switch(cmd)
+  {
+    case none:
+    case help:
+    case batch:
+    case scan:
+    case find:
+    case serve:
+      break;
+
+    case info:
+      print_info(img);
+      break;
 
-  if (check_boot_img_header(img))
-    abort_printf("%s: not a valid Android Boot Image.\n", img->fname);
-}
+    case verify:
+      open_bootimg(img, "r");
+      map_bootimg(img);
+      read_header(img);
+      verify_bootimg(img);
+      break;
 
+    case diff:
+      img->differs = diff_images(img->fname, img->diff_fname, image_index(img));
+      break;
 
+    case make_patch:
+      make_delta(img->fname, img->diff_fname, img->delta_fname);
+      break;
 
-void update_header_entry(t_abootimg* img, char* cmd)
-{
-  char *p;
-  char *token;
-  char *endtoken;
-  char *value;
+    case apply_patch:
+      stats_begin(stats, phase_read_header);
+      open_bootimg(img, "r+");
+      read_header(img);
+      stats_begin(stats, phase_update_images);
+      patch_bootimg(img);
+      stats_begin(stats, phase_write_bootimg);
+      write_bootimg(img);
+      break;
 
-  p = strchr(cmd, '\n');
-  if (p)
-    *p  = '\0';
+    case extract:
+      stats_begin(stats, phase_read_header);
+      open_bootimg(img, "r");
+      map_bootimg(img);
+      read_header(img);
+      stats_begin(stats, phase_extract);
+      write_bootimg_config(img);
+      extract_sections(img);
+      wait_section_copies(img);
+      break;
+    
+    case update:
+      stats_begin(stats, phase_read_header);
+      open_bootimg(img, "r+");
+      read_header(img);
+      stats_begin(stats, phase_update_header);
+      update_header(img);
+      stats_begin(stats, phase_update_images);
+      update_images(img);
+      stats_begin(stats, phase_write_bootimg);
+      write_bootimg(img);
+      break;
 
-  p = cmd;
-  p += strspn(p, " \t");
-  token = p;
-  
-  p += strcspn(p, " =\t");
-  endtoken = p;
-  p += strspn(p, " \t");
+    case create:
+      stats_begin(stats, phase_update_header);
+      check_if_block_device(img);
+      open_bootimg(img, "w");
+      update_header(img);
+      stats_begin(stats, phase_update_images);
+      update_images(img);
+      if (!has_streamed_section(img) && check_boot_img_header(img))
+        abort_printf("%s: Sanity cheks failed", img->fname);
+      stats_begin(stats, phase_write_bootimg);
+      if (img->sparse)
+        write_sparse_bootimg(img);
+      else
+        write_bootimg(img);
+      break;
+  }
 
-  if (*p++ != '=')
-    goto err;
+  if (stats)
+    print_stats(stats);
+  stats_attach(NULL);
+}
 
-  p += strspn(p, " \t");
-  value = p;
 
-  *endtoken = '\0';
 
-  unsigned valuenum = strtoul(value, NULL, 0);
-  
-  if (!strcmp(token, "cmdline")) {
-    unsigned len = strlen(value);
-    if (len >= BOOT_ARGS_SIZE) 
-      abort_printf("cmdline length (%d) is too long (max %d)", len, BOOT_ARGS_SIZE-1);
-    memset(img->header.cmdline, 0, BOOT_ARGS_SIZE);
-    strcpy((char*)(img->header.cmdline), value);
-  }
-  else if (!strncmp(token, "name", 4)) {
-    strncpy((char*)(img->header.name), value, BOOT_NAME_SIZE);
-    img->header.name[BOOT_NAME_SIZE-1] = '\0';
-  }
-  else if (!strncmp(token, "bootsize", 8)) {
-    if (img->is_blkdev && (img->size != valuenum))
-      abort_printf("%s: cannot change Boot Image size for a block device\n", img->fname);
-    img->size = valuenum;
-  }
-  else if (!strncmp(token, "pagesize", 8)) {
-    img->header.page_size = valuenum;
-  }
-  else if (!strncmp(token, "kerneladdr", 10)) {
-    img->header.kernel_addr = valuenum;
-  }
-  else if (!strncmp(token, "ramdiskaddr", 11)) {
-    img->header.ramdisk_addr = valuenum;
+/*
+ * Encode a code point read from a JSON \u escape in UTF-8.
+ */
+char* put_utf8(char* out, unsigned long c)
+{
+  if (c < 0x80)
+    *out++ = c;
+  else if (c < 0x800) {
+    *out++ = 0xc0 | (c >> 6);
+    *out++ = 0x80 | (c & 0x3f);
   }
-  else if (!strncmp(token, "secondaddr", 10)) {
-    img->header.second_addr = valuenum;
+  else if (c < 0x10000) {
+    *out++ = 0xe0 | (c >> 12);
+    *out++ = 0x80 | ((c >> 6) & 0x3f);
+    *out++ = 0x80 | (c & 0x3f);
   }
-  else if (!strncmp(token, "tagsaddr", 8)) {
-    img->header.tags_addr = valuenum;
+  else {
+    *out++ = 0xf0 | (c >> 18);
+    *out++ = 0x80 | ((c >> 12) & 0x3f);
+    *out++ = 0x80 | ((c >> 6) & 0x3f);
+    *out++ = 0x80 | (c & 0x3f);
   }
-  else
-    goto err;
-  return;
-
-err:
-  abort_printf("%s: bad config entry\n", token);
+  return out;
 }
 
 
-void update_header(t_abootimg* img)
-{
-  if (img->config_fname) {
-    FILE* config_file = fopen(img->config_fname, "r");
-    if (!config_file)
-      abort_perror(img->config_fname);
-
-    printf("reading config file %s\n", img->config_fname);
 
-    char* line = NULL;
-    size_t len = 0;
-    int read;
+int parse_hex4(char* p, unsigned long* c)
+{
+  int i;
 
-    while ((read = getline(&line, &len, config_file)) != -1) {
-      update_header_entry(img, line);
-      free(line);
-      line = NULL;
-    }
-    if (ferror(config_file))
-      abort_perror(img->config_fname);
+  *c = 0;
+  for (i=0; i<4; i++) {
+    char h = p[i] | 0x20;
+    if ((h >= '0') && (h <= '9'))
+      *c = (*c << 4) | (h - '0');
+    else if ((h >= 'a') && (h <= 'f'))
+      *c = (*c << 4) | (h - 'a' + 10);
+    else
+      return 1; // the end of the line included
   }
+  return 0;
+}
 
-  unsigned len = strlen(config_args);
-  if (len) {
-    FILE* config_file = fmemopen(config_args, len, "r");
-    if  (!config_file)
-      abort_perror("-c args");
-
-    printf("reading config args\n");
 
-    char* line = NULL;
-    size_t len = 0;
-    int read;
 
-    while ((read = getline(&line, &len, config_file)) != -1) {
-      update_header_entry(img, line);
-      free(line);
-      line = NULL;
+/*
+ * Split a manifest line given as a JSON array of strings. The strings are
+ * unescaped in out, which is as large as the line. Returns 1 when malformed.
+ */
+int split_json_args(char* p, char* out, char** argv, int* argc)
+{
+  p += strspn(p, " \t") + 1; // '['
+  p += strspn(p, " \t");
+  if (*p == ']')
+    return p[1 + strspn(p + 1, " \t")] != '\0';
+
+  for (;;) {
+    if (*p++ != '"')
+      return 1;
+    argv[(*argc)++] = out;
+    while (*p != '"') {
+      if ((unsigned char)*p < 0x20)
+        return 1;
+      if (*p != '\\') {
+        *out++ = *p++;
+        continue;
+      }
+      p++;
+      switch (*p++) {
+        case '"':  *out++ = '"';  break;
+        case '\\': *out++ = '\\'; break;
+        case '/':  *out++ = '/';  break;
+        case 'b':  *out++ = '\b'; break;
+        case 'f':  *out++ = '\f'; break;
+        case 'n':  *out++ = '\n'; break;
+        case 'r':  *out++ = '\r'; break;
+        case 't':  *out++ = '\t'; break;
+        case 'u':
+          {
+            unsigned long c, low;
+            if (parse_hex4(p, &c))
+              return 1;
+            p += 4;
+            if ((c >= 0xd800) && (c < 0xdc00)) {
+              // surrogate pair
+              if ((p[0] != '\\') || (p[1] != 'u') || parse_hex4(p + 2, &low) ||
+                  (low < 0xdc00) || (low >= 0xe000))
+                return 1;
+              p += 6;
+              c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+            }
+            else if (!c || ((c >= 0xdc00) && (c < 0xe000)))
+              return 1;
+            out = put_utf8(out, c);
+          }
+          break;
+        default:
+          return 1;
+      }
     }
-    if (ferror(config_file))
-      abort_perror("-c args");
+    p++;
+    *out++ = '\0';
+
+    p += strspn(p, " \t");
+    if (*p == ']')
+      return p[1 + strspn(p + 1, " \t")] != '\0';
+    if (*p++ != ',')
+      return 1;
+    p += strspn(p, " \t");
   }
 }
 
 
 
-void update_images(t_abootimg *img)
+/*
+ * Split a manifest line as the shell would: words separated by blanks,
+ * with '' and "" quotes and backslash escapes, up to a # comment.
+ * Returns 1 when a quote is not closed.
+ */
+int split_shell_args(char* p, char* out, char** argv, int* argc)
 {
-  unsigned page_size = img->header.page_size;
-  unsigned ksize = img->header.kernel_size;
-  unsigned rsize = img->header.ramdisk_size;
-  unsigned ssize = img->header.second_size;
-
-  if (!page_size)
-    abort_printf("%s: Image page size is null\n", img->fname);
-
-  unsigned n = (ksize + page_size - 1) / page_size;
-  unsigned m = (rsize + page_size - 1) / page_size;
-  unsigned o = (ssize + page_size - 1) / page_size;
-
-  unsigned roffset = (1+n)*page_size;
-  unsigned soffset = (1+n+m)*page_size;
-
-  if (img->kernel_fname) {
-    printf("reading kernel from %s\n", img->kernel_fname);
-    FILE* stream = fopen(img->kernel_fname, "r");
-    if (!stream)
-      abort_perror(img->kernel_fname);
-    struct stat st;
-    if (fstat(fileno(stream), &st))
-      abort_perror(img->kernel_fname);
-    ksize = st.st_size;
-    char* k = malloc(ksize);
-    if (!k)
-      abort_perror("");
-    size_t rb = fread(k, ksize, 1, stream);
-    if ((rb!=1) || ferror(stream))
-      abort_perror(img->kernel_fname);
-    else if (feof(stream))
-      abort_printf("%s: cannot read kernel\n", img->kernel_fname);
-    fclose(stream);
-    img->header.kernel_size = ksize;
-    img->kernel = k;
-  }
-
-  if (img->ramdisk_fname) {
-    printf("reading ramdisk from %s\n", img->ramdisk_fname);
-    FILE* stream = fopen(img->ramdisk_fname, "r");
-    if (!stream)
-      abort_perror(img->ramdisk_fname);
-    struct stat st;
-    if (fstat(fileno(stream), &st))
-      abort_perror(img->ramdisk_fname);
-    rsize = st.st_size;
-    char* r = malloc(rsize);
-    if (!r)
-      abort_perror("");
-    size_t rb = fread(r, rsize, 1, stream);
-    if ((rb!=1) || ferror(stream))
-      abort_perror(img->ramdisk_fname);
-    else if (feof(stream))
-      abort_printf("%s: cannot read ramdisk\n", img->ramdisk_fname);
-    fclose(stream);
-    img->header.ramdisk_size = rsize;
-    img->ramdisk = r;
-  }
-  else if (img->kernel) {
-    // if kernel is updated, copy the ramdisk from original image
-    char* r = malloc(rsize);
-    if (!r)
-      abort_perror("");
-    if (fseek(img->stream, roffset, SEEK_SET))
-      abort_perror(img->fname);
-    size_t rb = fread(r, rsize, 1, img->stream);
-    if ((rb!=1) || ferror(img->stream))
-      abort_perror(img->fname);
-    else if (feof(img->stream))
-      abort_printf("%s: cannot read ramdisk\n", img->fname);
-    img->ramdisk = r;
-  }
-
-  if (img->second_fname) {
-    printf("reading second stage from %s\n", img->second_fname);
-    FILE* stream = fopen(img->second_fname, "r");
-    if (!stream)
-      abort_perror(img->second_fname);
-    struct stat st;
-    if (fstat(fileno(stream), &st))
-      abort_perror(img->second_fname);
-    ssize = st.st_size;
-    char* s = malloc(ssize);
-    if (!s)
-      abort_perror("");
-    size_t rb = fread(s, ssize, 1, stream);
-    if ((rb!=1) || ferror(stream))
-      abort_perror(img->second_fname);
-    else if (feof(stream))
-      abort_printf("%s: cannot read second stage\n", img->second_fname);
-    fclose(stream);
-    img->header.second_size = ssize;
-    img->second = s;
-  }
-  else if (img->ramdisk && img->header.second_size) {
-    // if ramdisk is updated, copy the second stage from original image
-    char* s = malloc(ssize);
-    if (!s)
-      abort_perror("");
-    if (fseek(img->stream, soffset, SEEK_SET))
-      abort_perror(img->fname);
-    size_t rb = fread(s, ssize, 1, img->stream);
-    if ((rb!=1) || ferror(img->stream))
-      abort_perror(img->fname);
-    else if (feof(img->stream))
-      abort_printf("%s: cannot read second stage\n", img->fname);
-    img->second = s;
+  for (;;) {
+    p += strspn(p, " \t");
+    if (!*p || (*p == '#'))
+      return 0;
+
+    argv[(*argc)++] = out;
+    while (*p && (*p != ' ') && (*p != '\t')) {
+      if (*p == '\'') {
+        char* end = strchr(++p, '\'');
+        if (!end)
+          return 1;
+        memcpy(out, p, end - p);
+        out += end - p;
+        p = end + 1;
+      }
+      else if (*p == '"') {
+        p++;
+        while (*p != '"') {
+          if (!*p)
+            return 1;
+          if ((*p == '\\') && p[1] && strchr("\"\\$`", p[1]))
+            p++;
+          *out++ = *p++;
+        }
+        p++;
+      }
+      else if (*p == '\\') {
+        if (!*++p)
+          return 1;
+        *out++ = *p++;
+      }
+      else
+        *out++ = *p++;
+    }
+    *out++ = '\0';
   }
-
-  n = (img->header.kernel_size + page_size - 1) / page_size;
-  m = (img->header.ramdisk_size + page_size - 1) / page_size;
-  o = (img->header.second_size + page_size - 1) / page_size;
-  unsigned total_size = (1+n+m+o)*page_size;
-
-  if (!img->size)
-    img->size = total_size;
-  else if (total_size > img->size)
-    abort_printf("%s: updated is too big for the Boot Image (%u vs %u bytes)\n", img->fname, total_size, img->size);
 }
 
 
 
-void write_bootimg(t_abootimg* img)
+typedef struct
 {
-  unsigned psize;
-  char* padding;
-
-  printf ("Writing Boot Image %s\n", img->fname);
+  unsigned     line;
+  char*        text;
+  int          argc;
+  char**       argv;
+  char*        args;        /* the unquoted arguments argv points to */
+} t_batch_job;
 
-  psize = img->header.page_size;
-  padding = calloc(psize, 1);
-  if (!padding)
-    abort_perror("");
+typedef struct
+{
+  t_batch_job*    jobs;
+  unsigned        nb_jobs;
+  unsigned        next;
+  unsigned        failed;
+  pthread_mutex_t lock;
+} t_batch;
+
+/*
+ * What a worker thread of --batch or --serve keeps from one job to the
+ * next: the copy buffer of the last job, reused by the next one when it
+ * is large enough, and the index used by the jobs which give none.
+ */
+typedef struct
+{
+  t_index*     index;
+  char*        buffer;
+  size_t       buffer_size;
+} t_worker;
 
-  unsigned n = (img->header.kernel_size + psize - 1) / psize;
-  unsigned m = (img->header.ramdisk_size + psize - 1) / psize;
-  //unsigned o = (img->header.second_size + psize - 1) / psize;
+typedef struct
+{
+  char*        out;         /* the messages of the job */
+  size_t       out_len;
+  int          status;      /* as the exit status of abootimg: 1 for a failure, or differing images */
+  int          failed;
+  char         error[512];
+} t_job_result;
 
-  if (fseek(img->stream, 0, SEEK_SET))
-    abort_perror(img->fname);
 
-  fwrite(&img->header, sizeof(img->header), 1, img->stream);
-  if (ferror(img->stream))
-    abort_perror(img->fname);
 
-  fwrite(padding, psize - sizeof(img->header), 1, img->stream);
-  if (ferror(img->stream))
-    abort_perror(img->fname);
+/*
+ * Split the arguments of one command line, shell quoted or as a JSON array
+ * of strings, after an "abootimg" argv[0]. Returns 1 when malformed.
+ */
+int split_command(t_batch_job* job, char* p)
+{
+  size_t len = strlen(p);
 
-  if (img->kernel) {
-    fwrite(img->kernel, img->header.kernel_size, 1, img->stream);
-    if (ferror(img->stream))
-      abort_perror(img->fname);
+  // at most one argument in every two characters, argv[0] aside
+  job->argv = malloc((len/2 + 3) * sizeof(char*));
+  job->args = malloc(len + 2);
+  if (!job->argv || !job->args)
+    abort_perror(NULL);
+  job->argv[0] = "abootimg";
+  job->argc = 1;
 
-    fwrite(padding, psize - (img->header.kernel_size % psize), 1, img->stream);
-    if (ferror(img->stream))
-      abort_perror(img->fname);
-  }
+  int err = (*p == '[') ? split_json_args(p, job->args, job->argv, &job->argc)
+                        : split_shell_args(p, job->args, job->argv, &job->argc);
+  job->argv[job->argc] = NULL;
+  return err;
+}
 
-  if (img->ramdisk) {
-    if (fseek(img->stream, (1+n)*psize, SEEK_SET))
-      abort_perror(img->fname);
 
-    fwrite(img->ramdisk, img->header.ramdisk_size, 1, img->stream);
-    if (ferror(img->stream))
-      abort_perror(img->fname);
 
-    fwrite(padding, psize - (img->header.ramdisk_size % psize), 1, img->stream);
-    if (ferror(img->stream))
-      abort_perror(img->fname);
+/*
+ * Read the manifest: one job per line, with the arguments of a single
+ * abootimg command, blank lines and # comments being ignored.
+ */
+void read_manifest(t_batch* b, char* fname)
+{
+  FILE* f = strcmp(fname, "-") ? fopen(fname, "r") : stdin;
+  if (!f)
+    abort_perror(fname);
+
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  unsigned line_no = 0;
+  unsigned max_jobs = 0;
+
+  while ((len = getline(&line, &size, f)) != -1) {
+    line_no++;
+    while (len && ((line[len-1] == '\n') || (line[len-1] == '\r')))
+      line[--len] = '\0';
+
+    char* p = line + strspn(line, " \t");
+    if (!*p || (*p == '#'))
+      continue;
+
+    if (b->nb_jobs == max_jobs) {
+      max_jobs = max_jobs ? 2*max_jobs : 64;
+      b->jobs = realloc(b->jobs, max_jobs * sizeof(t_batch_job));
+      if (!b->jobs)
+        abort_perror(NULL);
+    }
+    t_batch_job* job = &b->jobs[b->nb_jobs++];
+
+    job->line = line_no;
+    job->text = strdup(p);
+    if (!job->text)
+      abort_perror(NULL);
+    if (split_command(job, p))
+      abort_printf("%s:%u: malformed line\n", fname, line_no);
   }
+  if (ferror(f))
+    abort_perror(fname);
+  free(line);
+  if (f != stdin)
+    fclose(f);
+}
 
-  if (img->header.second_size) {
-    if (fseek(img->stream, (1+n+m)*psize, SEEK_SET))
-      abort_perror(img->fname);
-
-    fwrite(img->second, img->header.second_size, 1, img->stream);
-    if (ferror(img->stream))
-      abort_perror(img->fname);
 
-    fwrite(padding, psize - (img->header.second_size % psize), 1, img->stream);
-    if (ferror(img->stream))
-      abort_perror(img->fname);
-  }
 
-  ftruncate (fileno(img->stream), img->size);
+/*
+ * Run one job with its own image, its messages being gathered in r, so
+ * that the outputs of concurrent jobs do not mix.
+ */
+void run_job(t_worker* w, t_batch_job* job, t_job_result* r)
+{
+  t_job_context ctx;
+  t_abootimg* volatile img = NULL;
 
-  free(padding);
+  memset(r, 0, sizeof(*r));
+  ctx.out = open_memstream(&r->out, &r->out_len);
+  if (!ctx.out)
+    abort_perror(NULL);
+  ctx.nb_cleanups = 0;
+
+  job_context = &ctx;
+  if (!setjmp(ctx.env)) {
+    img = new_bootimg();
+    enum command cmd = parse_args(job->argc, job->argv, img);
+    if ((cmd == none) || (cmd == help) || (cmd == batch) || (cmd == scan) || (cmd == find) || (cmd == serve))
+      abort_printf("bad arguments\n");
+    if ((cmd == create) && !create_args_complete(img))
+      abort_printf("--create: kernel and ramdisk are mandatory\n");
+    if (!img->index_fname)
+      img->shared_index = w->index;
+    if (w->buffer && (w->buffer_size >= img->buffer_size))
+      img->buffer = w->buffer;
+    run_command(img, cmd);
+    r->status = !!img->differs;
+  }
+  else {
+    r->failed = 1;
+    r->status = 1;
+    memcpy(r->error, ctx.error, sizeof(r->error));
+  }
+  job_context = NULL;
+
+  if (img) {
+    // the worker keeps the largest buffer
+    if (img->buffer == w->buffer)
+      img->buffer = NULL;
+    else if (img->buffer) {
+      free(w->buffer);
+      w->buffer = img->buffer;
+      w->buffer_size = img->buffer_size;
+      img->buffer = NULL;
+    }
+    free_bootimg(img);
+  }
+  fclose(ctx.out);
 }
 
 
 
-void print_bootimg_info(t_abootimg* img)
+void run_batch_job(t_batch* b, t_worker* w, t_batch_job* job)
 {
-  printf ("\nAndroid Boot Image Info:\n\n");
+  t_job_result r;
 
-  printf ("* file name = %s %s\n\n", img->fname, img->is_blkdev ? "[block device]":"");
+  run_job(w, job, &r);
 
-  printf ("* image size = %u bytes (%.2f MB)\n", img->size, (double)img->size/0x100000);
-  printf ("  page size  = %u bytes\n\n", img->header.page_size);
+  pthread_mutex_lock(&b->lock);
+  printf("== line %u: %s\n", job->line, job->text);
+  fwrite(r.out, 1, r.out_len, stdout);
+  fflush(stdout);
+  if (r.failed) {
+    fprintf(stderr, "line %u: %s\n", job->line, r.error);
+    b->failed++;
+  }
+  pthread_mutex_unlock(&b->lock);
 
-  printf ("* Boot Name = \"%s\"\n\n", img->header.name);
+  free(r.out);
+}
 
-  unsigned kernel_size = img->header.kernel_size;
-  unsigned ramdisk_size = img->header.ramdisk_size;
-  unsigned second_size = img->header.second_size;
 
-  printf ("* kernel size       = %u bytes (%.2f MB)\n", kernel_size, (double)kernel_size/0x100000);
-  printf ("  ramdisk size      = %u bytes (%.2f MB)\n", ramdisk_size, (double)ramdisk_size/0x100000);
-  if (second_size)
-    printf ("  second stage size = %u bytes (%.2f MB)\n", ramdisk_size, (double)ramdisk_size/0x100000);
- 
-  printf ("\n* load addresses:\n");
-  printf ("  kernel:       0x%08x\n", img->header.kernel_addr);
-  printf ("  ramdisk:      0x%08x\n", img->header.ramdisk_addr);
-  if (second_size)
-    printf ("  second stage: 0x%08x\n", img->header.second_addr);
-  printf ("  tags:         0x%08x\n\n", img->header.tags_addr);
-
-  if (img->header.cmdline[0])
-    printf ("* cmdline = %s\n\n", img->header.cmdline);
-  else
-    printf ("* empty cmdline\n");
 
-  printf ("* id = ");
-  int i;
-  for (i=0; i<8; i++)
-    printf ("0x%08x ", img->header.id[i]);
-  printf ("\n\n");
+void* batch_worker(void* arg)
+{
+  t_batch* b = arg;
+  t_worker w;
+
+  memset(&w, 0, sizeof(w));
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    unsigned i = b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (i >= b->nb_jobs)
+      break;
+    run_batch_job(b, &w, &b->jobs[i]);
+  }
+  free(w.buffer);
+  return NULL;
 }
 
 
 
-void write_bootimg_config(t_abootimg* img)
+int default_threads(int nb_threads)
 {
-  printf ("writing boot image config in %s\n", img->config_fname);
+  if (nb_threads <= 0)
+    nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  return nb_threads > 0 ? nb_threads : 1;
+}
 
-  FILE* config_file = fopen(img->config_fname, "w");
-  if (!config_file)
-    abort_perror(img->config_fname);
 
-  fprintf(config_file, "bootsize = 0x%x\n", img->size);
-  fprintf(config_file, "pagesize = 0x%x\n", img->header.page_size);
 
-  fprintf(config_file, "kerneladdr = 0x%x\n", img->header.kernel_addr);
-  fprintf(config_file, "ramdiskaddr = 0x%x\n", img->header.ramdisk_addr);
-  fprintf(config_file, "secondaddr = 0x%x\n", img->header.second_addr);
-  fprintf(config_file, "tagsaddr = 0x%x\n", img->header.tags_addr);
+/*
+ * Run all the jobs of a manifest on a pool of worker threads, each job
+ * with its own image. Returns the number of failed jobs.
+ */
+unsigned run_batch(char* fname, int nb_threads)
+{
+  t_batch b;
+  int i;
 
-  fprintf(config_file, "name = %s\n", img->header.name);
-  fprintf(config_file, "cmdline = %s\n", img->header.cmdline);
-  
-  fclose(config_file);
-}
+  memset(&b, 0, sizeof(b));
+  read_manifest(&b, fname);
+  pthread_mutex_init(&b.lock, NULL);
 
+  // a failed job closes the pipe of its ramdisk packer
+  signal(SIGPIPE, SIG_IGN);
 
+  nb_threads = default_threads(nb_threads);
+  if ((unsigned)nb_threads > b.nb_jobs)
+    nb_threads = b.nb_jobs ? b.nb_jobs : 1;
 
-void extract_kernel(t_abootimg* img)
-{
-  unsigned psize = img->header.page_size;
-  unsigned ksize = img->header.kernel_size;
+  pthread_t threads[nb_threads];
+  for (i=0; i<nb_threads; i++)
+    if ((errno = pthread_create(&threads[i], NULL, batch_worker, &b)))
+      abort_perror("pthread_create");
+  for (i=0; i<nb_threads; i++)
+    pthread_join(threads[i], NULL);
 
-  printf ("extracting kernel in %s\n", img->kernel_fname);
+  fprintf(stderr, "%u jobs, %u failed\n", b.nb_jobs, b.failed);
+  return b.failed;
+}
 
-  void* k = malloc(ksize);
-  if (!k)
-    abort_perror(NULL);
 
-  if (fseek(img->stream, psize, SEEK_SET))
-    abort_perror(img->fname);
 
-  size_t rb = fread(k, ksize, 1, img->stream);
-  if ((rb!=1) || ferror(img->stream))
-    abort_perror(img->fname);
- 
-  FILE* kernel_file = fopen(img->kernel_fname, "w");
-  if (!kernel_file)
-    abort_perror(img->kernel_fname);
+/*
+ * --serve: each client connection has a thread reading its requests, one
+ * command per line as in a batch manifest, and answering each with one
+ * JSON object per line. The commands run on one of nb_threads workers,
+ * waited for while all are busy, so that idle clients cost nothing.
+ */
+typedef struct
+{
+  int             fd;             /* listening */
+  t_index*        index;
+  t_worker*       workers;
+  t_worker**      idle;
+  int             nb_idle;
+  pthread_mutex_t lock;
+  pthread_cond_t  released;
+} t_server;
 
-  fwrite(k, ksize, 1, kernel_file);
-  if (ferror(kernel_file))
-    abort_perror(img->kernel_fname);
+typedef struct
+{
+  t_server*    server;
+  int          fd;
+} t_connection;
 
-  fclose(kernel_file);
-  free(k);
-}
+static char* served_socket;
 
 
 
-void extract_ramdisk(t_abootimg* img)
+static void stop_serving(int sig)
 {
-  unsigned psize = img->header.page_size;
-  unsigned ksize = img->header.kernel_size;
-  unsigned rsize = img->header.ramdisk_size;
+  (void)sig;
+  unlink(served_socket);
+  _exit(0);
+}
 
-  unsigned n = (ksize + psize - 1) / psize;
-  unsigned roffset = (1+n)*psize;
 
-  printf ("extracting ramdisk in %s\n", img->ramdisk_fname);
 
-  void* r = malloc(rsize);
-  if (!r) 
-    abort_perror(NULL);
+int open_server_socket(char* fname)
+{
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(fname) >= sizeof(addr.sun_path))
+    abort_printf("%s: socket path too long\n", fname);
+  strcpy(addr.sun_path, fname);
+
+  // the socket of a server which is gone is replaced, not a live one
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    abort_perror("socket");
+  if (!connect(fd, (struct sockaddr*)&addr, sizeof(addr)))
+    abort_printf("%s: already served\n", fname);
+  if (errno == ECONNREFUSED)
+    unlink(fname);
+  close(fd);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    abort_perror("socket");
+  // clients run commands as the user of the server: its own only
+  mode_t mask = umask(077);
+  int err = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+  umask(mask);
+  if (err || listen(fd, SOMAXCONN))
+    abort_perror(fname);
+  return fd;
+}
 
-  if (fseek(img->stream, roffset, SEEK_SET))
-    abort_perror(img->fname);
 
-  size_t rb = fread(r, rsize, 1, img->stream);
-  if ((rb!=1) || ferror(img->stream))
-    abort_perror(img->fname);
- 
-  FILE* ramdisk_file = fopen(img->ramdisk_fname, "w");
-  if (!ramdisk_file)
-    abort_perror(img->ramdisk_fname);
 
-  fwrite(r, rsize, 1, ramdisk_file);
-  if (ferror(ramdisk_file))
-    abort_perror(img->ramdisk_fname);
+t_worker* get_worker(t_server* s)
+{
+  pthread_mutex_lock(&s->lock);
+  while (!s->nb_idle)
+    pthread_cond_wait(&s->released, &s->lock);
+  t_worker* w = s->idle[--s->nb_idle];
+  pthread_mutex_unlock(&s->lock);
+  return w;
+}
 
-  fclose(ramdisk_file);
-  free(r);
+void release_worker(t_server* s, t_worker* w)
+{
+  pthread_mutex_lock(&s->lock);
+  s->idle[s->nb_idle++] = w;
+  pthread_cond_signal(&s->released);
+  pthread_mutex_unlock(&s->lock);
 }
 
 
 
-void extract_second(t_abootimg* img)
+/* the reply to a request: {"status": 0, "output": "..."}, with "error" for a failure */
+int send_reply(int fd, t_job_result* r)
 {
-  unsigned psize = img->header.page_size;
-  unsigned ksize = img->header.kernel_size;
-  unsigned rsize = img->header.ramdisk_size;
-  unsigned ssize = img->header.second_size;
+  char* buf = NULL;
+  size_t len = 0;
+  FILE* f = open_memstream(&buf, &len);
+  if (!f)
+    abort_perror(NULL);
 
-  if (!ssize) // Second Stage not present
-    return;
+  fprintf(f, "{\"status\": %d, \"output\": ", r->status);
+  put_json_string(f, r->out ? r->out : "", r->out_len);
+  if (r->failed) {
+    fprintf(f, ", \"error\": ");
+    put_json_string(f, r->error, strlen(r->error));
+  }
+  fprintf(f, "}\n");
+  fclose(f);
+
+  size_t done = 0;
+  while (done < len) {
+    ssize_t wb = send(fd, buf + done, len - done, MSG_NOSIGNAL);
+    if ((wb == -1) && (errno == EINTR))
+      continue;
+    if (wb <= 0)
+      break;
+    done += wb;
+  }
+  free(buf);
+  return done < len;
+}
 
-  unsigned n = (rsize + ksize + psize - 1) / psize;
-  unsigned soffset = (1+n)*psize;
 
-  printf ("extracting second stage image in %s\n", img->second_fname);
 
-  void* s = malloc(ksize);
-  if (!s)
+void* connection_thread(void* arg)
+{
+  t_connection* c = arg;
+  t_server* s = c->server;
+  FILE* in = fdopen(c->fd, "r");
+  if (!in)
     abort_perror(NULL);
 
-  if (fseek(img->stream, soffset, SEEK_SET))
-    abort_perror(img->fname);
-
-  size_t rb = fread(s, ssize, 1, img->stream);
-  if ((rb!=1) || ferror(img->stream))
-    abort_perror(img->fname);
- 
-  FILE* second_file = fopen(img->second_fname, "w");
-  if (!second_file)
-    abort_perror(img->second_fname);
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t len;
+
+  while ((len = getline(&line, &size, in)) != -1) {
+    while (len && ((line[len-1] == '\n') || (line[len-1] == '\r')))
+      line[--len] = '\0';
+    char* p = line + strspn(line, " \t");
+    if (!*p)
+      continue;
+
+    t_batch_job job;
+    t_job_result r;
+    memset(&job, 0, sizeof(job));
+    if (split_command(&job, p)) {
+      memset(&r, 0, sizeof(r));
+      r.failed = 1;
+      r.status = 1;
+      snprintf(r.error, sizeof(r.error), "malformed request");
+    }
+    else {
+      t_worker* w = get_worker(s);
+      run_job(w, &job, &r);
+      release_worker(s, w);
+    }
+    free(job.argv);
+    free(job.args);
 
-  fwrite(s, ssize, 1, second_file);
-  if (ferror(second_file))
-    abort_perror(img->second_fname);
+    int err = send_reply(c->fd, &r);
+    free(r.out);
+    if (err)
+      break;
+  }
 
-  fclose(second_file);
-  free(s);
+  free(line);
+  fclose(in);
+  free(c);
+  return NULL;
 }
 
 
 
-t_abootimg* new_bootimg()
+/*
+ * Serve the commands of the clients of a Unix socket, until killed. The
+ * index, when given, stays open for the jobs which do not give their own.
+ */
+void serve_commands(char* socket_fname, int nb_threads, char* index_fname)
 {
-  t_abootimg* img;
+  t_server s;
+  t_index index;
+  int i;
 
-  img = calloc(sizeof(t_abootimg), 1);
-  if (!img)
+  memset(&s, 0, sizeof(s));
+  nb_threads = default_threads(nb_threads);
+  s.workers = calloc(nb_threads, sizeof(t_worker));
+  s.idle = malloc(nb_threads * sizeof(t_worker*));
+  if (!s.workers || !s.idle)
     abort_perror(NULL);
+  if (index_fname) {
+    index_open(&index, index_fname);
+    s.index = &index;
+  }
+  for (i=0; i<nb_threads; i++) {
+    s.workers[i].index = s.index;
+    s.idle[s.nb_idle++] = &s.workers[i];
+  }
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.released, NULL);
+
+  s.fd = open_server_socket(socket_fname);
+  served_socket = socket_fname;
+  serving = 1;
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, stop_serving);
+  signal(SIGTERM, stop_serving);
+  fprintf(stderr, "serving on %s, %d workers\n", socket_fname, nb_threads);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (;;) {
+    int fd = accept4(s.fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+      if ((errno == EINTR) || (errno == ECONNABORTED))
+        continue;
+      if ((errno == EMFILE) || (errno == ENFILE)) {
+        perror("accept");
+        sleep(1);
+        continue;
+      }
+      abort_perror("accept");
+    }
 
-  img->config_fname = "bootimg.cfg";
-  img->kernel_fname = "zImage";
-  img->ramdisk_fname = "initrd.img";
-  img->second_fname = "stage2.img";
-
-  memcpy(img->header.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
-  img->header.page_size = 2048;  // a sensible default page size
-
-  return img;
+    t_connection* c = malloc(sizeof(t_connection));
+    if (!c)
+      abort_perror(NULL);
+    c->server = &s;
+    c->fd = fd;
+    pthread_t thread;
+    if ((errno = pthread_create(&thread, &attr, connection_thread, c))) {
+      perror("pthread_create");
+      close(fd);
+      free(c);
+    }
+  }
 }
 
 
+
 int main(int argc, char** argv)
 {
   t_abootimg* bootimg = new_bootimg();
+  enum command cmd = parse_args(argc, argv, bootimg);
 
-  switch(parse_args(argc, argv, bootimg))
+  switch(cmd)
   {
     case none:
       printf("error - bad arguments\n\n");
@@ -908,45 +4136,43 @@ int main(int argc, char** argv)
       print_usage();
       break;
 
-    case info:
-      open_bootimg(bootimg, "r");
-      read_header(bootimg);
-      print_bootimg_info(bootimg);
+    case batch:
+      if (run_batch(bootimg->batch_fname, bootimg->jobs))
+        return 1;
       break;
 
-    case extract:
-      open_bootimg(bootimg, "r");
-      read_header(bootimg);
-      write_bootimg_config(bootimg);
-      extract_kernel(bootimg);
-      extract_ramdisk(bootimg);
-      extract_second(bootimg);
+    case serve:
+      serve_commands(bootimg->socket_fname, bootimg->jobs, bootimg->index_fname);
       break;
-    
-    case update:
-      open_bootimg(bootimg, "r+");
-      read_header(bootimg);
-      update_header(bootimg);
-      update_images(bootimg);
-      write_bootimg(bootimg);
+
+    case scan:
+      if (scan_images(bootimg->scan_path, bootimg->jobs, &bootimg->info, bootimg->index_fname))
+        return 1;
+      break;
+
+    case find:
+      if (!find_images(bootimg->fname))
+        return 1;
       break;
 
     case create:
-      if (!bootimg->kernel_fname || !bootimg->ramdisk_fname) {
+      if (!create_args_complete(bootimg)) {
         print_usage();
         break;
       }
-      check_if_block_device(bootimg);
-      open_bootimg(bootimg, "w");
-      update_header(bootimg);
-      update_images(bootimg);
-      if (check_boot_img_header(bootimg))
-        abort_printf("%s: Sanity cheks failed", bootimg->fname);
-      write_bootimg(bootimg);
+      run_command(bootimg, cmd);
+      break;
+
+    case diff:
+      run_command(bootimg, cmd);
+      if (bootimg->differs)
+        return 1;
+      break;
+
+    default:
+      run_command(bootimg, cmd);
       break;
   }
 
   return 0;
 }
-
-
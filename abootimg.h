@@ -0,0 +1,50 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* declarations shared between the abootimg modules */
+
+#ifndef _ABOOTIMG_H_
+#define _ABOOTIMG_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* image offsets are 64-bit, see _FILE_OFFSET_BITS in the Makefile */
+_Static_assert(sizeof(off_t) >= 8, "64-bit off_t needed");
+
+void abort_perror(char* str);
+void abort_printf(char *fmt, ...);
+
+/*
+ * While a batch job runs, fn(arg) is called should it fail before
+ * job_cleanup_pop(arg), to release what would outlive the job otherwise,
+ * such as threads. Outside of a job, an error exits and both do nothing.
+ */
+void job_cleanup_push(void (*fn)(void*), void* arg);
+void job_cleanup_pop(void* arg);
+
+/* progress messages, to stdout or to the output of the current batch job */
+void print_msg(char *fmt, ...);
+
+/* read size bytes at offset, aborting on a short file */
+void read_all(int fd, void* buf, size_t size, off_t offset, char* fname);
+
+/* write the whole buffer to a pipe or a file at its current position */
+void write_stream(int fd, const void* buf, size_t size, char* fname);
+
+#endif
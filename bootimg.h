@@ -19,12 +19,17 @@
 #define _BOOT_IMAGE_H_
 
 typedef struct boot_img_hdr boot_img_hdr;
+typedef struct boot_img_hdr_v3 boot_img_hdr_v3;
 
 #define BOOT_MAGIC "ANDROID!"
 #define BOOT_MAGIC_SIZE 8
 #define BOOT_NAME_SIZE 16
 #define BOOT_ARGS_SIZE 512
+#define BOOT_EXTRA_ARGS_SIZE 1024
 
+#define BOOT_IMAGE_HEADER_V3_PAGESIZE 4096
+
+/* versions 0 to 2: each one extends the previous one */
 struct boot_img_hdr
 {
     unsigned char magic[BOOT_MAGIC_SIZE];
@@ -40,14 +45,48 @@ struct boot_img_hdr
 
     unsigned tags_addr;    /* physical addr for kernel tags */
     unsigned page_size;    /* flash page size we assume */
-    unsigned unused[2];    /* future expansion: should be 0 */
+    unsigned header_version; /* was unused[0]: should be 0 before version 1 */
+    unsigned os_version;   /* was unused[1] */
 
     unsigned char name[BOOT_NAME_SIZE]; /* asciiz product name */
     
     unsigned char cmdline[BOOT_ARGS_SIZE];
 
     unsigned id[8]; /* timestamp / checksum / sha1 / etc */
-};
+
+    /* supplemental command line data, kept here to maintain
+     * binary compatibility with older versions of mkbootimg */
+    unsigned char extra_cmdline[BOOT_EXTRA_ARGS_SIZE];
+
+    /* version 1 */
+    unsigned recovery_dtbo_size;           /* size in bytes of recovery dtbo/acpio */
+    unsigned long long recovery_dtbo_offset; /* offset in the boot image */
+    unsigned header_size;                  /* of this header */
+
+    /* version 2 */
+    unsigned dtb_size;                     /* size in bytes of the dtb */
+    unsigned long long dtb_addr;           /* physical load addr */
+} __attribute__((packed));
+
+/* versions 3 and 4: the load addresses and the name moved to vendor_boot */
+struct boot_img_hdr_v3
+{
+    unsigned char magic[BOOT_MAGIC_SIZE];
+
+    unsigned kernel_size;  /* size in bytes */
+    unsigned ramdisk_size; /* size in bytes */
+
+    unsigned os_version;
+    unsigned header_size;  /* of this header */
+    unsigned reserved[4];
+
+    unsigned header_version; /* at the same offset as in the older headers */
+
+    unsigned char cmdline[BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE];
+
+    /* version 4 */
+    unsigned signature_size; /* size in bytes of the boot signature */
+} __attribute__((packed));
 
 /*
 ** +-----------------+ 
@@ -59,10 +98,16 @@ struct boot_img_hdr
 ** +-----------------+
 ** | second stage    | o pages
 ** +-----------------+
+** | recovery dtbo   | p pages (version 1 and 2)
+** +-----------------+
+** | dtb             | q pages (version 2)
+** +-----------------+
 **
 ** n = (kernel_size + page_size - 1) / page_size
 ** m = (ramdisk_size + page_size - 1) / page_size
 ** o = (second_size + page_size - 1) / page_size
+** p = (recovery_dtbo_size + page_size - 1) / page_size
+** q = (dtb_size + page_size - 1) / page_size
 **
 ** 0. all entities are page_size aligned in flash
 ** 1. kernel and ramdisk are required (size != 0)
@@ -74,6 +119,20 @@ struct boot_img_hdr
 ** 5. r0 = 0, r1 = MACHINE_TYPE, r2 = tags_addr
 ** 6. if second_size != 0: jump to second_addr
 **    else: jump to kernel_addr
+**
+** Version 3 and 4 images have 4096 byte pages, and only hold:
+**
+** +---------------------+
+** | boot header         | 4096 bytes
+** +---------------------+
+** | kernel              | n pages
+** +---------------------+
+** | ramdisk             | m pages (may be empty)
+** +---------------------+
+** | boot signature      | g pages (version 4)
+** +---------------------+
+**
+** g = (signature_size + 4096 - 1) / 4096
 */
 
 #if 0
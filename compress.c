@@ -0,0 +1,1083 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef HAS_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAS_ZSTD
+#include <zstd.h>
+#endif
+
+#include "abootimg.h"
+#include "compress.h"
+#include "stats.h"
+
+
+#define GZIP_BLOCK_SIZE (128*1024)  /* input bytes compressed by a gzip job */
+#define LZ4_BLOCK_SIZE  (1024*1024) /* by a lz4 job, 8M at most for the kernel */
+#define DICT_SIZE       (32*1024)   /* deflate window primed from the previous block */
+#define INPUT_SIZE      (256*1024)  /* compressed input read at a time */
+
+#define LZ4_LEGACY_MAGIC      0x184c2102
+#define LZ4_LEGACY_BLOCK_MAX  (8*1024*1024)
+#define LZ4_HASH_LOG          16
+
+
+
+static const struct {
+  enum codec          codec;
+  const char*         name;
+  int                 len;
+  const unsigned char magic[6];
+} codecs[] = {
+  { codec_gzip,      "gzip",         2, { 0x1f, 0x8b } },
+  { codec_lz4,       "lz4",          4, { 0x02, 0x21, 0x4c, 0x18 } },
+  { codec_zstd,      "zstd",         4, { 0x28, 0xb5, 0x2f, 0xfd } },
+  { codec_xz,        "xz",           6, { 0xfd, '7', 'z', 'X', 'Z', 0x00 } },
+  { codec_lzma,      "lzma",         3, { 0x5d, 0x00, 0x00 } },
+  { codec_bzip2,     "bzip2",        3, { 'B', 'Z', 'h' } },
+  { codec_lz4_frame, "lz4 (frame)",  4, { 0x04, 0x22, 0x4d, 0x18 } },
+  { codec_lzop,      "lzop",         4, { 0x89, 'L', 'Z', 'O' } },
+};
+#define NB_CODECS  (sizeof(codecs) / sizeof(codecs[0]))
+
+
+
+enum codec detect_codec(const void* buf, size_t size)
+{
+  unsigned i;
+
+  for (i=0; i<NB_CODECS; i++)
+    if ((size >= codecs[i].len) && !memcmp(buf, codecs[i].magic, codecs[i].len))
+      return codecs[i].codec;
+  return codec_unknown;
+}
+
+
+
+const char* codec_name(enum codec codec)
+{
+  unsigned i;
+
+  for (i=0; i<NB_CODECS; i++)
+    if (codecs[i].codec == codec)
+      return codecs[i].name;
+  return "unknown";
+}
+
+
+
+enum codec parse_codec(const char* name)
+{
+  unsigned i;
+
+  // only the ones abootimg can compress
+  for (i=0; i<NB_CODECS; i++)
+    if (!strcmp(codecs[i].name, name) && (codecs[i].codec <= codec_zstd))
+      return codecs[i].codec;
+  return codec_unknown;
+}
+
+
+
+#ifdef HAS_ZLIB
+
+static inline uint32_t read32(const unsigned char* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+
+
+static unsigned char* lz4_write_length(unsigned char* op, size_t len)
+{
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+
+
+/* the largest LZ4 block for size input bytes */
+static size_t lz4_bound(size_t size)
+{
+  return size + size/255 + 16;
+}
+
+
+
+/*
+ * Compress a LZ4 block, greedily with a single hash table, which is the
+ * "fast" level of the reference implementation. As required by the format,
+ * the last match starts 12 bytes before the end at least, and the last 5
+ * bytes are literals.
+ */
+static size_t lz4_compress_block(const unsigned char* src, size_t size, unsigned char* dst, uint32_t* table)
+{
+  const unsigned char* ip = src;
+  const unsigned char* anchor = src;
+  const unsigned char* end = src + size;
+  unsigned char* op = dst;
+
+  memset(table, 0, sizeof(uint32_t) << LZ4_HASH_LOG);
+
+  if (size >= 13) {
+    const unsigned char* mflimit = end - 12;
+    const unsigned char* matchlimit = end - 5;
+    unsigned misses = 0;
+
+    while (ip < mflimit) {
+      uint32_t seq = read32(ip);
+      uint32_t h = (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+      const unsigned char* ref = src + table[h];
+      table[h] = ip - src;
+
+      if ((ref >= ip) || (ip - ref > 65535) || (read32(ref) != seq)) {
+        // go faster through incompressible data
+        ip += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+
+      while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+        ip--;
+        ref--;
+      }
+      const unsigned char* p = ip + 4;
+      const unsigned char* r = ref + 4;
+      while ((p < matchlimit) && (*p == *r)) {
+        p++;
+        r++;
+      }
+
+      size_t lit = ip - anchor;
+      size_t mlen = p - ip - 4;
+      unsigned char* token = op++;
+      *token = (lit >= 15 ? 15 : lit) << 4;
+      if (lit >= 15)
+        op = lz4_write_length(op, lit - 15);
+      memcpy(op, anchor, lit);
+      op += lit;
+      *op++ = (ip - ref);
+      *op++ = (ip - ref) >> 8;
+      *token |= mlen >= 15 ? 15 : mlen;
+      if (mlen >= 15)
+        op = lz4_write_length(op, mlen - 15);
+
+      ip = anchor = p;
+    }
+  }
+
+  size_t lit = end - anchor;
+  *op++ = (lit >= 15 ? 15 : lit) << 4;
+  if (lit >= 15)
+    op = lz4_write_length(op, lit - 15);
+  memcpy(op, anchor, lit);
+  op += lit;
+
+  return op - dst;
+}
+
+
+
+/* decompress a LZ4 block, returns its size or -1 when corrupted */
+static long lz4_decompress_block(const unsigned char* src, size_t size, unsigned char* dst, size_t dst_size)
+{
+  const unsigned char* ip = src;
+  const unsigned char* iend = src + size;
+  unsigned char* op = dst;
+  unsigned char* oend = dst + dst_size;
+
+  while (ip < iend) {
+    unsigned token = *ip++;
+    size_t lit = token >> 4;
+    if (lit == 15) {
+      unsigned b;
+      do {
+        if (ip >= iend)
+          return -1;
+        b = *ip++;
+        lit += b;
+      } while (b == 255);
+    }
+    if ((lit > (size_t)(iend - ip)) || (lit > (size_t)(oend - op)))
+      return -1;
+    memcpy(op, ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == iend)
+      break;  // last literals
+
+    if (iend - ip < 2)
+      return -1;
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (!offset || (offset > (size_t)(op - dst)))
+      return -1;
+
+    size_t mlen = token & 15;
+    if (mlen == 15) {
+      unsigned b;
+      do {
+        if (ip >= iend)
+          return -1;
+        b = *ip++;
+        mlen += b;
+      } while (b == 255);
+    }
+    mlen += 4;
+    if (mlen > (size_t)(oend - op))
+      return -1;
+
+    // the match may overlap what it produces
+    const unsigned char* ref = op - offset;
+    while (mlen--)
+      *op++ = *ref++;
+  }
+
+  return op - dst;
+}
+
+
+
+enum job_state {
+  job_free,
+  job_pending,
+  job_running,
+  job_done
+};
+
+
+typedef struct
+{
+  enum job_state state;
+  int            last;
+
+  unsigned char* in;        /* dictionary followed by the block */
+  size_t         dict_len;
+  size_t         in_len;
+
+  unsigned char* out;
+  size_t         out_len;
+  size_t         out_size;
+
+  uLong          crc;
+  int            capture_fd; /* where the output is copied as well, or -1 */
+} t_job;
+
+
+struct t_compressor
+{
+  enum codec      codec;
+  int             fd;
+  char*           fname;
+  size_t          block_size;
+
+  int             nb_threads;
+  pthread_t*      threads;
+  int             quit;
+
+  pthread_mutex_t lock;
+  pthread_cond_t  pending;  /* a job was queued, or quit */
+  pthread_cond_t  done;     /* a job completed */
+
+  int             nb_jobs;
+  t_job*          jobs;
+  int             head;     /* job being filled */
+  int             tail;     /* oldest job not written yet */
+
+  uLong           crc;
+  unsigned long   isize;
+
+  int             capture_fd;      /* of the member being written */
+  int             out_capture_fd;  /* of the member being output */
+  uLong           capture_crc;
+  unsigned long long capture_len;
+
+#ifdef HAS_ZSTD
+  ZSTD_CCtx*      zstd;     /* multithreaded by the library itself */
+  unsigned char*  zstd_out;
+  size_t          zstd_out_size;
+#endif
+};
+
+
+
+static void grow_job_output(t_job* job, size_t size)
+{
+  if (size > job->out_size) {
+    free(job->out);
+    job->out = malloc(size);
+    if (!job->out)
+      abort_perror(NULL);
+    job->out_size = size;
+  }
+}
+
+
+
+/*
+ * gzip: each block is a raw deflate stream ending on a byte boundary, the
+ * last one excepted, so that once concatenated they form a single deflate
+ * stream.
+ */
+static void deflate_job(t_compressor* c, z_stream* strm, t_job* job)
+{
+  deflateReset(strm);
+  if (job->dict_len)
+    deflateSetDictionary(strm, job->in, job->dict_len);
+
+  grow_job_output(job, deflateBound(strm, job->in_len) + 16);
+
+  strm->next_in = job->in + job->dict_len;
+  strm->avail_in = job->in_len;
+  strm->next_out = job->out;
+  strm->avail_out = job->out_size;
+  int ret = deflate(strm, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+  if ((ret != Z_OK) && (ret != Z_STREAM_END))
+    abort_printf("%s: compression failed\n", c->fname);
+  job->out_len = job->out_size - strm->avail_out;
+  job->crc = crc32(crc32(0L, Z_NULL, 0), job->in + job->dict_len, job->in_len);
+}
+
+
+
+/* lz4 legacy: each block is stored after its compressed size */
+static void lz4_job(t_compressor* c, uint32_t* table, t_job* job)
+{
+  size_t len;
+  int i;
+
+  job->out_len = 0;
+  job->crc = 0;
+  if (!job->in_len)
+    return;
+
+  grow_job_output(job, 4 + lz4_bound(job->in_len));
+  len = lz4_compress_block(job->in + job->dict_len, job->in_len, job->out + 4, table);
+  for (i=0; i<4; i++)
+    job->out[i] = len >> (8*i);
+  job->out_len = 4 + len;
+}
+
+
+
+static void* compress_worker(void* arg)
+{
+  t_compressor* c = arg;
+  uint32_t* table = NULL;
+  z_stream strm;
+
+  memset(&strm, 0, sizeof(strm));
+  if (c->codec == codec_gzip) {
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      abort_printf("%s: cannot initialize compression\n", c->fname);
+  }
+  else {
+    table = malloc(sizeof(uint32_t) << LZ4_HASH_LOG);
+    if (!table)
+      abort_perror(NULL);
+  }
+
+  pthread_mutex_lock(&c->lock);
+  for (;;) {
+    t_job* job = NULL;
+    int i;
+
+    for (i=0; i<c->nb_jobs; i++) {
+      t_job* j = &c->jobs[(c->tail + i) % c->nb_jobs];
+      if (j->state == job_pending) {
+        job = j;
+        break;
+      }
+    }
+    if (!job) {
+      if (c->quit)
+        break;
+      pthread_cond_wait(&c->pending, &c->lock);
+      continue;
+    }
+    job->state = job_running;
+    pthread_mutex_unlock(&c->lock);
+
+    if (c->codec == codec_gzip)
+      deflate_job(c, &strm, job);
+    else
+      lz4_job(c, table, job);
+
+    pthread_mutex_lock(&c->lock);
+    job->state = job_done;
+    pthread_cond_broadcast(&c->done);
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  if (c->codec == codec_gzip)
+    deflateEnd(&strm);
+  free(table);
+  return NULL;
+}
+
+
+
+/* complete a captured member with its crc and uncompressed length */
+static void end_capture(t_compressor* c)
+{
+  unsigned char trailer[12];
+  int i;
+
+  if (c->out_capture_fd == -1)
+    return;
+
+  for (i=0; i<4; i++)
+    trailer[i] = c->capture_crc >> (8*i);
+  for (i=0; i<8; i++)
+    trailer[4+i] = c->capture_len >> (8*i);
+  write_stream(c->out_capture_fd, trailer, sizeof(trailer), c->fname);
+  if (close(c->out_capture_fd))
+    abort_perror(c->fname);
+  c->out_capture_fd = -1;
+}
+
+
+
+/* write the oldest job once compressed, and make its slot free */
+static void write_oldest_job(t_compressor* c)
+{
+  t_job* job = &c->jobs[c->tail];
+
+  pthread_mutex_lock(&c->lock);
+  while (job->state != job_done)
+    pthread_cond_wait(&c->done, &c->lock);
+  pthread_mutex_unlock(&c->lock);
+
+  write_stream(c->fd, job->out, job->out_len, c->fname);
+  c->crc = crc32_combine(c->crc, job->crc, job->in_len);
+  c->isize += job->in_len;
+
+  if (job->capture_fd != c->out_capture_fd) {
+    end_capture(c);
+    c->out_capture_fd = job->capture_fd;
+    c->capture_crc = crc32(0L, Z_NULL, 0);
+    c->capture_len = 0;
+  }
+  if (job->capture_fd != -1) {
+    write_stream(job->capture_fd, job->out, job->out_len, c->fname);
+    c->capture_crc = crc32_combine(c->capture_crc, job->crc, job->in_len);
+    c->capture_len += job->in_len;
+  }
+
+  job->state = job_free;
+  c->tail = (c->tail + 1) % c->nb_jobs;
+}
+
+
+
+/* queue the job being filled, and start the next one */
+static void submit_job(t_compressor* c, int last)
+{
+  t_job* job = &c->jobs[c->head];
+
+  pthread_mutex_lock(&c->lock);
+  job->last = last;
+  job->capture_fd = c->capture_fd;
+  job->state = job_pending;
+  pthread_cond_signal(&c->pending);
+  pthread_mutex_unlock(&c->lock);
+
+  if (last)
+    return;
+
+  c->head = (c->head + 1) % c->nb_jobs;
+  t_job* next = &c->jobs[c->head];
+  if (next->state != job_free)
+    write_oldest_job(c);
+
+  // prime the next block with the end of this one, lz4 blocks being
+  // independent from each other
+  next->dict_len = job->in_len < DICT_SIZE ? job->in_len : DICT_SIZE;
+  if (c->codec != codec_gzip)
+    next->dict_len = 0;
+  memcpy(next->in, job->in + job->dict_len + job->in_len - next->dict_len, next->dict_len);
+  next->in_len = 0;
+}
+
+
+
+#ifdef HAS_ZSTD
+static void zstd_compress(t_compressor* c, const void* buf, size_t size, ZSTD_EndDirective mode)
+{
+  ZSTD_inBuffer in = { buf, size, 0 };
+
+  for (;;) {
+    ZSTD_outBuffer out = { c->zstd_out, c->zstd_out_size, 0 };
+    size_t left = ZSTD_compressStream2(c->zstd, &out, &in, mode);
+    if (ZSTD_isError(left))
+      abort_printf("%s: %s\n", c->fname, ZSTD_getErrorName(left));
+    write_stream(c->fd, c->zstd_out, out.pos, c->fname);
+    if ((mode == ZSTD_e_end) ? !left : (in.pos == in.size))
+      break;
+  }
+}
+#endif
+
+#endif /* HAS_ZLIB */
+
+
+
+#ifdef HAS_ZLIB
+/*
+ * Release a compressor left open by a failed job: the workers are stopped
+ * and the captures closed, the output being abandoned where it is.
+ */
+static void compressor_abort(void* arg)
+{
+  t_compressor* c = arg;
+  int i;
+
+#ifdef HAS_ZSTD
+  if (c->zstd) {
+    ZSTD_freeCCtx(c->zstd);
+    free(c->zstd_out);
+    free(c);
+    return;
+  }
+#endif
+
+  pthread_mutex_lock(&c->lock);
+  c->quit = 1;
+  pthread_cond_broadcast(&c->pending);
+  pthread_mutex_unlock(&c->lock);
+  for (i=0; i<c->nb_threads; i++)
+    pthread_join(c->threads[i], NULL);
+
+  // a member runs over consecutive jobs, up to the one being filled
+  int last_fd = c->out_capture_fd;
+  if (last_fd != -1)
+    close(last_fd);
+  for (i=0; i<=c->nb_jobs; i++) {
+    t_job* job = &c->jobs[(c->tail + i) % c->nb_jobs];
+    int fd = (i < c->nb_jobs) ? ((job->state != job_free) ? job->capture_fd : -1) : c->capture_fd;
+    if ((fd != -1) && (fd != last_fd))
+      close(fd);
+    if (fd != -1)
+      last_fd = fd;
+  }
+  for (i=0; i<c->nb_jobs; i++) {
+    free(c->jobs[i].in);
+    free(c->jobs[i].out);
+  }
+  free(c->jobs);
+  free(c->threads);
+  pthread_mutex_destroy(&c->lock);
+  pthread_cond_destroy(&c->pending);
+  pthread_cond_destroy(&c->done);
+  free(c);
+}
+#endif
+
+
+
+t_compressor* compressor_open(enum codec codec, int fd, char* fname, int nb_threads)
+{
+#ifdef HAS_ZLIB
+  static const unsigned char gzip_header[10] = {
+    0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 /* unix */
+  };
+  static const unsigned char lz4_header[4] = { 0x02, 0x21, 0x4c, 0x18 };
+  int i;
+
+  if ((codec != codec_gzip) && (codec != codec_lz4) && (codec != codec_zstd))
+    abort_printf("%s: %s compression not supported\n", fname, codec_name(codec));
+#ifndef HAS_ZSTD
+  if (codec == codec_zstd)
+    abort_printf("%s: zstd compression not supported in this build\n", fname);
+#endif
+
+  t_compressor* c = calloc(sizeof(t_compressor), 1);
+  if (!c)
+    abort_perror(NULL);
+
+  if (nb_threads <= 0)
+    nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nb_threads <= 0)
+    nb_threads = 1;
+
+  c->codec = codec;
+  c->fd = fd;
+  c->fname = fname;
+  c->crc = crc32(0L, Z_NULL, 0);
+  c->capture_fd = -1;
+  c->out_capture_fd = -1;
+
+#ifdef HAS_ZSTD
+  if (codec == codec_zstd) {
+    c->zstd = ZSTD_createCCtx();
+    c->zstd_out_size = ZSTD_CStreamOutSize();
+    c->zstd_out = malloc(c->zstd_out_size);
+    if (!c->zstd || !c->zstd_out)
+      abort_perror(NULL);
+    // fails when libzstd is built without threads, compressing on one core
+    ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_nbWorkers, nb_threads);
+    job_cleanup_push(compressor_abort, c);
+    return c;
+  }
+#endif
+
+  c->block_size = (codec == codec_gzip) ? GZIP_BLOCK_SIZE : LZ4_BLOCK_SIZE;
+  c->nb_threads = nb_threads;
+  c->nb_jobs = 2 * nb_threads;
+
+  c->jobs = calloc(sizeof(t_job), c->nb_jobs);
+  c->threads = calloc(sizeof(pthread_t), nb_threads);
+  if (!c->jobs || !c->threads)
+    abort_perror(NULL);
+  for (i=0; i<c->nb_jobs; i++) {
+    c->jobs[i].in = malloc(DICT_SIZE + c->block_size);
+    if (!c->jobs[i].in)
+      abort_perror(NULL);
+  }
+
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->pending, NULL);
+  pthread_cond_init(&c->done, NULL);
+  for (i=0; i<nb_threads; i++)
+    if ((errno = pthread_create(&c->threads[i], NULL, compress_worker, c))) {
+      int err = errno;
+      c->nb_threads = i;
+      compressor_abort(c);
+      errno = err;
+      abort_perror("pthread_create");
+    }
+  job_cleanup_push(compressor_abort, c);
+
+  if (codec == codec_gzip)
+    write_stream(fd, gzip_header, sizeof(gzip_header), fname);
+  else
+    write_stream(fd, lz4_header, sizeof(lz4_header), fname);
+  return c;
+#else
+  abort_printf("%s: compression support not compiled in\n", fname);
+  return NULL;
+#endif
+}
+
+
+
+void compressor_write(t_compressor* c, const void* buf, size_t size)
+{
+#ifdef HAS_ZLIB
+  const unsigned char* p = buf;
+
+#ifdef HAS_ZSTD
+  if (c->zstd) {
+    zstd_compress(c, buf, size, ZSTD_e_continue);
+    return;
+  }
+#endif
+
+  while (size) {
+    t_job* job = &c->jobs[c->head];
+    size_t len = c->block_size - job->in_len;
+    if (len > size)
+      len = size;
+
+    memcpy(job->in + job->dict_len + job->in_len, p, len);
+    job->in_len += len;
+    p += len;
+    size -= len;
+
+    if (job->in_len == c->block_size)
+      submit_job(c, 0);
+  }
+#endif
+}
+
+
+
+void compressor_member(t_compressor* c, int capture_fd)
+{
+#ifdef HAS_ZLIB
+  if ((capture_fd != -1) && (c->codec != codec_gzip))
+    abort_printf("%s: members can only be captured with gzip\n", c->fname);
+  if (c->codec == codec_zstd)
+    return;
+
+  if (c->jobs[c->head].in_len)
+    submit_job(c, 0);
+  c->jobs[c->head].dict_len = 0;
+  c->capture_fd = capture_fd;
+#endif
+}
+
+
+
+void compressor_write_deflated(t_compressor* c, const void* buf, size_t size,
+                               unsigned long crc, unsigned long long len)
+{
+#ifdef HAS_ZLIB
+  if (c->codec != codec_gzip)
+    abort_printf("%s: deflated data can only be written with gzip\n", c->fname);
+  compressor_member(c, -1);
+
+  // queued as an already compressed job, to keep the output order
+  t_job* job = &c->jobs[c->head];
+  grow_job_output(job, size);
+  memcpy(job->out, buf, size);
+  job->out_len = size;
+  job->crc = crc;
+  job->in_len = len;
+  job->capture_fd = -1;
+
+  pthread_mutex_lock(&c->lock);
+  job->state = job_done;
+  pthread_mutex_unlock(&c->lock);
+
+  c->head = (c->head + 1) % c->nb_jobs;
+  t_job* next = &c->jobs[c->head];
+  if (next->state != job_free)
+    write_oldest_job(c);
+  next->dict_len = 0;
+  next->in_len = 0;
+#endif
+}
+
+
+
+void compressor_close(t_compressor* c)
+{
+#ifdef HAS_ZLIB
+  int i;
+
+#ifdef HAS_ZSTD
+  if (c->zstd) {
+    zstd_compress(c, NULL, 0, ZSTD_e_end);
+    job_cleanup_pop(c);
+    ZSTD_freeCCtx(c->zstd);
+    free(c->zstd_out);
+    free(c);
+    return;
+  }
+#endif
+
+  // flush every queued job, up to the last one
+  submit_job(c, 1);
+  for (;;) {
+    int last = (c->tail == c->head);
+    write_oldest_job(c);
+    if (last)
+      break;
+  }
+  end_capture(c);
+
+  if (c->codec == codec_gzip) {
+    unsigned char trailer[8];
+    for (i=0; i<4; i++) {
+      trailer[i] = c->crc >> (8*i);
+      trailer[4+i] = c->isize >> (8*i);
+    }
+    write_stream(c->fd, trailer, sizeof(trailer), c->fname);
+  }
+  job_cleanup_pop(c);
+
+  pthread_mutex_lock(&c->lock);
+  c->quit = 1;
+  pthread_cond_broadcast(&c->pending);
+  pthread_mutex_unlock(&c->lock);
+  for (i=0; i<c->nb_threads; i++)
+    pthread_join(c->threads[i], NULL);
+
+  for (i=0; i<c->nb_jobs; i++) {
+    free(c->jobs[i].in);
+    free(c->jobs[i].out);
+  }
+  free(c->jobs);
+  free(c->threads);
+  pthread_mutex_destroy(&c->lock);
+  pthread_cond_destroy(&c->pending);
+  pthread_cond_destroy(&c->done);
+  free(c);
+#endif
+}
+
+
+
+#ifdef HAS_ZLIB
+
+struct t_decompressor
+{
+  enum codec         codec;
+  int                fd;
+  char*              fname;
+  off_t              offset;     /* next compressed byte to read */
+  unsigned long long remaining;  /* compressed bytes not read yet */
+  int                end;
+
+  unsigned char      in[INPUT_SIZE];
+  z_stream           strm;
+
+  unsigned char*     block;      /* lz4: current uncompressed block */
+  size_t             block_len;
+  size_t             block_pos;
+  unsigned char*     cblock;
+
+#ifdef HAS_ZSTD
+  ZSTD_DCtx*         zstd;
+  ZSTD_inBuffer      zin;
+#endif
+};
+
+
+
+/* refill the input buffer, returns 0 once all the section is consumed */
+static int fill_input(t_decompressor* d)
+{
+  size_t len = d->remaining < INPUT_SIZE ? d->remaining : INPUT_SIZE;
+  if (!len)
+    return 0;
+
+  ssize_t rb;
+  do
+    rb = pread(d->fd, d->in, len, d->offset);
+  while ((rb < 0) && (errno == EINTR));
+  if (rb < 0)
+    abort_perror(d->fname);
+  if (!rb)
+    abort_printf("%s: unexpected end of file\n", d->fname);
+  stats_read(rb);
+
+  d->offset += rb;
+  d->remaining -= rb;
+  d->strm.next_in = d->in;
+  d->strm.avail_in = rb;
+#ifdef HAS_ZSTD
+  d->zin.src = d->in;
+  d->zin.size = rb;
+  d->zin.pos = 0;
+#endif
+  return 1;
+}
+
+
+
+/* read the next lz4 block, returns 0 at the end of the stream */
+static int read_lz4_block(t_decompressor* d)
+{
+  unsigned char size[4];
+
+  for (;;) {
+    if (d->remaining < sizeof(size))
+      return 0;   // padding
+    read_all(d->fd, size, sizeof(size), d->offset, d->fname);
+    d->offset += sizeof(size);
+    d->remaining -= sizeof(size);
+
+    uint32_t len = size[0] | (size[1] << 8) | (size[2] << 16) | ((uint32_t)size[3] << 24);
+    if (!len)
+      return 0;
+    if (len == LZ4_LEGACY_MAGIC)
+      continue;   // concatenated streams
+    if ((len > lz4_bound(LZ4_LEGACY_BLOCK_MAX)) || (len > d->remaining))
+      abort_printf("%s: corrupted lz4 data\n", d->fname);
+
+    read_all(d->fd, d->cblock, len, d->offset, d->fname);
+    d->offset += len;
+    d->remaining -= len;
+
+    long ret = lz4_decompress_block(d->cblock, len, d->block, LZ4_LEGACY_BLOCK_MAX);
+    if (ret < 0)
+      abort_printf("%s: corrupted lz4 data\n", d->fname);
+    d->block_len = ret;
+    d->block_pos = 0;
+    return 1;
+  }
+}
+
+#endif /* HAS_ZLIB */
+
+
+
+t_decompressor* decompressor_open(int fd, off_t offset, unsigned long long size, char* fname)
+{
+#ifdef HAS_ZLIB
+  t_decompressor* d = malloc(sizeof(t_decompressor));
+  if (!d)
+    abort_perror(NULL);
+  memset(d, 0, sizeof(t_decompressor));
+
+  d->fd = fd;
+  d->fname = fname;
+  d->offset = offset;
+  d->remaining = size;
+
+  if (!fill_input(d))
+    abort_printf("%s: empty compressed section\n", fname);
+  d->codec = detect_codec(d->in, d->strm.avail_in);
+
+  switch (d->codec) {
+    case codec_gzip:
+      // gzip header detection
+      if (inflateInit2(&d->strm, 15 + 16) != Z_OK)
+        abort_printf("%s: cannot initialize decompression\n", fname);
+      break;
+
+    case codec_lz4:
+      // blocks are read straight from the file
+      d->offset = offset + 4;
+      d->remaining = size - 4;
+      d->block = malloc(LZ4_LEGACY_BLOCK_MAX);
+      d->cblock = malloc(lz4_bound(LZ4_LEGACY_BLOCK_MAX));
+      if (!d->block || !d->cblock)
+        abort_perror(NULL);
+      break;
+
+#ifdef HAS_ZSTD
+    case codec_zstd:
+      d->zstd = ZSTD_createDCtx();
+      if (!d->zstd)
+        abort_perror(NULL);
+      break;
+#endif
+
+    case codec_unknown:
+      abort_printf("%s: not a compressed ramdisk\n", fname);
+      break;
+
+    default:
+      abort_printf("%s: %s compressed ramdisks are not supported\n", fname, codec_name(d->codec));
+  }
+
+  return d;
+#else
+  abort_printf("%s: compression support not compiled in\n", fname);
+  return NULL;
+#endif
+}
+
+
+
+enum codec decompressor_codec(t_decompressor* d)
+{
+#ifdef HAS_ZLIB
+  return d->codec;
+#else
+  return codec_unknown;
+#endif
+}
+
+
+
+size_t decompressor_read(t_decompressor* d, void* buf, size_t size)
+{
+#ifdef HAS_ZLIB
+  unsigned char* p = buf;
+  size_t done = 0;
+
+  if (d->codec == codec_lz4) {
+    while ((done < size) && !d->end) {
+      if ((d->block_pos == d->block_len) && !read_lz4_block(d)) {
+        d->end = 1;
+        break;
+      }
+      size_t len = d->block_len - d->block_pos;
+      if (len > size - done)
+        len = size - done;
+      memcpy(p + done, d->block + d->block_pos, len);
+      d->block_pos += len;
+      done += len;
+    }
+    return done;
+  }
+
+#ifdef HAS_ZSTD
+  if (d->codec == codec_zstd) {
+    ZSTD_outBuffer out = { buf, size, 0 };
+    while ((out.pos < out.size) && !d->end) {
+      if ((d->zin.pos == d->zin.size) && !fill_input(d)) {
+        d->end = 1;
+        break;
+      }
+      size_t ret = ZSTD_decompressStream(d->zstd, &out, &d->zin);
+      if (ZSTD_isError(ret))
+        abort_printf("%s: %s\n", d->fname, ZSTD_getErrorName(ret));
+      // a frame is complete, another one may follow, the rest is padding
+      if (!ret && (d->zin.pos < d->zin.size) &&
+          (detect_codec(d->in + d->zin.pos, d->zin.size - d->zin.pos) != codec_zstd))
+        d->end = 1;
+    }
+    return out.pos;
+  }
+#endif
+
+  d->strm.next_out = buf;
+  d->strm.avail_out = size;
+
+  while (d->strm.avail_out && !d->end) {
+    if (!d->strm.avail_in && !fill_input(d))
+      abort_printf("%s: truncated compressed data\n", d->fname);
+
+    int ret = inflate(&d->strm, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      // another member may follow, the rest is padding
+      if (!d->strm.avail_in && !fill_input(d))
+        d->end = 1;
+      else if ((d->strm.avail_in >= 2) && (d->strm.next_in[0] == 0x1f) && (d->strm.next_in[1] == 0x8b))
+        inflateReset(&d->strm);
+      else
+        d->end = 1;
+    }
+    else if ((ret != Z_OK) && (ret != Z_BUF_ERROR))
+      abort_printf("%s: corrupted compressed data\n", d->fname);
+  }
+
+  return size - d->strm.avail_out;
+#else
+  return 0;
+#endif
+}
+
+
+
+void decompressor_close(t_decompressor* d)
+{
+#ifdef HAS_ZLIB
+  if (d->codec == codec_gzip)
+    inflateEnd(&d->strm);
+#ifdef HAS_ZSTD
+  if (d->zstd)
+    ZSTD_freeDCtx(d->zstd);
+#endif
+  free(d->block);
+  free(d->cblock);
+  free(d);
+#endif
+}
@@ -0,0 +1,81 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* streaming compression of ramdisks */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <sys/types.h>
+
+typedef struct t_compressor t_compressor;
+typedef struct t_decompressor t_decompressor;
+
+enum codec {
+  codec_gzip,
+  codec_lz4,        /* legacy format, as used by the kernel */
+  codec_zstd,
+  codec_xz,
+  codec_lzma,
+  codec_bzip2,
+  codec_lz4_frame,
+  codec_lzop,
+  codec_unknown
+};
+
+/* recognize a compressed stream from its first bytes */
+enum codec detect_codec(const void* buf, size_t size);
+const char* codec_name(enum codec codec);
+/* codec_unknown if name is not one abootimg can compress with */
+enum codec parse_codec(const char* name);
+
+/*
+ * Compress everything written to the compressor into fd (a pipe or a file
+ * written sequentially). The stream is cut in blocks compressed in
+ * parallel by nb_threads workers (0: one per CPU), and stitched back into
+ * a single standard stream, as pigz does. zstd is left to libzstd's own
+ * workers.
+ */
+t_compressor* compressor_open(enum codec codec, int fd, char* fname, int nb_threads);
+void compressor_write(t_compressor* c, const void* buf, size_t size);
+void compressor_close(t_compressor* c);
+
+/*
+ * Start a member: the data written next is compressed independently of
+ * what precedes it, and its compressed form is also copied to capture_fd
+ * (unless -1) up to the next member, followed by its crc32 (4 bytes) and
+ * length (8 bytes) in little endian. capture_fd is closed by the compressor.
+ * Such a member can be put back in another stream with
+ * compressor_write_deflated(), given its crc32 and length for the last piece
+ * (0 for the previous ones).
+ */
+void compressor_member(t_compressor* c, int capture_fd);
+void compressor_write_deflated(t_compressor* c, const void* buf, size_t size,
+                               unsigned long crc, unsigned long long len);
+
+/*
+ * Decompress the size bytes found at offset in fd. The codec is detected
+ * from the data: gzip, lz4 and zstd (with HAS_ZSTD) are supported.
+ */
+t_decompressor* decompressor_open(int fd, off_t offset, unsigned long long size, char* fname);
+enum codec decompressor_codec(t_decompressor* d);
+/* read up to size bytes, returns 0 at the end of the stream */
+size_t decompressor_read(t_decompressor* d, void* buf, size_t size);
+void decompressor_close(t_decompressor* d);
+
+#endif
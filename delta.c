@@ -0,0 +1,622 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "abootimg.h"
+#include "delta.h"
+
+
+/*
+ * The new sections are matched against the whole old image: blocks of the
+ * old sections are indexed by a rolling hash, looked up at every offset of
+ * the new ones, and exact matches are extended both ways to become copies.
+ * Past an exact match, the bytes which mostly agree with the old ones at
+ * the same distance (code whose addresses moved, ...) are given as their
+ * difference to them, mostly zeros, as bsdiff does. The rest is new data.
+ * The operations are compressed with gzip, when built with zlib.
+ */
+
+#define DELTA_BLOCK    64          /* indexed block, and shortest match */
+#define DELTA_PROBES   8           /* blocks tried for the same hash */
+#define DELTA_SLACK    256         /* an approximate match ends after as many bytes without gain */
+#define DELTA_CHUNK    (64*1024)
+#define DELTA_PRIME    0x01000193u
+
+
+typedef struct
+{
+  char*              fname;
+  int                fd;
+  unsigned long long size;
+  boot_img_hdr       hdr;
+  t_bootimg_layout   layout;
+  char*              map;
+  int                mapped;      /* map is a mmap(), a copy otherwise */
+} t_delta_image;
+
+typedef struct
+{
+  uint32_t           hash;
+  uint32_t           block;       /* offset / DELTA_BLOCK + 1, 0 when free */
+} t_delta_slot;
+
+typedef struct
+{
+  t_delta_image*     old;
+  t_delta_slot*      slots;
+  unsigned long long mask;
+  uint32_t           prime_pow;   /* DELTA_PRIME^(DELTA_BLOCK-1) */
+
+  int                fd;
+  char*              fname;
+  t_compressor*      c;
+  char*              buf;
+
+  unsigned long long copied;
+  unsigned long long added;
+  unsigned long long literal;
+} t_delta_writer;
+
+static void open_image(t_delta_image* d, char* fname)
+{
+  d->fname = fname;
+  d->fd = open(fname, O_RDONLY);
+  if (d->fd == -1)
+    abort_perror(fname);
+
+  enum bootimg_status status = bootimg_read_header(d->fd, &d->hdr, &d->size);
+  if (status == bootimg_err_io)
+    abort_perror(fname);
+  if (status)
+    abort_printf("%s: %s\n", fname, bootimg_strerror(status));
+  bootimg_get_layout(&d->hdr, &d->layout);
+
+  // matches are looked for anywhere: the image has to be at hand
+  void* p = mmap(NULL, d->size, PROT_READ, MAP_SHARED, d->fd, 0);
+  if (p != MAP_FAILED) {
+    d->map = p;
+    d->mapped = 1;
+    return;
+  }
+  if (!(d->map = malloc(d->size)))
+    abort_perror(NULL);
+  read_all(d->fd, d->map, d->size, 0, fname);
+}
+
+
+
+static void close_image(t_delta_image* d)
+{
+  if (d->mapped)
+    munmap(d->map, d->size);
+  else
+    free(d->map);
+  close(d->fd);
+}
+
+
+
+static uint32_t block_hash(const unsigned char* p)
+{
+  uint32_t h = 0;
+  int i;
+
+  for (i=0; i<DELTA_BLOCK; i++)
+    h = h * DELTA_PRIME + p[i];
+  return h;
+}
+
+
+
+static unsigned long long slot_of(t_delta_writer* w, uint32_t hash)
+{
+  return (hash ^ (hash >> 15)) * 0x9e3779b1ull & w->mask;
+}
+
+
+
+static void index_old_image(t_delta_writer* w)
+{
+  t_delta_image* old = w->old;
+  unsigned long long nb_blocks = 0;
+  unsigned long long nb_slots = 1024;
+  int s, i;
+
+  for (s=0; s<bootimg_nb_sections; s++)
+    nb_blocks += old->layout.sections[s].size / DELTA_BLOCK;
+  while (nb_slots < 2 * nb_blocks)
+    nb_slots *= 2;
+
+  w->slots = calloc(nb_slots, sizeof(t_delta_slot));
+  if (!w->slots)
+    abort_perror(NULL);
+  w->mask = nb_slots - 1;
+
+  w->prime_pow = 1;
+  for (i=1; i<DELTA_BLOCK; i++)
+    w->prime_pow *= DELTA_PRIME;
+
+  // sections start on page boundaries, so do the blocks
+  for (s=0; s<bootimg_nb_sections; s++) {
+    t_bootimg_extent* e = &old->layout.sections[s];
+    unsigned long long off;
+    for (off = e->offset; off + DELTA_BLOCK <= e->offset + e->size; off += DELTA_BLOCK) {
+      uint32_t h = block_hash((unsigned char*)old->map + off);
+      unsigned long long j = slot_of(w, h);
+      // the first blocks of a given content are kept, the others dropped
+      for (i=0; (i<DELTA_PROBES) && w->slots[j].block; i++)
+        j = (j+1) & w->mask;
+      if (i < DELTA_PROBES) {
+        w->slots[j].hash = h;
+        w->slots[j].block = off / DELTA_BLOCK + 1;
+      }
+    }
+  }
+}
+
+
+
+/* the old section holding offset, NULL if in none */
+static t_bootimg_extent* section_at(t_delta_image* d, unsigned long long offset)
+{
+  int s;
+
+  for (s=0; s<bootimg_nb_sections; s++) {
+    t_bootimg_extent* e = &d->layout.sections[s];
+    if ((offset >= e->offset) && (offset < e->offset + e->size))
+      return e;
+  }
+  return NULL;
+}
+
+
+
+/*
+ * Longest exact match of the len bytes at p among the old blocks of the
+ * same hash, at least a block long. Returns its length, 0 if none.
+ */
+static size_t find_match(t_delta_writer* w, uint32_t h, const char* p, size_t len,
+                         unsigned long long* match)
+{
+  const char* map = w->old->map;
+  unsigned long long j = slot_of(w, h);
+  size_t best = 0;
+  int i;
+
+  for (i=0; (i<DELTA_PROBES) && w->slots[j].block; i++, j = (j+1) & w->mask) {
+    if (w->slots[j].hash != h)
+      continue;
+    unsigned long long off = (unsigned long long)(w->slots[j].block - 1) * DELTA_BLOCK;
+    if (memcmp(map + off, p, DELTA_BLOCK))
+      continue;
+    t_bootimg_extent* e = section_at(w->old, off);
+    size_t max = e->offset + e->size - off;
+    if (max > len)
+      max = len;
+    size_t n = DELTA_BLOCK;
+    while ((n < max) && (map[off+n] == p[n]))
+      n++;
+    if (n > best) {
+      best = n;
+      *match = off;
+    }
+  }
+  return best;
+}
+
+
+
+/*
+ * How far the bytes at p keep mostly matching those at old, scored as
+ * bsdiff does: twice the equal bytes, less the length. It ends before a
+ * block long run of equal bytes, left to be found as an exact match.
+ */
+static size_t approx_match(const char* p, const char* old, size_t max)
+{
+  long long score = 0, best_score = 0;
+  size_t best = 0;
+  size_t last_diff = 0;
+  size_t i;
+
+  for (i=0; i<max; i++) {
+    if (p[i] != old[i]) {
+      score--;
+      last_diff = i;
+    }
+    else if (i - last_diff >= DELTA_BLOCK)
+      break;
+    else if (++score > best_score) {
+      best_score = score;
+      best = i+1;
+    }
+    if (i+1 - best > DELTA_SLACK)
+      break;
+  }
+  return best > last_diff + 1 ? last_diff + 1 : best;
+}
+
+
+
+static void put(t_delta_writer* w, const void* buf, size_t size)
+{
+  if (w->c)
+    compressor_write(w->c, buf, size);
+  else
+    write_stream(w->fd, buf, size, w->fname);
+}
+
+
+
+static void put_op(t_delta_writer* w, enum delta_op_type type, unsigned long long offset, size_t size)
+{
+  t_delta_op op;
+
+  memset(&op, 0, sizeof(op));
+  op.type = type;
+  op.size = size;
+  op.offset = offset;
+  put(w, &op, sizeof(op));
+}
+
+
+
+static void put_data(t_delta_writer* w, const char* p, size_t size)
+{
+  if (!size)
+    return;
+  put_op(w, delta_data, 0, size);
+  put(w, p, size);
+  w->literal += size;
+}
+
+
+
+static void put_add(t_delta_writer* w, unsigned long long offset, const char* p, size_t size)
+{
+  const char* old = w->old->map + offset;
+  size_t done, i;
+
+  put_op(w, delta_add, offset, size);
+  for (done = 0; done < size; done += DELTA_CHUNK) {
+    size_t len = size - done < DELTA_CHUNK ? size - done : DELTA_CHUNK;
+    for (i=0; i<len; i++)
+      w->buf[i] = p[done+i] - old[done+i];
+    put(w, w->buf, len);
+  }
+  w->added += size;
+}
+
+
+
+static void delta_section(t_delta_writer* w, const char* p, size_t len)
+{
+  const char* map = w->old->map;
+  const unsigned char* u = (const unsigned char*)p;
+  size_t pos = 0;
+  size_t lit = 0;         // start of the data not matched yet
+  uint32_t h = 0;
+
+  if (len >= DELTA_BLOCK)
+    h = block_hash(u);
+
+  while (pos + DELTA_BLOCK <= len) {
+    unsigned long long match = 0;
+    size_t n = find_match(w, h, p + pos, len - pos, &match);
+
+    if (!n) {
+      if (pos + DELTA_BLOCK < len)
+        h = (h - u[pos] * w->prime_pow) * DELTA_PRIME + u[pos + DELTA_BLOCK];
+      pos++;
+      continue;
+    }
+
+    // the start of the match was skipped while rolling
+    t_bootimg_extent* e = section_at(w->old, match);
+    unsigned long long start = match;
+    while ((pos > lit) && (start > e->offset) && (map[start-1] == p[pos-1])) {
+      start--;
+      pos--;
+      n++;
+    }
+
+    put_data(w, p + lit, pos - lit);
+    put_op(w, delta_copy, start, n);
+    w->copied += n;
+    pos += n;
+    start += n;
+
+    size_t max = e->offset + e->size - start;
+    if (max > len - pos)
+      max = len - pos;
+    size_t m = approx_match(p + pos, map + start, max);
+    if (m) {
+      put_add(w, start, p + pos, m);
+      pos += m;
+    }
+
+    lit = pos;
+    if (pos + DELTA_BLOCK <= len)
+      h = block_hash(u + pos);
+  }
+
+  put_data(w, p + lit, len - lit);
+  put_op(w, delta_end, 0, 0);
+}
+
+
+
+static void hash_sections(t_delta_image* d, unsigned char digests[bootimg_nb_sections][SHA1_DIGEST_SIZE])
+{
+  int s;
+
+  for (s=0; s<bootimg_nb_sections; s++) {
+    t_sha1 sha1;
+    sha1_init(&sha1);
+    sha1_update(&sha1, d->map + d->layout.sections[s].offset, d->layout.sections[s].size);
+    sha1_final(&sha1, digests[s]);
+  }
+}
+
+
+
+void make_delta(char* old_fname, char* new_fname, char* patch_fname)
+{
+  t_delta_image old, new;
+  t_delta_header h;
+  t_delta_writer w;
+  int s;
+
+  open_image(&old, old_fname);
+  open_image(&new, new_fname);
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, DELTA_MAGIC, sizeof(h.magic));
+  h.version = DELTA_VERSION;
+  h.old_header = old.hdr;
+  h.new_header = new.hdr;
+  h.new_image_size = new.size;
+  hash_sections(&old, h.old_sha1);
+  hash_sections(&new, h.new_sha1);
+
+  for (s=0; s<bootimg_nb_sections; s++) {
+    t_bootimg_extent* o = &old.layout.sections[s];
+    t_bootimg_extent* n = &new.layout.sections[s];
+    if ((o->size == n->size) && !memcmp(old.map + o->offset, new.map + n->offset, n->size))
+      h.kept |= 1 << s;
+  }
+#ifdef HAS_ZLIB
+  h.flags |= delta_compressed;
+#endif
+
+  memset(&w, 0, sizeof(w));
+  w.old = &old;
+  w.fname = patch_fname;
+  w.fd = open(patch_fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (w.fd == -1)
+    abort_perror(patch_fname);
+  if (!(w.buf = malloc(DELTA_CHUNK)))
+    abort_perror(NULL);
+
+  write_stream(w.fd, &h, sizeof(h), patch_fname);
+  if (h.flags & delta_compressed)
+    w.c = compressor_open(codec_gzip, w.fd, patch_fname, 0);
+  if (h.kept != (1 << bootimg_nb_sections) - 1)
+    index_old_image(&w);
+
+  for (s=0; s<bootimg_nb_sections; s++) {
+    t_bootimg_extent* n = &new.layout.sections[s];
+    if (h.kept & (1 << s)) {
+      if (bootimg_has_section(&old.hdr, s) || bootimg_has_section(&new.hdr, s))
+        print_msg("%s: same (%u bytes)\n", bootimg_section_name(s), n->size);
+      continue;
+    }
+    if (!n->size) {
+      put_op(&w, delta_end, 0, 0);
+      print_msg("%s: removed\n", bootimg_section_name(s));
+      continue;
+    }
+    unsigned long long copied = w.copied, added = w.added, literal = w.literal;
+    delta_section(&w, new.map + n->offset, n->size);
+    print_msg("%s: %llu bytes copied, %llu patched, %llu new (%u bytes)\n", bootimg_section_name(s),
+              w.copied - copied, w.added - added, w.literal - literal, n->size);
+  }
+
+  if (w.c)
+    compressor_close(w.c);
+  struct stat st;
+  if (fstat(w.fd, &st) || close(w.fd))
+    abort_perror(patch_fname);
+  print_msg("%s: %llu bytes, for an image of %llu bytes\n", patch_fname,
+            (unsigned long long)st.st_size, new.size);
+
+  free(w.buf);
+  free(w.slots);
+  close_image(&old);
+  close_image(&new);
+}
+
+
+
+void delta_open(t_delta* d, char* fname)
+{
+  struct stat st;
+
+  memset(d, 0, sizeof(*d));
+  d->fname = fname;
+  d->fd = open(fname, O_RDONLY);
+  if (d->fd == -1)
+    abort_perror(fname);
+  if (fstat(d->fd, &st))
+    abort_perror(fname);
+
+  if (st.st_size >= (off_t)sizeof(d->header))
+    read_all(d->fd, &d->header, sizeof(d->header), 0, fname);
+  if (memcmp(d->header.magic, DELTA_MAGIC, sizeof(d->header.magic)))
+    abort_printf("%s: not an abootimg patch\n", fname);
+  if (d->header.version != DELTA_VERSION)
+    abort_printf("%s: unsupported patch version %u\n", fname, d->header.version);
+
+  d->pos = sizeof(d->header);
+  if (d->header.flags & delta_compressed)
+    d->dec = decompressor_open(d->fd, d->pos, st.st_size - d->pos, fname);
+}
+
+
+
+void delta_close(t_delta* d)
+{
+  if (d->dec)
+    decompressor_close(d->dec);
+  close(d->fd);
+}
+
+
+
+/* the next size bytes of operations */
+static void delta_read(t_delta* d, void* buf, size_t size)
+{
+  if (!d->dec) {
+    read_all(d->fd, buf, size, d->pos, d->fname);
+    d->pos += size;
+    return;
+  }
+
+  char* p = buf;
+  while (size) {
+    size_t rb = decompressor_read(d->dec, p, size);
+    if (!rb)
+      abort_printf("%s: truncated patch\n", d->fname);
+    p += rb;
+    size -= rb;
+    d->pos += rb;
+  }
+}
+
+
+
+void delta_check_image(t_delta* d, int fd, char* fname, const boot_img_hdr* hdr,
+                       char* buf, size_t buf_size)
+{
+  t_bootimg_layout layout, old_layout;
+  int s;
+
+  bootimg_get_layout(hdr, &layout);
+  if (bootimg_get_layout(&d->header.old_header, &old_layout))
+    abort_printf("%s: corrupted patch\n", d->fname);
+  int differs = (layout.version != old_layout.version) || (layout.page_size != old_layout.page_size);
+  for (s=0; s<bootimg_nb_sections; s++)
+    differs |= layout.sections[s].size != old_layout.sections[s].size;
+  if (differs)
+    abort_printf("%s: not the image %s was made from (section sizes differ)\n", fname, d->fname);
+
+  for (s=0; s<bootimg_nb_sections; s++) {
+    unsigned char digest[SHA1_DIGEST_SIZE];
+    unsigned long long offset = layout.sections[s].offset;
+    size_t size = layout.sections[s].size;
+    t_sha1 sha1;
+
+    sha1_init(&sha1);
+    while (size) {
+      size_t len = size < buf_size ? size : buf_size;
+      read_all(fd, buf, len, offset, fname);
+      sha1_update(&sha1, buf, len);
+      offset += len;
+      size -= len;
+    }
+    sha1_final(&sha1, digest);
+    if (memcmp(digest, d->header.old_sha1[s], SHA1_DIGEST_SIZE))
+      abort_printf("%s: not the image %s was made from (%s differs)\n", fname, d->fname, bootimg_section_name(s));
+  }
+}
+
+
+
+void delta_build_section(t_delta* d, enum bootimg_section s, int fd, char* fname,
+                         int out_fd, char* out_fname, char* buf, size_t buf_size)
+{
+  t_bootimg_layout old_layout, new_layout;
+  unsigned char digest[SHA1_DIGEST_SIZE];
+  unsigned long long done = 0;
+  t_sha1 sha1;
+  size_t i;
+
+  bootimg_get_layout(&d->header.old_header, &old_layout);
+  bootimg_get_layout(&d->header.new_header, &new_layout);
+  unsigned long long size = new_layout.sections[s].size;
+
+  // add operations need the old bytes and the differences side by side
+  size_t half = buf_size / 2;
+  char* diff = buf + half;
+
+  sha1_init(&sha1);
+  for (;;) {
+    t_delta_op op;
+    delta_read(d, &op, sizeof(op));
+    if (op.type == delta_end)
+      break;
+    if ((op.type > delta_data) || (op.size > size - done))
+      abort_printf("%s: corrupted patch\n", d->fname);
+
+    if (op.type != delta_data) {
+      // sources stay within the sections checked by delta_check_image()
+      int ok = 0, t;
+      for (t=0; t<bootimg_nb_sections; t++) {
+        t_bootimg_extent* e = &old_layout.sections[t];
+        ok |= (op.offset >= e->offset) && (op.offset + op.size <= e->offset + e->size);
+      }
+      if (!ok)
+        abort_printf("%s: corrupted patch\n", d->fname);
+    }
+
+    unsigned long long offset = op.offset;
+    size_t left = op.size;
+    while (left) {
+      size_t len = left < half ? left : half;
+      switch (op.type) {
+        case delta_copy:
+          read_all(fd, buf, len, offset, fname);
+          break;
+        case delta_add:
+          read_all(fd, buf, len, offset, fname);
+          delta_read(d, diff, len);
+          for (i=0; i<len; i++)
+            buf[i] += diff[i];
+          break;
+        default:
+          delta_read(d, buf, len);
+      }
+      sha1_update(&sha1, buf, len);
+      write_stream(out_fd, buf, len, out_fname);
+      offset += len;
+      left -= len;
+    }
+    done += op.size;
+  }
+
+  sha1_final(&sha1, digest);
+  if ((done != size) || memcmp(digest, d->header.new_sha1[s], SHA1_DIGEST_SIZE))
+    abort_printf("%s: the patch does not give the expected %s\n", d->fname, bootimg_section_name(s));
+}
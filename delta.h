@@ -0,0 +1,106 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* section aware delta patches between two images, for OTA updates */
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "bootimg.h"
+#include "libabootimg.h"
+#include "compress.h"
+#include "sha1.h"
+
+#define DELTA_MAGIC    "ABOOTDLT"
+#define DELTA_VERSION  2
+
+enum delta_flags {
+  delta_compressed = 1    /* the operations are a gzip stream */
+};
+
+/*
+ * Start of a patch file, little endian as the boot image itself. The
+ * operations of the sections which are not kept follow, in section order,
+ * each list ended by a delta_end.
+ */
+typedef struct
+{
+  char               magic[8];
+  uint32_t           version;
+  uint32_t           flags;
+  boot_img_hdr       old_header;
+  boot_img_hdr       new_header;
+  unsigned char      old_sha1[bootimg_nb_sections][SHA1_DIGEST_SIZE];
+  unsigned char      new_sha1[bootimg_nb_sections][SHA1_DIGEST_SIZE];
+  uint32_t           kept;      /* sections equal to the old ones, one bit each */
+  uint32_t           reserved;
+  uint64_t           new_image_size;
+} t_delta_header;
+
+enum delta_op_type {
+  delta_end,
+  delta_copy,             /* size bytes of the old image at offset */
+  delta_add,              /* the same, plus the size bytes which follow */
+  delta_data              /* the size bytes which follow */
+};
+
+typedef struct
+{
+  uint32_t           type;
+  uint32_t           size;
+  uint64_t           offset;
+} t_delta_op;
+
+typedef struct
+{
+  char*              fname;
+  int                fd;
+  t_delta_header     header;
+  off_t              pos;         /* of the next operation, uncompressed */
+  t_decompressor*    dec;
+} t_delta;
+
+/*
+ * Write into patch_fname what turns the image old_fname into new_fname,
+ * and print what it is made of.
+ */
+void make_delta(char* old_fname, char* new_fname, char* patch_fname);
+
+/* open a patch and read its header */
+void delta_open(t_delta* d, char* fname);
+void delta_close(t_delta* d);
+
+/*
+ * Check that the image opened as fd, of header hdr, is the one the patch
+ * was made from, aborting otherwise.
+ */
+void delta_check_image(t_delta* d, int fd, char* fname, const boot_img_hdr* hdr,
+                       char* buf, size_t buf_size);
+
+/*
+ * Write the new content of a section which is not kept to out_fd, from
+ * the image opened as fd, checking it on the way. Sections have to be
+ * built in order.
+ */
+void delta_build_section(t_delta* d, enum bootimg_section s, int fd, char* fname,
+                         int out_fd, char* out_fname, char* buf, size_t buf_size);
+
+#endif
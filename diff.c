@@ -0,0 +1,408 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "abootimg.h"
+#include "libabootimg.h"
+#include "index.h"
+#include "sha1.h"
+#include "diff.h"
+
+
+#define DIFF_CHUNK       (1024*1024)  /* compared at once when not mapped */
+#define DIFF_BLOCK       256          /* equal bytes skipped with memcmp() */
+#define DIFF_GAP         32           /* shorter equal runs stay in a range */
+#define DIFF_MAX_RANGES  16           /* ranges printed per section */
+
+
+typedef struct
+{
+  char*              fname;
+  int                fd;
+  unsigned long long size;
+  boot_img_hdr       hdr;
+  t_bootimg_layout   layout;
+  char*              map;
+  size_t             map_size;
+  char*              buf;
+
+  t_index_entry      entry;
+  int                indexed;     /* entry holds the section hashes */
+  int                hash;        /* hash the sections, to index them */
+  t_sha1             sha1[bootimg_nb_sections];
+} t_diff_image;
+
+/* differing ranges of a section, [start, end) offsets in the section */
+typedef struct
+{
+  int                open;
+  unsigned long long start;
+  unsigned long long end;
+  unsigned           nb_ranges;
+  unsigned long long nb_bytes;
+  unsigned long long ranges[DIFF_MAX_RANGES][2];
+} t_diff_ranges;
+
+
+
+static void open_image(t_diff_image* d)
+{
+  d->fd = open(d->fname, O_RDONLY);
+  if (d->fd == -1)
+    abort_perror(d->fname);
+
+  enum bootimg_status status = bootimg_read_header(d->fd, &d->hdr, &d->size);
+  if (status == bootimg_err_io)
+    abort_perror(d->fname);
+  if (status)
+    abort_printf("%s: %s\n", d->fname, bootimg_strerror(status));
+  bootimg_get_layout(&d->hdr, &d->layout);
+
+  // mapped when possible, read in chunks otherwise
+  void* p = mmap(NULL, d->size, PROT_READ, MAP_SHARED, d->fd, 0);
+  if (p != MAP_FAILED) {
+    d->map = p;
+    d->map_size = d->size;
+    madvise(p, d->size, MADV_SEQUENTIAL);
+  }
+  else if (!(d->buf = malloc(DIFF_CHUNK)))
+    abort_perror(NULL);
+}
+
+
+
+/*
+ * Get the header of an image: from the index while the image does not
+ * change, the image being only opened if a section has to be read.
+ */
+static void load_image(t_diff_image* d, char* fname, t_index* index)
+{
+  struct stat st;
+
+  memset(d, 0, sizeof(*d));
+  d->fname = fname;
+  d->fd = -1;
+
+  if (index) {
+    if (stat(fname, &st))
+      abort_perror(fname);
+    if (!index_lookup(index, &st, &d->entry) && !d->entry.status) {
+      d->hdr = d->entry.header;
+      d->size = d->entry.image_size;
+      bootimg_get_layout(&d->hdr, &d->layout);
+      d->indexed = !!(d->entry.flags & index_hashes);
+      if (d->indexed)
+        return;
+    }
+    else
+      memset(&d->entry, 0, sizeof(d->entry));
+    d->hash = 1;
+  }
+
+  open_image(d);
+}
+
+
+
+static void close_image(t_diff_image* d)
+{
+  if (d->map)
+    munmap(d->map, d->map_size);
+  if (d->fd != -1)
+    close(d->fd);
+  free(d->buf);
+}
+
+
+
+/* len bytes of a section from pos */
+static const char* section_bytes(t_diff_image* d, enum bootimg_section s, unsigned long long pos, size_t len)
+{
+  unsigned long long offset = d->layout.sections[s].offset + pos;
+
+  if (d->fd == -1)
+    open_image(d);
+  if (d->map)
+    return d->map + offset;
+  read_all(d->fd, d->buf, len, offset, d->fname);
+  return d->buf;
+}
+
+
+
+static void add_range(t_diff_ranges* r, unsigned long long start, unsigned long long end)
+{
+  if (r->nb_ranges < DIFF_MAX_RANGES) {
+    r->ranges[r->nb_ranges][0] = start;
+    r->ranges[r->nb_ranges][1] = end;
+  }
+  r->nb_ranges++;
+  r->nb_bytes += end - start;
+}
+
+
+
+/*
+ * Find the differing ranges of len bytes at pos. Equal bytes are skipped
+ * a block at a time with memcmp(), differing ones are followed byte by
+ * byte, ranges being closed after DIFF_GAP equal bytes.
+ */
+static void compare_bytes(t_diff_ranges* r, const char* pa, const char* pb, size_t len, unsigned long long pos)
+{
+  size_t i = 0;
+
+  while (i < len) {
+    if (!r->open) {
+      while ((i + DIFF_BLOCK <= len) && !memcmp(pa + i, pb + i, DIFF_BLOCK))
+        i += DIFF_BLOCK;
+      while ((i < len) && (pa[i] == pb[i]))
+        i++;
+      if (i == len)
+        break;
+      r->open = 1;
+      r->start = pos + i;
+      r->end = pos + i + 1;
+      i++;
+    }
+
+    for (; i < len; i++) {
+      if (pa[i] != pb[i])
+        r->end = pos + i + 1;
+      else if (pos + i >= r->end + DIFF_GAP - 1) {
+        add_range(r, r->start, r->end);
+        r->open = 0;
+        i++;
+        break;
+      }
+    }
+  }
+}
+
+
+
+static void hash_bytes(t_diff_image* d, enum bootimg_section s, const char* p, size_t len)
+{
+  if (d->hash)
+    sha1_update(&d->sha1[s], p, len);
+}
+
+
+
+static int diff_section(t_diff_image* img, enum bootimg_section s)
+{
+  unsigned size_a = img[0].layout.sections[s].size;
+  unsigned size_b = img[1].layout.sections[s].size;
+  unsigned common = size_a < size_b ? size_a : size_b;
+  t_diff_ranges r;
+  unsigned i;
+
+  if (img[0].indexed && img[1].indexed && (size_a == size_b) &&
+      !memcmp(img[0].entry.sha1[s], img[1].entry.sha1[s], SHA1_DIGEST_SIZE)) {
+    print_msg("%s: same (%u bytes)\n", bootimg_section_name(s), size_a);
+    return 0;
+  }
+
+  memset(&r, 0, sizeof(r));
+  for (i=0; i<2; i++)
+    if (img[i].hash)
+      sha1_init(&img[i].sha1[s]);
+
+  unsigned long long pos = 0;
+  while (pos < common) {
+    size_t len = common - pos < DIFF_CHUNK ? common - pos : DIFF_CHUNK;
+    const char* pa = section_bytes(&img[0], s, pos, len);
+    const char* pb = section_bytes(&img[1], s, pos, len);
+    compare_bytes(&r, pa, pb, len, pos);
+    hash_bytes(&img[0], s, pa, len);
+    hash_bytes(&img[1], s, pb, len);
+    pos += len;
+  }
+  if (r.open)
+    add_range(&r, r.start, r.end);
+
+  // what is past the end of the shorter one differs as a whole
+  if (size_a != size_b) {
+    t_diff_image* longer = size_a > size_b ? &img[0] : &img[1];
+    unsigned size = size_a > size_b ? size_a : size_b;
+    if (r.nb_ranges && (r.nb_ranges <= DIFF_MAX_RANGES) && (r.ranges[r.nb_ranges-1][1] + DIFF_GAP > common)) {
+      r.nb_bytes += size - r.ranges[r.nb_ranges-1][1];
+      r.ranges[r.nb_ranges-1][1] = size;
+    }
+    else
+      add_range(&r, common, size);
+    for (; pos < size; pos += DIFF_CHUNK) {
+      size_t len = size - pos < DIFF_CHUNK ? size - pos : DIFF_CHUNK;
+      if (longer->hash)
+        hash_bytes(longer, s, section_bytes(longer, s, pos, len), len);
+    }
+  }
+
+  for (i=0; i<2; i++)
+    if (img[i].hash)
+      sha1_final(&img[i].sha1[s], img[i].entry.sha1[s]);
+
+  if (!r.nb_ranges) {
+    print_msg("%s: same (%u bytes)\n", bootimg_section_name(s), size_a);
+    return 0;
+  }
+
+  if (size_a != size_b)
+    print_msg("%s: differs, %u vs %u bytes, %u range%s (%llu bytes)\n", bootimg_section_name(s), size_a, size_b,
+              r.nb_ranges, r.nb_ranges > 1 ? "s" : "", r.nb_bytes);
+  else
+    print_msg("%s: differs, %u range%s (%llu of %u bytes)\n", bootimg_section_name(s),
+              r.nb_ranges, r.nb_ranges > 1 ? "s" : "", r.nb_bytes, size_a);
+  for (i=0; (i<r.nb_ranges) && (i<DIFF_MAX_RANGES); i++)
+    print_msg("  0x%08llx-0x%08llx (%llu bytes)\n", r.ranges[i][0], r.ranges[i][1] - 1,
+              r.ranges[i][1] - r.ranges[i][0]);
+  if (r.nb_ranges > DIFF_MAX_RANGES)
+    print_msg("  ... %u more\n", r.nb_ranges - DIFF_MAX_RANGES);
+  return 1;
+}
+
+
+
+static int diff_number(FILE* out, const char* name, unsigned a, unsigned b, int hex)
+{
+  if (a == b)
+    return 0;
+  fprintf(out, hex ? "  %s: 0x%08x vs 0x%08x\n" : "  %s: %u vs %u\n", name, a, b);
+  return 1;
+}
+
+
+
+static int diff_string(FILE* out, const char* name, const unsigned char* a, const unsigned char* b, size_t size)
+{
+  if (!strncmp((const char*)a, (const char*)b, size))
+    return 0;
+  fprintf(out, "  %s: \"%.*s\" vs \"%.*s\"\n", name, (int)strnlen((const char*)a, size), a,
+          (int)strnlen((const char*)b, size), b);
+  return 1;
+}
+
+
+
+static int diff_header(t_diff_image* img)
+{
+  boot_img_hdr* a = &img[0].hdr;
+  boot_img_hdr* b = &img[1].hdr;
+  int n = 0;
+  int i;
+
+  // the differences are listed under the header line, printed first
+  char* out = NULL;
+  size_t len = 0;
+  FILE* f = open_memstream(&out, &len);
+  if (!f)
+    abort_perror(NULL);
+
+  if (img[0].size != img[1].size) {
+    fprintf(f, "  image_size: %llu vs %llu\n", img[0].size, img[1].size);
+    n++;
+  }
+  n += diff_number(f, "header_version", img[0].layout.version, img[1].layout.version, 0);
+  n += diff_number(f, "page_size", img[0].layout.page_size, img[1].layout.page_size, 0);
+  for (i=0; i<bootimg_nb_sections; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s_size", bootimg_section_name(i));
+    n += diff_number(f, name, img[0].layout.sections[i].size, img[1].layout.sections[i].size, 0);
+  }
+  n += diff_number(f, "os_version", bootimg_os_version(a), bootimg_os_version(b), 1);
+
+  char cmdline_a[BOOTIMG_CMDLINE_SIZE], cmdline_b[BOOTIMG_CMDLINE_SIZE];
+  bootimg_get_cmdline(a, cmdline_a);
+  bootimg_get_cmdline(b, cmdline_b);
+  n += diff_string(f, "cmdline", (unsigned char*)cmdline_a, (unsigned char*)cmdline_b, BOOTIMG_CMDLINE_SIZE);
+
+  // the addresses, name and id of versions 0 to 2 only
+  if (bootimg_has_legacy_fields(a) && bootimg_has_legacy_fields(b)) {
+    n += diff_number(f, "kernel_addr", a->kernel_addr, b->kernel_addr, 1);
+    n += diff_number(f, "ramdisk_addr", a->ramdisk_addr, b->ramdisk_addr, 1);
+    n += diff_number(f, "second_addr", a->second_addr, b->second_addr, 1);
+    n += diff_number(f, "tags_addr", a->tags_addr, b->tags_addr, 1);
+    if (bootimg_has_section(a, bootimg_dtb) && bootimg_has_section(b, bootimg_dtb) &&
+        (a->dtb_addr != b->dtb_addr)) {
+      fprintf(f, "  dtb_addr: 0x%llx vs 0x%llx\n", a->dtb_addr, b->dtb_addr);
+      n++;
+    }
+    n += diff_string(f, "name", a->name, b->name, BOOT_NAME_SIZE);
+    if (memcmp(a->id, b->id, sizeof(a->id))) {
+      fprintf(f, "  id:");
+      for (i=0; i<8; i++)
+        fprintf(f, " 0x%08x", a->id[i]);
+      fprintf(f, " vs");
+      for (i=0; i<8; i++)
+        fprintf(f, " 0x%08x", b->id[i]);
+      fprintf(f, "\n");
+      n++;
+    }
+  }
+  fclose(f);
+
+  if (n)
+    print_msg("header: %d field%s differ%s\n%s", n, n > 1 ? "s" : "", n > 1 ? "" : "s", out);
+  else
+    print_msg("header: same\n");
+  free(out);
+  return n;
+}
+
+
+
+int diff_images(char* a, char* b, t_index* index)
+{
+  t_diff_image img[2];
+  int differs = 0;
+  int i;
+
+  load_image(&img[0], a, index);
+  load_image(&img[1], b, index);
+
+  print_msg("--- %s\n+++ %s\n", a, b);
+  differs |= diff_header(img);
+  for (i=0; i<bootimg_nb_sections; i++)
+    if (bootimg_has_section(&img[0].hdr, i) || bootimg_has_section(&img[1].hdr, i))
+      differs |= diff_section(img, i);
+
+  // both images are entirely read by then, unless their hashes were known
+  for (i=0; i<2; i++)
+    if (img[i].hash) {
+      struct stat st;
+      if (fstat(img[i].fd, &st))
+        abort_perror(img[i].fname);
+      img[i].entry.flags |= index_header | index_hashes;
+      img[i].entry.status = bootimg_ok;
+      img[i].entry.image_size = img[i].size;
+      img[i].entry.header = img[i].hdr;
+      index_store(index, &st, &img[i].entry);
+    }
+
+  close_image(&img[0]);
+  close_image(&img[1]);
+
+  return !!differs;
+}
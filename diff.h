@@ -0,0 +1,36 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* section by section comparison of two images */
+
+#ifndef _DIFF_H_
+#define _DIFF_H_
+
+#include "index.h"
+
+/*
+ * Print the header fields which differ between the images a and b, then,
+ * for each section, whether it differs and the byte ranges which do.
+ * With an index (opened by the caller, or NULL), sections whose hashes
+ * are known and equal are not read, and the images which had no hashes
+ * get them. Returns 1 if the
+ * images differ, 0 if they are the same.
+ */
+int diff_images(char* a, char* b, t_index* index);
+
+#endif
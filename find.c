@@ -0,0 +1,112 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE /* memmem */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "abootimg.h"
+#include "bootimg.h"
+#include "libabootimg.h"
+#include "find.h"
+
+
+#define FIND_BLOCK_SIZE  (8*1024*1024)
+
+
+
+/* check a magic found at offset, and print the image it starts */
+static int check_hit(int fd, char* fname, unsigned long long offset, unsigned long long size)
+{
+  boot_img_hdr hdr;
+  t_bootimg_layout layout;
+
+  if (size - offset < sizeof(hdr))
+    return 0;
+  read_all(fd, &hdr, sizeof(hdr), offset, fname);
+  if (bootimg_check_header(&hdr, size - offset))
+    return 0;
+
+  bootimg_get_layout(&hdr, &layout);
+  hdr.name[BOOT_NAME_SIZE-1] = '\0';
+  print_msg("%llu\t%llu\t%u\t%u\t%u\t%u\t%u\t%s\n", offset, layout.total_size, layout.version,
+            layout.page_size, layout.sections[bootimg_kernel].size, layout.sections[bootimg_ramdisk].size,
+            layout.sections[bootimg_second].size, bootimg_has_legacy_fields(&hdr) ? (char*)hdr.name : "");
+  return 1;
+}
+
+
+
+/*
+ * The file is read sequentially in large blocks, the next one being
+ * prefetched by the kernel while the current one is searched with the
+ * memmem() of the C library (vectorized, much faster than the storage).
+ * The last bytes of a block are searched again with the next one, for
+ * the magics which straddle them. Blocks searched are dropped from the
+ * page cache, which a dump much larger than the memory would only thrash.
+ */
+unsigned find_images(char* fname)
+{
+  const size_t keep = BOOT_MAGIC_SIZE - 1;
+  unsigned long long size, pos;
+  unsigned found = 0;
+
+  int fd = open(fname, O_RDONLY);
+  if (fd == -1)
+    abort_perror(fname);
+  if (bootimg_image_size(fd, &size))
+    abort_perror(fname);
+
+  char* buf = malloc(keep + FIND_BLOCK_SIZE);
+  if (!buf)
+    abort_perror(NULL);
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  size_t kept = 0;
+  for (pos=0; pos<size; ) {
+    size_t len = size - pos < FIND_BLOCK_SIZE ? size - pos : FIND_BLOCK_SIZE;
+    read_all(fd, buf + kept, len, pos, fname);
+    if (pos + len < size)
+      posix_fadvise(fd, pos + len, FIND_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+
+    // buf holds the bytes from pos - kept
+    char* p = buf;
+    size_t left = kept + len;
+    char* hit;
+    while ((hit = memmem(p, left, BOOT_MAGIC, BOOT_MAGIC_SIZE))) {
+      found += check_hit(fd, fname, pos - kept + (hit - buf), size);
+      left -= hit + 1 - p;
+      p = hit + 1;
+    }
+
+    posix_fadvise(fd, pos, len, POSIX_FADV_DONTNEED);
+    pos += len;
+    size_t next_kept = kept + len < keep ? kept + len : keep;
+    memmove(buf, buf + kept + len - next_kept, next_kept);
+    kept = next_kept;
+  }
+
+  free(buf);
+  close(fd);
+  return found;
+}
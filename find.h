@@ -0,0 +1,33 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* boot images embedded in larger files: flash dumps, firmware bundles */
+
+#ifndef _FIND_H_
+#define _FIND_H_
+
+/*
+ * Read the whole file or block device, and print one line for each boot
+ * magic followed by a valid header, within the bytes which follow it: the
+ * offset of the image, its size (header and sections, page aligned), then
+ * its header version, page size, kernel, ramdisk and second stage sizes,
+ * and its name (empty from version 3), tab separated. Returns the number of images found.
+ */
+unsigned find_images(char* fname);
+
+#endif
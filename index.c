@@ -0,0 +1,362 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE /* st_mtim */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "abootimg.h"
+#include "index.h"
+
+
+/*
+ * The index file is a header followed by an open addressing hash table of
+ * fixed size entries, mapped shared by every process using it. Lookups
+ * hold a shared flock(), updates an exclusive one. The table is never
+ * resized in place: a larger copy is built aside and renamed over the
+ * file, and the processes which still map the old one notice it is
+ * unlinked the next time they lock it.
+ */
+
+#define INDEX_MAGIC      "ABOOTIDX"
+#define INDEX_VERSION    2
+#define INDEX_MIN_SLOTS  1024    /* a power of two */
+
+typedef struct
+{
+  char               magic[8];
+  unsigned           version;
+  unsigned           entry_size;
+  unsigned long long nb_slots;
+  unsigned long long nb_used;
+} t_index_file;
+
+#define index_file(idx)   ((t_index_file*)(idx)->map)
+#define index_slots(idx)  ((t_index_entry*)((idx)->map + sizeof(t_index_file)))
+
+
+
+static size_t index_map_size(unsigned long long nb_slots)
+{
+  return sizeof(t_index_file) + nb_slots * sizeof(t_index_entry);
+}
+
+
+
+static unsigned long long key_hash(unsigned long long dev, unsigned long long ino)
+{
+  unsigned long long h = ino * 0x9e3779b97f4a7c15ULL ^ dev;
+
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 29;
+  return h;
+}
+
+
+
+/*
+ * The slot of a file: its entry, maybe stale, or the free slot where it
+ * belongs. The table is never full.
+ */
+static t_index_entry* find_slot(t_index* idx, unsigned long long dev, unsigned long long ino)
+{
+  t_index_entry* slots = index_slots(idx);
+  unsigned long long mask = index_file(idx)->nb_slots - 1;
+  unsigned long long i = key_hash(dev, ino) & mask;
+
+  while (slots[i].flags && ((slots[i].dev != dev) || (slots[i].ino != ino)))
+    i = (i+1) & mask;
+  return &slots[i];
+}
+
+
+
+static int map_index(t_index* idx, int fd, size_t size)
+{
+  void* p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return -1;
+
+  idx->fd = fd;
+  idx->map = p;
+  idx->map_size = size;
+  return 0;
+}
+
+
+
+static void unmap_index(t_index* idx)
+{
+  if (idx->map)
+    munmap(idx->map, idx->map_size);
+  if (idx->fd != -1)
+    close(idx->fd);
+  idx->map = NULL;
+  idx->fd = -1;
+}
+
+
+
+/*
+ * Replace the index file by an empty table of nb_slots, filled with the
+ * entries of the current one if it is mapped. Called with the current file
+ * locked: the new one is locked as well before it gets visible.
+ */
+static int rebuild_index(t_index* idx, unsigned long long nb_slots)
+{
+  size_t len = strlen(idx->fname);
+  char tmp_fname[len + 8];
+  int old_fd = idx->fd;
+  char* old_map = idx->map;
+  size_t old_size = idx->map_size;
+  t_index_file f;
+  unsigned long long i;
+
+  snprintf(tmp_fname, sizeof(tmp_fname), "%s.XXXXXX", idx->fname);
+  int fd = mkstemp(tmp_fname);
+  if (fd == -1)
+    return -1;
+
+  memset(&f, 0, sizeof(f));
+  memcpy(f.magic, INDEX_MAGIC, sizeof(f.magic));
+  f.version = INDEX_VERSION;
+  f.entry_size = sizeof(t_index_entry);
+  f.nb_slots = nb_slots;
+
+  if (fchmod(fd, 0644) || flock(fd, LOCK_EX) || ftruncate(fd, index_map_size(nb_slots)) ||
+      (pwrite(fd, &f, sizeof(f), 0) != sizeof(f)) || map_index(idx, fd, index_map_size(nb_slots))) {
+    close(fd);
+    unlink(tmp_fname);
+    return -1;
+  }
+
+  if (old_map) {
+    t_index_file* old_f = (t_index_file*)old_map;
+    t_index_entry* old_slots = (t_index_entry*)(old_map + sizeof(t_index_file));
+    for (i=0; i<old_f->nb_slots; i++)
+      if (old_slots[i].flags) {
+        *find_slot(idx, old_slots[i].dev, old_slots[i].ino) = old_slots[i];
+        index_file(idx)->nb_used++;
+      }
+  }
+
+  if (rename(tmp_fname, idx->fname)) {
+    unmap_index(idx);
+    unlink(tmp_fname);
+    idx->fd = old_fd;
+    idx->map = old_map;
+    idx->map_size = old_size;
+    return -1;
+  }
+
+  if (old_map)
+    munmap(old_map, old_size);
+  close(old_fd);
+  return 0;
+}
+
+
+
+/*
+ * Open and map the index file, creating it if needed. Returns 1 if the
+ * file is not an index, -1 on system errors.
+ */
+static int attach_index(t_index* idx)
+{
+  for (;;) {
+    struct stat st;
+    t_index_file f;
+    int ret = -1;
+
+    int fd = open(idx->fname, O_RDWR|O_CREAT, 0644);
+    if (fd == -1)
+      return -1;
+    if (flock(fd, LOCK_EX) || fstat(fd, &st))
+      goto err;
+    if (!st.st_nlink) {
+      // replaced by a larger copy meanwhile
+      close(fd);
+      continue;
+    }
+
+    idx->fd = fd;
+    if (!st.st_size) {
+      if (rebuild_index(idx, INDEX_MIN_SLOTS))
+        goto err;
+    }
+    else {
+      ssize_t rb = pread(fd, &f, sizeof(f), 0);
+      if (rb < 0)
+        goto err;
+      if ((rb != sizeof(f)) || memcmp(f.magic, INDEX_MAGIC, sizeof(f.magic))) {
+        ret = 1;
+        goto err;
+      }
+      // an index of another version, or built elsewhere, is started over
+      if ((f.version != INDEX_VERSION) || (f.entry_size != sizeof(t_index_entry)) ||
+          !f.nb_slots || (f.nb_slots & (f.nb_slots - 1)) ||
+          (st.st_size != (off_t)index_map_size(f.nb_slots))) {
+        if (rebuild_index(idx, INDEX_MIN_SLOTS))
+          goto err;
+      }
+      else if (map_index(idx, fd, st.st_size))
+        goto err;
+    }
+
+    flock(idx->fd, LOCK_UN);
+    return 0;
+
+  err:
+    close(fd);
+    idx->fd = -1;
+    return ret;
+  }
+}
+
+
+
+static void attach_or_abort(t_index* idx)
+{
+  int ret = attach_index(idx);
+
+  if (ret) {
+    pthread_mutex_unlock(&idx->lock);
+    if (ret == 1)
+      abort_printf("%s: not an abootimg index\n", idx->fname);
+    abort_perror(idx->fname);
+  }
+}
+
+
+
+/* lock the index, following it if it was replaced */
+static void lock_index(t_index* idx, int op)
+{
+  struct stat st;
+
+  pthread_mutex_lock(&idx->lock);
+  for (;;) {
+    if (flock(idx->fd, op) || fstat(idx->fd, &st)) {
+      pthread_mutex_unlock(&idx->lock);
+      abort_perror(idx->fname);
+    }
+    if (st.st_nlink)
+      return;
+    unmap_index(idx);
+    attach_or_abort(idx);
+  }
+}
+
+
+
+static void unlock_index(t_index* idx)
+{
+  flock(idx->fd, LOCK_UN);
+  pthread_mutex_unlock(&idx->lock);
+}
+
+
+
+void index_open(t_index* idx, char* fname)
+{
+  memset(idx, 0, sizeof(*idx));
+  idx->fname = fname;
+  idx->fd = -1;
+  pthread_mutex_init(&idx->lock, NULL);
+
+  pthread_mutex_lock(&idx->lock);
+  attach_or_abort(idx);
+  pthread_mutex_unlock(&idx->lock);
+}
+
+
+
+void index_close(t_index* idx)
+{
+  unmap_index(idx);
+  pthread_mutex_destroy(&idx->lock);
+}
+
+
+
+static int same_file(const t_index_entry* e, const struct stat* st)
+{
+  return e->flags && (e->dev == (unsigned long long)st->st_dev) &&
+         (e->ino == (unsigned long long)st->st_ino) && (e->size == (unsigned long long)st->st_size) &&
+         (e->mtime_sec == st->st_mtim.tv_sec) && (e->mtime_nsec == st->st_mtim.tv_nsec);
+}
+
+
+
+int index_lookup(t_index* idx, const struct stat* st, t_index_entry* entry)
+{
+  int found;
+
+  if (!S_ISREG(st->st_mode))
+    return 1;
+
+  lock_index(idx, LOCK_SH);
+  t_index_entry* e = find_slot(idx, st->st_dev, st->st_ino);
+  found = same_file(e, st);
+  if (found)
+    *entry = *e;
+  unlock_index(idx);
+
+  return !found;
+}
+
+
+
+void index_store(t_index* idx, const struct stat* st, const t_index_entry* entry)
+{
+  if (!S_ISREG(st->st_mode))
+    return;
+
+  lock_index(idx, LOCK_EX);
+  t_index_entry* e = find_slot(idx, st->st_dev, st->st_ino);
+  if (!e->flags) {
+    t_index_file* f = index_file(idx);
+    // at most 3/4 full, for short probe sequences
+    if ((f->nb_used + 1) * 4 > f->nb_slots * 3) {
+      if (rebuild_index(idx, 2 * f->nb_slots)) {
+        unlock_index(idx);
+        abort_perror(idx->fname);
+      }
+      e = find_slot(idx, st->st_dev, st->st_ino);
+    }
+    index_file(idx)->nb_used++;
+  }
+
+  *e = *entry;
+  e->dev = st->st_dev;
+  e->ino = st->st_ino;
+  e->size = st->st_size;
+  e->mtime_sec = st->st_mtim.tv_sec;
+  e->mtime_nsec = st->st_mtim.tv_nsec;
+  e->flags |= index_header;
+  unlock_index(idx);
+}
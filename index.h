@@ -0,0 +1,82 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* persistent cache of parsed headers, for -i and --scan */
+
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "bootimg.h"
+#include "libabootimg.h"
+#include "sha1.h"
+
+#define INDEX_FORMAT_SIZE  16
+
+/* what an entry holds, beside the header */
+enum index_flags {
+  index_header  = 1,     /* header and status */
+  index_formats = 2,     /* kernel and ramdisk formats */
+  index_hashes  = 4      /* SHA-1 of each section */
+};
+
+/*
+ * The entries are stored as is in the index file: regular files only, keyed
+ * by device and inode, and only valid while size and mtime did not change.
+ */
+typedef struct
+{
+  unsigned long long dev;
+  unsigned long long ino;
+  unsigned long long size;
+  long long          mtime_sec;
+  long long          mtime_nsec;
+
+  unsigned           flags;         /* 0 for a free slot */
+  unsigned           status;        /* enum bootimg_status */
+  unsigned long long image_size;
+  boot_img_hdr       header;
+  char               formats[2][INDEX_FORMAT_SIZE];
+  unsigned char      sha1[bootimg_nb_sections][SHA1_DIGEST_SIZE];
+} t_index_entry;
+
+typedef struct
+{
+  char*              fname;
+  int                fd;
+  char*              map;
+  size_t             map_size;
+  pthread_mutex_t    lock;
+} t_index;
+
+/* open or create the index file, aborting if it is something else */
+void index_open(t_index* idx, char* fname);
+void index_close(t_index* idx);
+
+/*
+ * Copy the entry of the file described by st, and return 0, or 1 if the
+ * file is not indexed or changed since.
+ */
+int index_lookup(t_index* idx, const struct stat* st, t_index_entry* entry);
+
+/* insert or replace the entry of the file described by st */
+void index_store(t_index* idx, const struct stat* st, const t_index_entry* entry);
+
+#endif
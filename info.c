@@ -0,0 +1,400 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libabootimg.h"
+#include "info.h"
+
+
+static const char* field_names[nb_info_fields] = {
+  "file",
+  "status",
+  "image_size",
+  "page_size",
+  "name",
+  "kernel_size",
+  "kernel_offset",
+  "kernel_addr",
+  "ramdisk_size",
+  "ramdisk_offset",
+  "ramdisk_addr",
+  "second_size",
+  "second_offset",
+  "second_addr",
+  "tags_addr",
+  "cmdline",
+  "id",
+  "header_version",
+  "os_version",
+  "recovery_dtbo_size",
+  "recovery_dtbo_offset",
+  "dtb_size",
+  "dtb_offset",
+  "dtb_addr",
+  "signature_size",
+  "signature_offset",
+  "kernel_sha1",
+  "ramdisk_sha1",
+  "second_sha1",
+  "recovery_dtbo_sha1",
+  "dtb_sha1",
+  "signature_sha1",
+};
+
+
+
+int parse_info_format(t_info_output* o, const char* name)
+{
+  if (!strcmp(name, "text"))
+    o->format = info_text;
+  else if (!strcmp(name, "json"))
+    o->format = info_json;
+  else if (!strcmp(name, "csv"))
+    o->format = info_csv;
+  else
+    return 1;
+  o->format_set = 1;
+  return 0;
+}
+
+
+
+int parse_info_fields(t_info_output* o, const char* list)
+{
+  const char* p = list;
+
+  while (*p) {
+    size_t len = strcspn(p, ",");
+    int f, i;
+
+    for (f=0; f<nb_info_fields; f++)
+      if ((strlen(field_names[f]) == len) && !strncmp(field_names[f], p, len))
+        break;
+    if (f == nb_info_fields)
+      return 1;
+    for (i=0; i<o->nb_fields; i++)
+      if (o->fields[i] == (enum info_field)f)
+        return 1;
+    o->fields[o->nb_fields++] = f;
+
+    p += len;
+    if (*p)
+      p++;
+  }
+  return !o->nb_fields;
+}
+
+
+
+void default_info_fields(t_info_output* o, int with_status)
+{
+  int f;
+
+  if (o->nb_fields)
+    return;
+  // the hashes need the whole image to be read, only when asked for
+  for (f=0; f<field_kernel_sha1; f++)
+    if (with_status || (f != field_status))
+      o->fields[o->nb_fields++] = f;
+}
+
+
+
+int info_needs_hashes(const t_info_output* o)
+{
+  int i;
+
+  for (i=0; i<o->nb_fields; i++)
+    if (o->fields[i] >= field_kernel_sha1)
+      return 1;
+  return 0;
+}
+
+
+
+void print_info_header(FILE* out, const t_info_output* o)
+{
+  int i;
+
+  if (o->format != info_csv)
+    return;
+  for (i=0; i<o->nb_fields; i++)
+    fprintf(out, "%s%s", i ? "," : "", field_names[o->fields[i]]);
+  fputc('\n', out);
+}
+
+
+
+void put_json_string(FILE* out, const char* s, size_t len)
+{
+  size_t i;
+
+  fputc('"', out);
+  for (i=0; i<len; i++) {
+    unsigned char c = s[i];
+    if ((c == '"') || (c == '\\'))
+      fprintf(out, "\\%c", c);
+    else if (c == '\n')
+      fputs("\\n", out);
+    else if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+
+
+static void put_string(FILE* out, enum info_format format, const char* s, size_t len)
+{
+  size_t i;
+
+  switch (format) {
+    case info_json:
+      put_json_string(out, s, len);
+      break;
+
+    case info_csv:
+      for (i=0; i<len; i++)
+        if (strchr(",\"\r\n", s[i]))
+          break;
+      if (i == len) {
+        fwrite(s, 1, len, out);
+        break;
+      }
+      fputc('"', out);
+      for (i=0; i<len; i++) {
+        if (s[i] == '"')
+          fputc('"', out);
+        fputc(s[i], out);
+      }
+      fputc('"', out);
+      break;
+
+    case info_text:
+      // one record per line, one field per column
+      for (i=0; i<len; i++)
+        fputc(((s[i] == '\t') || (s[i] == '\n') || (s[i] == '\r')) ? ' ' : s[i], out);
+      break;
+  }
+}
+
+
+
+static void put_hex(FILE* out, enum info_format format, unsigned long long value)
+{
+  fprintf(out, format == info_json ? "%llu" : "0x%08llx", value);
+}
+
+
+
+static void put_hash(FILE* out, enum info_format format, const unsigned char* digest)
+{
+  char hex[2*SHA1_DIGEST_SIZE];
+  int i;
+
+  for (i=0; i<SHA1_DIGEST_SIZE; i++) {
+    hex[2*i] = "0123456789abcdef"[digest[i] >> 4];
+    hex[2*i+1] = "0123456789abcdef"[digest[i] & 0xf];
+  }
+  put_string(out, format, hex, sizeof(hex));
+}
+
+
+
+static void put_field(FILE* out, enum info_format format, enum info_field field, const char* fname,
+                      unsigned long long image_size, const boot_img_hdr* hdr,
+                      const unsigned char (*sha1)[SHA1_DIGEST_SIZE], const char* status)
+{
+  t_bootimg_layout layout;
+  char cmdline[BOOTIMG_CMDLINE_SIZE];
+  int i;
+
+  memset(&layout, 0, sizeof(layout));
+  if (hdr)
+    bootimg_get_layout(hdr, &layout);
+
+  switch (field) {
+    case field_file:
+      put_string(out, format, fname, strlen(fname));
+      break;
+    case field_status:
+      put_string(out, format, status, strlen(status));
+      break;
+    case field_image_size:
+      fprintf(out, "%llu", image_size);
+      break;
+    case field_page_size:
+      fprintf(out, "%u", layout.page_size);
+      break;
+    case field_name:
+      put_string(out, format, (const char*)hdr->name, strnlen((const char*)hdr->name, BOOT_NAME_SIZE));
+      break;
+    case field_kernel_size:
+      fprintf(out, "%u", layout.sections[bootimg_kernel].size);
+      break;
+    case field_kernel_offset:
+      fprintf(out, "%llu", layout.sections[bootimg_kernel].offset);
+      break;
+    case field_kernel_addr:
+      put_hex(out, format, hdr->kernel_addr);
+      break;
+    case field_ramdisk_size:
+      fprintf(out, "%u", layout.sections[bootimg_ramdisk].size);
+      break;
+    case field_ramdisk_offset:
+      fprintf(out, "%llu", layout.sections[bootimg_ramdisk].offset);
+      break;
+    case field_ramdisk_addr:
+      put_hex(out, format, hdr->ramdisk_addr);
+      break;
+    case field_second_size:
+      fprintf(out, "%u", layout.sections[bootimg_second].size);
+      break;
+    case field_second_offset:
+      fprintf(out, "%llu", layout.sections[bootimg_second].offset);
+      break;
+    case field_second_addr:
+      put_hex(out, format, hdr->second_addr);
+      break;
+    case field_tags_addr:
+      put_hex(out, format, hdr->tags_addr);
+      break;
+    case field_cmdline:
+      bootimg_get_cmdline(hdr, cmdline);
+      put_string(out, format, cmdline, strlen(cmdline));
+      break;
+    case field_id:
+      if (format == info_json)
+        fputc('[', out);
+      for (i=0; i<8; i++)
+        fprintf(out, format == info_json ? "%s%u" : "%s0x%08x",
+                !i ? "" : format == info_json ? ", " : " ", hdr->id[i]);
+      if (format == info_json)
+        fputc(']', out);
+      break;
+    case field_header_version:
+      fprintf(out, "%u", layout.version);
+      break;
+    case field_os_version:
+      put_hex(out, format, bootimg_os_version(hdr));
+      break;
+    case field_recovery_dtbo_size:
+      fprintf(out, "%u", layout.sections[bootimg_recovery_dtbo].size);
+      break;
+    case field_recovery_dtbo_offset:
+      fprintf(out, "%llu", layout.sections[bootimg_recovery_dtbo].offset);
+      break;
+    case field_dtb_size:
+      fprintf(out, "%u", layout.sections[bootimg_dtb].size);
+      break;
+    case field_dtb_offset:
+      fprintf(out, "%llu", layout.sections[bootimg_dtb].offset);
+      break;
+    case field_dtb_addr:
+      put_hex(out, format, hdr->dtb_addr);
+      break;
+    case field_signature_size:
+      fprintf(out, "%u", layout.sections[bootimg_signature].size);
+      break;
+    case field_signature_offset:
+      fprintf(out, "%llu", layout.sections[bootimg_signature].offset);
+      break;
+    case field_kernel_sha1:
+    case field_ramdisk_sha1:
+    case field_second_sha1:
+    case field_recovery_dtbo_sha1:
+    case field_dtb_sha1:
+    case field_signature_sha1:
+      put_hash(out, format, sha1[field - field_kernel_sha1]);
+      break;
+    case nb_info_fields:
+      break;
+  }
+}
+
+
+
+/* whether the header version of hdr has the field */
+static int field_known(const boot_img_hdr* hdr, enum info_field f)
+{
+  switch (f) {
+    case field_name:
+    case field_kernel_addr:
+    case field_ramdisk_addr:
+    case field_second_addr:
+    case field_tags_addr:
+    case field_id:
+      return bootimg_has_legacy_fields(hdr);
+    case field_second_size:
+    case field_second_offset:
+      return bootimg_has_section(hdr, bootimg_second);
+    case field_recovery_dtbo_size:
+    case field_recovery_dtbo_offset:
+      return bootimg_has_section(hdr, bootimg_recovery_dtbo);
+    case field_dtb_size:
+    case field_dtb_offset:
+    case field_dtb_addr:
+      return bootimg_has_section(hdr, bootimg_dtb);
+    case field_signature_size:
+    case field_signature_offset:
+      return bootimg_has_section(hdr, bootimg_signature);
+    default:
+      if (f >= field_kernel_sha1)
+        return bootimg_has_section(hdr, f - field_kernel_sha1);
+      return 1;
+  }
+}
+
+
+
+void print_info_record(FILE* out, const t_info_output* o, const char* fname,
+                       unsigned long long image_size, const boot_img_hdr* hdr,
+                       const unsigned char (*sha1)[SHA1_DIGEST_SIZE], const char* status)
+{
+  int printed = 0;
+  int i;
+
+  if (o->format == info_json)
+    fputc('{', out);
+
+  for (i=0; i<o->nb_fields; i++) {
+    enum info_field f = o->fields[i];
+    int known = hdr ? field_known(hdr, f) : (f == field_file) || (f == field_status);
+
+    if (f >= field_kernel_sha1)
+      known = known && sha1;
+
+    // invalid images, or hashes not computed: empty CSV cells, nothing in
+    // the other formats
+    if (!known && (o->format != info_csv))
+      continue;
+
+    if (printed++)
+      fputs(o->format == info_json ? ", " : o->format == info_csv ? "," : "\t", out);
+    if (o->format == info_json)
+      fprintf(out, "\"%s\": ", field_names[f]);
+    if (known)
+      put_field(out, o->format, f, fname, image_size, hdr, sha1, status);
+  }
+
+  fputs(o->format == info_json ? "}\n" : "\n", out);
+}
@@ -0,0 +1,104 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* machine readable image information, for -i and --scan */
+
+#ifndef _INFO_H_
+#define _INFO_H_
+
+#include <stdio.h>
+
+#include "bootimg.h"
+#include "sha1.h"
+
+enum info_format {
+  info_text,      /* tab separated values */
+  info_json,      /* one object per image */
+  info_csv        /* a header row, then one row per image */
+};
+
+enum info_field {
+  field_file,
+  field_status,   /* ok, or why the image is not valid */
+  field_image_size,
+  field_page_size,
+  field_name,
+  field_kernel_size,
+  field_kernel_offset,
+  field_kernel_addr,
+  field_ramdisk_size,
+  field_ramdisk_offset,
+  field_ramdisk_addr,
+  field_second_size,
+  field_second_offset,
+  field_second_addr,
+  field_tags_addr,
+  field_cmdline,
+  field_id,
+  field_header_version,
+  field_os_version,
+  field_recovery_dtbo_size,
+  field_recovery_dtbo_offset,
+  field_dtb_size,
+  field_dtb_offset,
+  field_dtb_addr,
+  field_signature_size,
+  field_signature_offset,
+  field_kernel_sha1,    /* the hashes last, in the order of the sections */
+  field_ramdisk_sha1,
+  field_second_sha1,
+  field_recovery_dtbo_sha1,
+  field_dtb_sha1,
+  field_signature_sha1,
+  nb_info_fields
+};
+
+typedef struct
+{
+  enum info_format format;
+  int              format_set;
+  int              nb_fields;   /* 0 until given with --fields */
+  enum info_field  fields[nb_info_fields];
+} t_info_output;
+
+/* return 1 for an unknown format, or an unknown or repeated field */
+int parse_info_format(t_info_output* o, const char* name);
+int parse_info_fields(t_info_output* o, const char* list);
+
+/* select every field (but status without with_status, and the hashes) if none was given */
+void default_info_fields(t_info_output* o, int with_status);
+
+/* return 1 if one of the selected fields is a section hash */
+int info_needs_hashes(const t_info_output* o);
+
+void print_info_header(FILE* out, const t_info_output* o);
+
+/* a JSON string holding the len bytes of s, quoted and escaped */
+void put_json_string(FILE* out, const char* s, size_t len);
+
+/*
+ * Print the record of an image. For an invalid image, hdr is NULL and
+ * status tells why: only the file and status fields are known. The fields
+ * its header version does not have are not known either. sha1 holds the
+ * hashes of the sections, or is NULL when they were not computed.
+ */
+void print_info_record(FILE* out, const t_info_output* o, const char* fname,
+                       unsigned long long image_size, const boot_img_hdr* hdr,
+                       const unsigned char (*sha1)[SHA1_DIGEST_SIZE], const char* status);
+
+#endif
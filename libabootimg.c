@@ -0,0 +1,538 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h> /* BLKGETSIZE64 */
+#endif
+
+#ifdef __CYGWIN__
+#include <sys/ioctl.h>
+#include <cygwin/fs.h> /* BLKGETSIZE64 */
+#endif
+
+#if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
+#include <sys/disk.h> /* DIOCGMEDIASIZE */
+#endif
+
+#if defined(__APPLE__)
+# include <sys/disk.h> /* DKIOCGETBLOCKCOUNT */
+#endif
+
+#include "libabootimg.h"
+
+
+_Static_assert(sizeof(boot_img_hdr) == 1660, "boot_img_hdr must be packed");
+_Static_assert(sizeof(boot_img_hdr_v3) <= sizeof(boot_img_hdr), "a boot_img_hdr holds every version");
+
+
+const char* bootimg_strerror(enum bootimg_status status)
+{
+  switch (status) {
+    case bootimg_ok:               return "no error";
+    case bootimg_err_short:        return "cannot read image header";
+    case bootimg_err_magic:        return "no Android Magic Value";
+    case bootimg_err_kernel_size:  return "kernel size is null";
+    case bootimg_err_ramdisk_size: return "ramdisk size is null";
+    case bootimg_err_page_size:    return "Image page size is null or too small";
+    case bootimg_err_size:         return "sizes mismatches in boot image";
+    case bootimg_err_range:        return "out of the section";
+    case bootimg_err_io:           return "I/O error";
+    case bootimg_err_eof:          return "unexpected end of file";
+    case bootimg_err_version:      return "unsupported header version";
+    case bootimg_err_section:      return "not in this header version";
+    default:                       return "unknown error";
+  }
+}
+
+
+
+static const char* section_names[bootimg_nb_sections] = {
+  "kernel", "ramdisk", "second", "recovery_dtbo", "dtb", "signature"
+};
+
+const char* bootimg_section_name(enum bootimg_section section)
+{
+  if ((section < 0) || (section >= bootimg_nb_sections))
+    return "unknown";
+  return section_names[section];
+}
+
+
+
+/*
+ * Where the fields of each header version are, 0 for those it has not
+ * (the magic is the only field at offset 0).
+ */
+typedef struct
+{
+  unsigned           header_size;
+  unsigned           page_size;           /* fixed by the version, 0 when in the header */
+  int                ramdisk_required;
+  unsigned           page_size_field;
+  unsigned           header_size_field;
+  unsigned           os_version_field;
+  unsigned           cmdline_field;
+  unsigned           cmdline_size;
+  unsigned           extra_cmdline_field; /* BOOT_EXTRA_ARGS_SIZE bytes */
+  unsigned           size_fields[bootimg_nb_sections];
+} t_bootimg_version;
+
+#define V0(field)  offsetof(boot_img_hdr, field)
+#define V3(field)  offsetof(boot_img_hdr_v3, field)
+
+#define V0_FIELDS \
+  .ramdisk_required = 1, .page_size_field = V0(page_size), .os_version_field = V0(os_version), \
+  .cmdline_field = V0(cmdline), .cmdline_size = BOOT_ARGS_SIZE, .extra_cmdline_field = V0(extra_cmdline)
+
+#define V3_FIELDS \
+  .page_size = BOOT_IMAGE_HEADER_V3_PAGESIZE, .header_size_field = V3(header_size), \
+  .os_version_field = V3(os_version), .cmdline_field = V3(cmdline), .cmdline_size = BOOTIMG_CMDLINE_SIZE
+
+static const t_bootimg_version versions[BOOTIMG_MAX_VERSION+1] = {
+  { V0_FIELDS, .header_size = V0(recovery_dtbo_size),
+    .size_fields = { V0(kernel_size), V0(ramdisk_size), V0(second_size) } },
+  { V0_FIELDS, .header_size = V0(dtb_size), .header_size_field = V0(header_size),
+    .size_fields = { V0(kernel_size), V0(ramdisk_size), V0(second_size), V0(recovery_dtbo_size) } },
+  { V0_FIELDS, .header_size = sizeof(boot_img_hdr), .header_size_field = V0(header_size),
+    .size_fields = { V0(kernel_size), V0(ramdisk_size), V0(second_size), V0(recovery_dtbo_size),
+                     V0(dtb_size) } },
+  { V3_FIELDS, .header_size = V3(signature_size),
+    .size_fields = { V3(kernel_size), V3(ramdisk_size) } },
+  { V3_FIELDS, .header_size = sizeof(boot_img_hdr_v3),
+    .size_fields = { [bootimg_kernel] = V3(kernel_size), [bootimg_ramdisk] = V3(ramdisk_size),
+                     [bootimg_signature] = V3(signature_size) } },
+};
+
+// the fields are read and written as bytes, the versions overlapping
+static unsigned get_field(const boot_img_hdr* hdr, unsigned field)
+{
+  unsigned value;
+  memcpy(&value, (const char*)hdr + field, sizeof(value));
+  return value;
+}
+
+static void set_field(boot_img_hdr* hdr, unsigned field, unsigned value)
+{
+  memcpy((char*)hdr + field, &value, sizeof(value));
+}
+
+
+
+unsigned bootimg_header_version(const boot_img_hdr* hdr)
+{
+  return hdr->header_version > BOOTIMG_MAX_VERSION ? 0 : hdr->header_version;
+}
+
+static const t_bootimg_version* version_of(const boot_img_hdr* hdr)
+{
+  return &versions[bootimg_header_version(hdr)];
+}
+
+
+
+int bootimg_has_section(const boot_img_hdr* hdr, enum bootimg_section section)
+{
+  if ((section < 0) || (section >= bootimg_nb_sections))
+    return 0;
+  return !!version_of(hdr)->size_fields[section];
+}
+
+unsigned bootimg_section_size(const boot_img_hdr* hdr, enum bootimg_section section)
+{
+  return bootimg_has_section(hdr, section) ? get_field(hdr, version_of(hdr)->size_fields[section]) : 0;
+}
+
+enum bootimg_status bootimg_set_section_size(boot_img_hdr* hdr, enum bootimg_section section,
+                                             unsigned size)
+{
+  if (!bootimg_has_section(hdr, section))
+    return size ? bootimg_err_section : bootimg_ok;
+  set_field(hdr, version_of(hdr)->size_fields[section], size);
+  return bootimg_ok;
+}
+
+
+
+unsigned bootimg_page_size(const boot_img_hdr* hdr)
+{
+  const t_bootimg_version* v = version_of(hdr);
+  return v->page_size ? v->page_size : get_field(hdr, v->page_size_field);
+}
+
+enum bootimg_status bootimg_set_page_size(boot_img_hdr* hdr, unsigned page_size)
+{
+  const t_bootimg_version* v = version_of(hdr);
+
+  if (v->page_size)
+    return page_size == v->page_size ? bootimg_ok : bootimg_err_page_size;
+  set_field(hdr, v->page_size_field, page_size);
+  return bootimg_ok;
+}
+
+
+
+int bootimg_has_legacy_fields(const boot_img_hdr* hdr)
+{
+  return bootimg_header_version(hdr) < 3;
+}
+
+unsigned bootimg_os_version(const boot_img_hdr* hdr)
+{
+  return get_field(hdr, version_of(hdr)->os_version_field);
+}
+
+void bootimg_set_os_version(boot_img_hdr* hdr, unsigned os_version)
+{
+  set_field(hdr, version_of(hdr)->os_version_field, os_version);
+}
+
+
+
+void bootimg_get_cmdline(const boot_img_hdr* hdr, char cmdline[BOOTIMG_CMDLINE_SIZE])
+{
+  const t_bootimg_version* v = version_of(hdr);
+  const char* p = (const char*)hdr + v->cmdline_field;
+  size_t len = strnlen(p, v->cmdline_size);
+
+  memcpy(cmdline, p, len);
+  if (v->extra_cmdline_field) {
+    p = (const char*)hdr + v->extra_cmdline_field;
+    size_t extra = strnlen(p, BOOT_EXTRA_ARGS_SIZE);
+    if (extra > BOOTIMG_CMDLINE_SIZE - 1 - len)
+      extra = BOOTIMG_CMDLINE_SIZE - 1 - len;
+    memcpy(cmdline + len, p, extra);
+    len += extra;
+  }
+  if (len > BOOTIMG_CMDLINE_SIZE - 1)
+    len = BOOTIMG_CMDLINE_SIZE - 1;
+  cmdline[len] = '\0';
+}
+
+/* as mkbootimg: what does not fit in cmdline goes on in extra_cmdline */
+enum bootimg_status bootimg_set_cmdline(boot_img_hdr* hdr, const char* cmdline)
+{
+  const t_bootimg_version* v = version_of(hdr);
+  size_t len = strlen(cmdline);
+  size_t max = v->cmdline_size - 1;
+
+  if (len > max + (v->extra_cmdline_field ? BOOT_EXTRA_ARGS_SIZE - 1 : 0))
+    return bootimg_err_range;
+
+  char* p = (char*)hdr + v->cmdline_field;
+  memset(p, 0, v->cmdline_size);
+  memcpy(p, cmdline, len < max ? len : max);
+  if (v->extra_cmdline_field) {
+    p = (char*)hdr + v->extra_cmdline_field;
+    memset(p, 0, BOOT_EXTRA_ARGS_SIZE);
+    if (len > max)
+      memcpy(p, cmdline + max, len - max);
+  }
+  return bootimg_ok;
+}
+
+
+
+enum bootimg_status bootimg_set_header_version(boot_img_hdr* hdr, unsigned version)
+{
+  unsigned old = bootimg_header_version(hdr);
+  unsigned sizes[bootimg_nb_sections];
+  char cmdline[BOOTIMG_CMDLINE_SIZE];
+  boot_img_hdr h = *hdr;
+  int i;
+
+  if (version > BOOTIMG_MAX_VERSION)
+    return bootimg_err_version;
+
+  const t_bootimg_version* from = &versions[old];
+  const t_bootimg_version* to = &versions[version];
+  for (i=0; i<bootimg_nb_sections; i++) {
+    sizes[i] = bootimg_section_size(hdr, i);
+    if (sizes[i] && !to->size_fields[i])
+      return bootimg_err_section;
+  }
+
+  if ((old < 3) == (version < 3)) {
+    // the same header, extended or cut: the fields beyond the shorter
+    // version are cleared, they end up in the first page otherwise
+    unsigned keep = from->header_size < to->header_size ? from->header_size : to->header_size;
+    memset((char*)&h + keep, 0, sizeof(h) - keep);
+    h.header_version = version;
+  }
+  else {
+    // the other header layout: only sizes, cmdline and os version remain,
+    // a former version 3 image keeping its page size
+    bootimg_get_cmdline(hdr, cmdline);
+    unsigned os_version = bootimg_os_version(hdr);
+    unsigned page_size = bootimg_page_size(hdr);
+
+    memset((char*)&h + BOOT_MAGIC_SIZE, 0, sizeof(h) - BOOT_MAGIC_SIZE);
+    h.header_version = version;
+    for (i=0; i<bootimg_nb_sections; i++)
+      bootimg_set_section_size(&h, i, sizes[i]);
+    bootimg_set_os_version(&h, os_version);
+    if (!to->page_size)
+      set_field(&h, to->page_size_field, page_size);
+    if (bootimg_set_cmdline(&h, cmdline))
+      return bootimg_err_range;
+  }
+
+  if (to->header_size_field)
+    set_field(&h, to->header_size_field, to->header_size);
+  *hdr = h;
+  return bootimg_ok;
+}
+
+
+
+enum bootimg_status bootimg_plan_layout(unsigned version, unsigned page_size,
+                                        const unsigned sizes[bootimg_nb_sections],
+                                        t_bootimg_layout* layout)
+{
+  unsigned long long offset;
+  int i;
+
+  if (version > BOOTIMG_MAX_VERSION)
+    return bootimg_err_version;
+
+  const t_bootimg_version* v = &versions[version];
+  if (v->page_size)
+    page_size = v->page_size;
+  if (!page_size || (page_size < v->header_size))
+    return bootimg_err_page_size;
+
+  // 64-bit offsets: page counts of 32-bit sizes cannot overflow them
+  layout->version = version;
+  layout->page_size = page_size;
+  layout->header_size = v->header_size;
+  offset = page_size;
+  for (i=0; i<bootimg_nb_sections; i++) {
+    if (sizes[i] && !v->size_fields[i])
+      return bootimg_err_section;
+    layout->sections[i].offset = offset;
+    layout->sections[i].size = sizes[i];
+    offset += ((sizes[i] + (unsigned long long)page_size - 1) / page_size) * page_size;
+  }
+  layout->total_size = offset;
+  return bootimg_ok;
+}
+
+
+
+enum bootimg_status bootimg_get_layout(const boot_img_hdr* hdr, t_bootimg_layout* layout)
+{
+  unsigned sizes[bootimg_nb_sections];
+  int i;
+
+  for (i=0; i<bootimg_nb_sections; i++)
+    sizes[i] = bootimg_section_size(hdr, i);
+  return bootimg_plan_layout(bootimg_header_version(hdr), bootimg_page_size(hdr), sizes, layout);
+}
+
+
+
+enum bootimg_status bootimg_check_header(const boot_img_hdr* hdr, unsigned long long image_size)
+{
+  t_bootimg_layout layout;
+
+  if (memcmp(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE))
+    return bootimg_err_magic;
+  if (!bootimg_section_size(hdr, bootimg_kernel))
+    return bootimg_err_kernel_size;
+  // from version 3 on, the ramdisk can be in vendor_boot or init_boot
+  if (!bootimg_section_size(hdr, bootimg_ramdisk) && version_of(hdr)->ramdisk_required)
+    return bootimg_err_ramdisk_size;
+
+  enum bootimg_status status = bootimg_get_layout(hdr, &layout);
+  if (status)
+    return status;
+  if (layout.total_size > image_size)
+    return bootimg_err_size;
+  return bootimg_ok;
+}
+
+
+
+enum bootimg_status bootimg_parse_header(const void* buf, size_t size,
+                                         unsigned long long image_size, boot_img_hdr* hdr)
+{
+  if (size < sizeof(boot_img_hdr))
+    return bootimg_err_short;
+  memcpy(hdr, buf, sizeof(boot_img_hdr));
+  return bootimg_check_header(hdr, image_size);
+}
+
+
+
+static int blkgetsize(int fd, unsigned long long *pbsize)
+{
+# if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
+  return ioctl(fd, DIOCGMEDIASIZE, pbsize);
+# elif defined(__APPLE__)
+  return ioctl(fd, DKIOCGETBLOCKCOUNT, pbsize);
+# elif defined(__NetBSD__)
+  // does a suitable ioctl exist?
+  // return (ioctl(fd, DIOCGDINFO, &label) == -1);
+  return 1;
+# elif defined(__linux__) || defined(__CYGWIN__)
+  return ioctl(fd, BLKGETSIZE64, pbsize);
+# elif defined(__GNU__)
+  // does a suitable ioctl for HURD exist?
+  return 1;
+# else
+  return 1;
+# endif
+
+}
+
+
+
+enum bootimg_status bootimg_image_size(int fd, unsigned long long* size)
+{
+  struct stat st;
+
+  if (fstat(fd, &st))
+    return bootimg_err_io;
+
+  if (S_ISBLK(st.st_mode)) {
+    *size = 0;
+    if (blkgetsize(fd, size))
+      return bootimg_err_io;
+  }
+  else
+    *size = st.st_size;
+  return bootimg_ok;
+}
+
+
+
+/* pread() up to size bytes, short at the end of the file only */
+static enum bootimg_status read_at(int fd, void* buf, size_t size, off_t offset, size_t* done)
+{
+  char* p = buf;
+
+  *done = 0;
+  while (*done < size) {
+    ssize_t rb = pread(fd, p + *done, size - *done, offset + *done);
+    if (rb < 0) {
+      if (errno == EINTR)
+        continue;
+      return bootimg_err_io;
+    }
+    if (!rb)
+      break;
+    *done += rb;
+  }
+  return bootimg_ok;
+}
+
+
+
+enum bootimg_status bootimg_read_header(int fd, boot_img_hdr* hdr, unsigned long long* image_size)
+{
+  enum bootimg_status status;
+  size_t done;
+
+  status = bootimg_image_size(fd, image_size);
+  if (status)
+    return status;
+
+  status = read_at(fd, hdr, sizeof(boot_img_hdr), 0, &done);
+  if (status)
+    return status;
+  if (done < sizeof(boot_img_hdr))
+    return bootimg_err_short;
+  return bootimg_check_header(hdr, *image_size);
+}
+
+
+
+const void* bootimg_section_data(const void* image, size_t image_size,
+                                 const t_bootimg_layout* layout, enum bootimg_section section)
+{
+  if ((section < 0) || (section >= bootimg_nb_sections))
+    return NULL;
+
+  const t_bootimg_extent* e = &layout->sections[section];
+  if ((e->offset > image_size) || (e->size > image_size - e->offset))
+    return NULL;
+  return (const char*)image + e->offset;
+}
+
+
+
+enum bootimg_status bootimg_read_section(int fd, const t_bootimg_layout* layout,
+                                         enum bootimg_section section, unsigned long long pos,
+                                         void* buf, size_t size, size_t* done)
+{
+  *done = 0;
+  if ((section < 0) || (section >= bootimg_nb_sections))
+    return bootimg_err_range;
+
+  const t_bootimg_extent* e = &layout->sections[section];
+  if (pos > e->size)
+    return bootimg_err_range;
+  if (size > e->size - pos)
+    size = e->size - pos;
+
+  enum bootimg_status status = read_at(fd, buf, size, e->offset + pos, done);
+  if (status)
+    return status;
+  return *done < size ? bootimg_err_eof : bootimg_ok;
+}
+
+
+
+enum bootimg_status bootimg_copy_section(int fd, const t_bootimg_layout* layout,
+                                         enum bootimg_section section, int out_fd,
+                                         void* buf, size_t buf_size)
+{
+  unsigned long long pos = 0;
+
+  if (!buf_size)
+    return bootimg_err_range;
+
+  for (;;) {
+    size_t len;
+    enum bootimg_status status = bootimg_read_section(fd, layout, section, pos, buf, buf_size, &len);
+    if (status)
+      return status;
+    if (!len)
+      return bootimg_ok;
+
+    const char* p = buf;
+    size_t left = len;
+    while (left) {
+      ssize_t wb = write(out_fd, p, left);
+      if (wb < 0) {
+        if (errno == EINTR)
+          continue;
+        return bootimg_err_io;
+      }
+      p += wb;
+      left -= wb;
+    }
+    pos += len;
+  }
+}
@@ -0,0 +1,180 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * libabootimg: boot image headers, layouts and sections.
+ *
+ * Every function is reentrant, works on caller provided memory only (no
+ * heap allocation, no global state), and reports errors with a status
+ * instead of exiting. bootimg_err_io leaves errno set by the failing call:
+ * bootimg_strerror() only says "I/O error" for it, strerror_r() on errno
+ * tells why.
+ */
+
+#ifndef _LIBABOOTIMG_H_
+#define _LIBABOOTIMG_H_
+
+#include <stddef.h>
+
+#include "bootimg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum bootimg_status {
+  bootimg_ok = 0,
+  bootimg_err_short,        /* buffer smaller than a header */
+  bootimg_err_magic,
+  bootimg_err_kernel_size,
+  bootimg_err_ramdisk_size,
+  bootimg_err_page_size,
+  bootimg_err_size,         /* sections beyond the end of the image */
+  bootimg_err_range,        /* position out of the section */
+  bootimg_err_io,
+  bootimg_err_eof,          /* image or input shorter than its header says */
+  bootimg_err_version,      /* header version not supported */
+  bootimg_err_section       /* section or field not in this header version */
+};
+
+#define BOOTIMG_MAX_VERSION   4
+
+/* the whole cmdline, split in cmdline and extra_cmdline before version 3 */
+#define BOOTIMG_CMDLINE_SIZE  (BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE)
+
+enum bootimg_section {
+  bootimg_kernel,
+  bootimg_ramdisk,
+  bootimg_second,
+  bootimg_recovery_dtbo,    /* versions 1 and 2 */
+  bootimg_dtb,              /* version 2 */
+  bootimg_signature,        /* version 4 */
+  bootimg_nb_sections
+};
+
+typedef struct
+{
+  unsigned long long offset;
+  unsigned           size;
+} t_bootimg_extent;
+
+/*
+ * The sections are in image order. Those the header version has not are
+ * empty, at the end of the previous one.
+ */
+typedef struct
+{
+  unsigned           version;
+  unsigned           page_size;
+  unsigned           header_size;  /* bytes of the header, in its first page */
+  t_bootimg_extent   sections[bootimg_nb_sections];
+  unsigned long long total_size;   /* header and sections, page aligned */
+} t_bootimg_layout;
+
+const char* bootimg_strerror(enum bootimg_status status);
+
+/* kernel, ramdisk, second, recovery_dtbo, dtb or signature */
+const char* bootimg_section_name(enum bootimg_section section);
+
+/*
+ * Place the header and sections one after the other, each starting on a
+ * page boundary. page_size is ignored by the versions which fix it.
+ */
+enum bootimg_status bootimg_plan_layout(unsigned version, unsigned page_size,
+                                        const unsigned sizes[bootimg_nb_sections],
+                                        t_bootimg_layout* layout);
+enum bootimg_status bootimg_get_layout(const boot_img_hdr* hdr, t_bootimg_layout* layout);
+
+/*
+ * A boot_img_hdr holds any header version, those from 3 on being a
+ * boot_img_hdr_v3, and its fields are accessed according to it by the
+ * functions below.
+ *
+ * The version was part of the unused words of the original header, which
+ * some vendors did use: versions above BOOTIMG_MAX_VERSION are taken as 0.
+ */
+unsigned bootimg_header_version(const boot_img_hdr* hdr);
+
+/*
+ * Convert a header to another version, keeping the fields they share. The
+ * sections the new version has not must be empty.
+ */
+enum bootimg_status bootimg_set_header_version(boot_img_hdr* hdr, unsigned version);
+
+int bootimg_has_section(const boot_img_hdr* hdr, enum bootimg_section section);
+unsigned bootimg_section_size(const boot_img_hdr* hdr, enum bootimg_section section);
+enum bootimg_status bootimg_set_section_size(boot_img_hdr* hdr, enum bootimg_section section,
+                                             unsigned size);
+
+/* fixed from version 3 on: only that page size can be set */
+unsigned bootimg_page_size(const boot_img_hdr* hdr);
+enum bootimg_status bootimg_set_page_size(boot_img_hdr* hdr, unsigned page_size);
+
+/* the name, load addresses and id fields are only in versions 0 to 2 */
+int bootimg_has_legacy_fields(const boot_img_hdr* hdr);
+
+unsigned bootimg_os_version(const boot_img_hdr* hdr);
+void bootimg_set_os_version(boot_img_hdr* hdr, unsigned os_version);
+
+/* copy the cmdline, NUL terminated, into cmdline */
+void bootimg_get_cmdline(const boot_img_hdr* hdr, char cmdline[BOOTIMG_CMDLINE_SIZE]);
+
+/* bootimg_err_range if the cmdline does not fit in the header */
+enum bootimg_status bootimg_set_cmdline(boot_img_hdr* hdr, const char* cmdline);
+
+/* sanity checks of a header, for an image of image_size bytes */
+enum bootimg_status bootimg_check_header(const boot_img_hdr* hdr, unsigned long long image_size);
+
+/*
+ * Copy and check the header found at the start of buf. image_size is the
+ * size of the whole image, which buf may only hold the beginning of.
+ */
+enum bootimg_status bootimg_parse_header(const void* buf, size_t size,
+                                         unsigned long long image_size, boot_img_hdr* hdr);
+
+/* size of an image file or block device */
+enum bootimg_status bootimg_image_size(int fd, unsigned long long* size);
+
+/* read and check the header of the image opened as fd */
+enum bootimg_status bootimg_read_header(int fd, boot_img_hdr* hdr, unsigned long long* image_size);
+
+/*
+ * Zero-copy access to a section of an image held in memory (or mapped),
+ * NULL when the section is not within image_size bytes.
+ */
+const void* bootimg_section_data(const void* image, size_t image_size,
+                                 const t_bootimg_layout* layout, enum bootimg_section section);
+
+/*
+ * Read up to size bytes of a section, from pos. *done is set to the
+ * number of bytes read, 0 at the end of the section.
+ */
+enum bootimg_status bootimg_read_section(int fd, const t_bootimg_layout* layout,
+                                         enum bootimg_section section, unsigned long long pos,
+                                         void* buf, size_t size, size_t* done);
+
+/* stream a whole section to out_fd through buf */
+enum bootimg_status bootimg_copy_section(int fd, const t_bootimg_layout* layout,
+                                         enum bootimg_section section, int out_fd,
+                                         void* buf, size_t buf_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
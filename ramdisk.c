@@ -0,0 +1,797 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE /* nftw, *at() */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "abootimg.h"
+#include "compress.h"
+#include "ramdisk.h"
+#include "stats.h"
+
+
+/* only used with HAS_ZLIB, as the compressor it feeds */
+#ifdef HAS_ZLIB
+
+#include <zlib.h>
+
+
+#define CPIO_MAGIC        "070701"
+#define CPIO_HEADER_SIZE  110
+#define CPIO_TRAILER      "TRAILER!!!"
+
+#define DATA_BUFFER_SIZE  (64*1024)
+#define CACHE_MIN_SIZE    (16*1024)   /* smallest file whose member is cached */
+
+
+typedef struct
+{
+  char*       name;   /* relative to the packed directory */
+  struct stat st;
+} t_entry;
+
+
+/* nftw() has no user pointer, one set per thread for batch jobs */
+static __thread t_entry* entries;
+static __thread int nb_entries;
+static __thread int max_entries;
+static __thread size_t root_len;
+
+
+
+static int collect_entry(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+  if (!ftw->level)
+    return 0;   // the directory itself is the archive root
+
+  if (nb_entries == max_entries) {
+    max_entries = max_entries ? 2*max_entries : 256;
+    entries = realloc(entries, max_entries * sizeof(t_entry));
+    if (!entries)
+      abort_perror(NULL);
+  }
+
+  entries[nb_entries].name = strdup(path + root_len + 1);
+  if (!entries[nb_entries].name)
+    abort_perror(NULL);
+  entries[nb_entries].st = *st;
+  nb_entries++;
+  return 0;
+}
+
+
+
+static int compare_entries(const void* a, const void* b)
+{
+  return strcmp(((const t_entry*)a)->name, ((const t_entry*)b)->name);
+}
+
+
+
+/* FNV-1a, for inode numbers and cache keys */
+static unsigned long long hash_bytes(unsigned long long h, const void* buf, size_t size)
+{
+  const unsigned char* p = buf;
+
+  while (size--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+#define HASH_INIT  0xcbf29ce484222325ULL
+
+
+
+/*
+ * Format the cpio header of an entry, followed by its name and padding,
+ * and return its length. Entries always take a multiple of 4 bytes, and
+ * inode numbers derive from the names: an entry is the same wherever it
+ * lands in the archive, which is what makes caching members possible.
+ */
+static size_t format_cpio_header(char* hdr, const char* name, mode_t mode,
+                                 time_t mtime, unsigned size, dev_t rdev)
+{
+  size_t namesize = strlen(name) + 1;
+  unsigned ino = hash_bytes(HASH_INIT, name, namesize - 1);
+
+  sprintf(hdr, "%s%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+          CPIO_MAGIC, strcmp(name, CPIO_TRAILER) ? ino : 0, (unsigned)mode, 0, 0,
+          S_ISDIR(mode) ? 2 : 1, (unsigned)mtime, size,
+          0, 0, major(rdev), minor(rdev), (unsigned)namesize, 0);
+  memcpy(hdr + CPIO_HEADER_SIZE, name, namesize);
+
+  size_t len = CPIO_HEADER_SIZE + namesize;
+  while (len % 4)
+    hdr[len++] = 0;
+  return len;
+}
+
+
+
+/* read the size bytes of a file being archived, up to DATA_BUFFER_SIZE */
+static size_t read_data(int fd, char* buf, unsigned long long left, char* path)
+{
+  for (;;) {
+    ssize_t rb = read(fd, buf, left < DATA_BUFFER_SIZE ? left : DATA_BUFFER_SIZE);
+    if (rb < 0) {
+      if (errno == EINTR)
+        continue;
+      abort_perror(path);
+    }
+    stats_read(rb);
+    if (!rb)
+      abort_printf("%s: file shrank while archived\n", path);
+    return rb;
+  }
+}
+
+
+
+static void write_file_data(t_compressor* c, int fd, unsigned long long size, char* buf, char* path)
+{
+  static const char zeroes[4];
+  unsigned long long left = size;
+
+  while (left) {
+    size_t len = read_data(fd, buf, left, path);
+    compressor_write(c, buf, len);
+    left -= len;
+  }
+  compressor_write(c, zeroes, (4 - (size % 4)) % 4);
+}
+
+
+
+typedef struct
+{
+  char*        dir;
+  char**       tmp_names;  /* cache files being written, renamed once complete */
+  char**       names;
+  int          nb_names;
+  unsigned     hits;
+  unsigned     files;
+} t_cache;
+
+
+
+/*
+ * Archive a regular file through the cache of compressed members: the
+ * member is looked up by a hash of its header and content. On a hit, its
+ * compressed form is copied as is, otherwise it is compressed and stored.
+ */
+static void pack_cached_file(t_compressor* c, t_cache* cache, char* hdr, size_t hlen,
+                             int fd, unsigned long long size, char* buf, char* path)
+{
+  static const char zeroes[4];
+  size_t pad = (4 - (size % 4)) % 4;
+  unsigned long long member_len = hlen + size + pad;
+
+  unsigned long long h = hash_bytes(HASH_INIT, hdr, hlen);
+  uLong crc = crc32(crc32(0L, Z_NULL, 0), (Bytef*)hdr, hlen);
+  unsigned long long left = size;
+  while (left) {
+    size_t len = read_data(fd, buf, left, path);
+    h = hash_bytes(h, buf, len);
+    crc = crc32(crc, (Bytef*)buf, len);
+    left -= len;
+  }
+  h = hash_bytes(h, zeroes, pad);
+  crc = crc32(crc, (Bytef*)zeroes, pad);
+
+  char name[PATH_MAX];
+  snprintf(name, sizeof(name), "%s/%016llx%08lx", cache->dir, h, crc);
+  cache->files++;
+
+  int cfd = open(name, O_RDONLY);
+  if (cfd != -1) {
+    struct stat st;
+    unsigned char trailer[12];
+    unsigned long ccrc = 0;
+    unsigned long long clen = 0;
+    int i;
+
+    if (!fstat(cfd, &st) && (st.st_size >= sizeof(trailer)) &&
+        (pread(cfd, trailer, sizeof(trailer), st.st_size - sizeof(trailer)) == sizeof(trailer))) {
+      stats_read(sizeof(trailer));
+      for (i=3; i>=0; i--)
+        ccrc = (ccrc << 8) | trailer[i];
+      for (i=11; i>=4; i--)
+        clen = (clen << 8) | trailer[i];
+    }
+
+    if ((ccrc == crc) && (clen == member_len)) {
+      off_t offset = 0;
+      off_t end = st.st_size - sizeof(trailer);
+      while (offset < end) {
+        size_t len = end - offset < DATA_BUFFER_SIZE ? end - offset : DATA_BUFFER_SIZE;
+        read_all(cfd, buf, len, offset, name);
+        offset += len;
+        if (offset < end)
+          compressor_write_deflated(c, buf, len, 0, 0);
+        else
+          compressor_write_deflated(c, buf, len, crc, member_len);
+      }
+      close(cfd);
+      cache->hits++;
+      return;
+    }
+    close(cfd);
+  }
+
+  // miss: compressed again from the file, and captured for the next time
+  // under a unique name, as concurrent batch jobs may share the cache
+  char tmp_name[PATH_MAX + 16];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.XXXXXX", name);
+  int tfd = mkstemp(tmp_name);
+  if (tfd != -1) {
+    fchmod(tfd, 0644);
+    cache->tmp_names = realloc(cache->tmp_names, (cache->nb_names+1) * sizeof(char*));
+    cache->names = realloc(cache->names, (cache->nb_names+1) * sizeof(char*));
+    if (!cache->tmp_names || !cache->names)
+      abort_perror(NULL);
+    cache->tmp_names[cache->nb_names] = strdup(tmp_name);
+    cache->names[cache->nb_names] = strdup(name);
+    cache->nb_names++;
+  }
+
+  if (lseek(fd, 0, SEEK_SET))
+    abort_perror(path);
+  stats_seek();
+  compressor_member(c, tfd);
+  compressor_write(c, hdr, hlen);
+  write_file_data(c, fd, size, buf, path);
+  compressor_member(c, -1);
+}
+
+
+
+void pack_ramdisk(char* dir, int fd, char* fname, enum codec codec, int nb_threads, char* cache_dir)
+{
+  char hdr[CPIO_HEADER_SIZE + PATH_MAX + 4];
+  t_cache cache = { cache_dir, NULL, NULL, 0, 0, 0 };
+  int i;
+
+  // left over by a failed batch job
+  nb_entries = 0;
+
+  root_len = strlen(dir);
+  while ((root_len > 1) && (dir[root_len-1] == '/'))
+    root_len--;
+  if (nftw(dir, collect_entry, 64, FTW_PHYS))
+    abort_perror(dir);
+  qsort(entries, nb_entries, sizeof(t_entry), compare_entries);
+
+  if (cache_dir && mkdir(cache_dir, 0755) && (errno != EEXIST))
+    abort_perror(cache_dir);
+
+  char* buf = malloc(DATA_BUFFER_SIZE);
+  if (!buf)
+    abort_perror(NULL);
+
+  t_compressor* c = compressor_open(codec, fd, fname, nb_threads);
+
+  for (i=0; i<nb_entries; i++) {
+    t_entry* e = &entries[i];
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%.*s/%s", (int)root_len, dir, e->name);
+
+    if (strlen(e->name) >= PATH_MAX)
+      abort_printf("%s: name too long\n", path);
+
+    if (S_ISLNK(e->st.st_mode)) {
+      ssize_t len = readlink(path, buf, DATA_BUFFER_SIZE - 4);
+      if (len < 0)
+        abort_perror(path);
+      compressor_write(c, hdr, format_cpio_header(hdr, e->name, e->st.st_mode, e->st.st_mtime, len, 0));
+      memset(buf + len, 0, 3);
+      compressor_write(c, buf, len + (4 - (len % 4)) % 4);
+    }
+    else if (S_ISREG(e->st.st_mode)) {
+      if (e->st.st_size > 0xffffffffULL)
+        abort_printf("%s: too big\n", path);
+      int in = open(path, O_RDONLY);
+      if (in == -1)
+        abort_perror(path);
+      size_t hlen = format_cpio_header(hdr, e->name, e->st.st_mode, e->st.st_mtime, e->st.st_size, 0);
+
+      // hard links are archived as separate files, small files are cheaper
+      // to compress than to look up
+      if (cache_dir && (e->st.st_size >= CACHE_MIN_SIZE))
+        pack_cached_file(c, &cache, hdr, hlen, in, e->st.st_size, buf, path);
+      else {
+        compressor_write(c, hdr, hlen);
+        write_file_data(c, in, e->st.st_size, buf, path);
+      }
+      close(in);
+    }
+    else
+      compressor_write(c, hdr, format_cpio_header(hdr, e->name, e->st.st_mode, e->st.st_mtime, 0, e->st.st_rdev));
+
+    free(e->name);
+  }
+
+  compressor_write(c, hdr, format_cpio_header(hdr, CPIO_TRAILER, 0, 0, 0, 0));
+  compressor_close(c);
+
+  // the captures are complete once the compressor is closed
+  for (i=0; i<cache.nb_names; i++) {
+    if (rename(cache.tmp_names[i], cache.names[i]))
+      unlink(cache.tmp_names[i]);
+    free(cache.tmp_names[i]);
+    free(cache.names[i]);
+  }
+  free(cache.tmp_names);
+  free(cache.names);
+  if (cache_dir)
+    print_msg("ramdisk cache: %u of %u files reused\n", cache.hits, cache.files);
+
+  free(entries);
+  entries = NULL;
+  nb_entries = max_entries = 0;
+  free(buf);
+}
+
+
+
+typedef struct
+{
+  char*  name;
+  mode_t mode;
+  time_t mtime;
+} t_dir;
+
+
+typedef struct
+{
+  t_decompressor*    d;
+  char*              fname;
+  unsigned long long pos;
+} t_archive;
+
+
+
+static void read_archive(t_archive* a, void* buf, size_t size)
+{
+  if (decompressor_read(a->d, buf, size) != size)
+    abort_printf("%s: truncated ramdisk archive\n", a->fname);
+  a->pos += size;
+}
+
+
+
+static void skip_padding(t_archive* a)
+{
+  char pad[4];
+  read_archive(a, pad, (4 - (a->pos % 4)) % 4);
+}
+
+
+
+static void skip_data(t_archive* a, unsigned size, char* buf)
+{
+  while (size) {
+    size_t len = size < DATA_BUFFER_SIZE ? size : DATA_BUFFER_SIZE;
+    read_archive(a, buf, len);
+    size -= len;
+  }
+  skip_padding(a);
+}
+
+
+
+static unsigned parse_hex(t_archive* a, const char* field)
+{
+  unsigned v = 0;
+  int i;
+
+  for (i=0; i<8; i++) {
+    char ch = field[i];
+    v <<= 4;
+    if ((ch >= '0') && (ch <= '9'))
+      v |= ch - '0';
+    else if ((ch >= 'a') && (ch <= 'f'))
+      v |= ch - 'a' + 10;
+    else if ((ch >= 'A') && (ch <= 'F'))
+      v |= ch - 'A' + 10;
+    else
+      abort_printf("%s: corrupted cpio header\n", a->fname);
+  }
+  return v;
+}
+
+
+
+typedef struct
+{
+  char     hdr[CPIO_HEADER_SIZE + PATH_MAX + 4];  /* as found, with name and padding */
+  size_t   hlen;
+  char*    name;   /* without any leading ./ */
+
+  mode_t   mode;
+  unsigned uid;
+  unsigned gid;
+  time_t   mtime;
+  unsigned fsize;
+  dev_t    rdev;
+} t_cpio_entry;
+
+
+
+/* read the next entry header, returns 0 on the trailer */
+static int read_cpio_entry(t_archive* a, t_cpio_entry* e)
+{
+  char* hdr = e->hdr;
+
+  read_archive(a, hdr, CPIO_HEADER_SIZE);
+  if (strncmp(hdr, CPIO_MAGIC, 6))
+    abort_printf("%s: not a newc cpio archive\n", a->fname);
+
+  e->mode = parse_hex(a, hdr + 14);
+  e->uid = parse_hex(a, hdr + 22);
+  e->gid = parse_hex(a, hdr + 30);
+  e->mtime = parse_hex(a, hdr + 46);
+  e->fsize = parse_hex(a, hdr + 54);
+  e->rdev = makedev(parse_hex(a, hdr + 78), parse_hex(a, hdr + 86));
+  unsigned namesize = parse_hex(a, hdr + 94);
+
+  if (!namesize || (namesize > PATH_MAX))
+    abort_printf("%s: corrupted cpio header\n", a->fname);
+  read_archive(a, hdr + CPIO_HEADER_SIZE, namesize);
+  hdr[CPIO_HEADER_SIZE + namesize - 1] = 0;
+  e->hlen = CPIO_HEADER_SIZE + namesize;
+  while (a->pos % 4) {
+    read_archive(a, hdr + e->hlen, 1);
+    e->hlen++;
+  }
+
+  e->name = hdr + CPIO_HEADER_SIZE;
+  if (!strcmp(e->name, CPIO_TRAILER))
+    return 0;
+  while (!strncmp(e->name, "./", 2))
+    e->name += 2;
+  return 1;
+}
+
+
+
+/*
+ * Open the directory holding name below root, without following any
+ * symbolic link: entries of a hostile archive cannot escape the root.
+ * Returns the directory fd, and the last path component in *base.
+ */
+static int open_parent(int root_fd, char* name, char** base)
+{
+  int fd = dup(root_fd);
+  char* p = name;
+  char* slash;
+
+  while ((slash = strchr(p, '/'))) {
+    *slash = 0;
+    int next = openat(fd, p, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+    if (next == -1)
+      abort_perror(name);
+    *slash = '/';
+    close(fd);
+    fd = next;
+    p = slash + 1;
+  }
+
+  *base = p;
+  return fd;
+}
+
+
+
+static int valid_name(char* name)
+{
+  char* p = name;
+
+  if (*name == '/')
+    return 0;
+  while (*p) {
+    size_t len = strcspn(p, "/");
+    if (!len || ((len == 2) && !strncmp(p, "..", 2)))
+      return 0;
+    p += len;
+    if (*p)
+      p++;
+  }
+  return 1;
+}
+
+
+
+void unpack_ramdisk(int fd, off_t offset, unsigned long long size, char* fname, char* dir)
+{
+  int is_root = !geteuid();
+  t_dir* dirs = NULL;
+  int nb_dirs = 0;
+  int i;
+
+  t_archive a = { decompressor_open(fd, offset, size, fname), fname, 0 };
+
+  if (mkdir(dir, 0755))
+    abort_perror(dir);
+  int root_fd = open(dir, O_RDONLY|O_DIRECTORY);
+  if (root_fd == -1)
+    abort_perror(dir);
+
+  char* buf = malloc(DATA_BUFFER_SIZE);
+  if (!buf)
+    abort_perror(NULL);
+
+  t_cpio_entry* e = malloc(sizeof(t_cpio_entry));
+  if (!e)
+    abort_perror(NULL);
+
+  while (read_cpio_entry(&a, e)) {
+    char* p = e->name;
+    mode_t mode = e->mode;
+    time_t mtime = e->mtime;
+    unsigned fsize = e->fsize;
+
+    if (!*p || !strcmp(p, ".")) {
+      // the archive root, dir itself
+      skip_data(&a, fsize, buf);
+      continue;
+    }
+    if (!valid_name(p))
+      abort_printf("%s: unsafe name in ramdisk archive: %s\n", fname, p);
+
+    char* base;
+    int dfd = open_parent(root_fd, p, &base);
+
+    if (S_ISREG(mode)) {
+      int out = openat(dfd, base, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600);
+      if (out == -1)
+        abort_perror(p);
+      unsigned left = fsize;
+      while (left) {
+        size_t len = left < DATA_BUFFER_SIZE ? left : DATA_BUFFER_SIZE;
+        read_archive(&a, buf, len);
+        write_stream(out, buf, len, p);
+        left -= len;
+      }
+      if (fchmod(out, mode & 07777))
+        abort_perror(p);
+      if (close(out))
+        abort_perror(p);
+    }
+    else if (S_ISLNK(mode)) {
+      if (fsize >= DATA_BUFFER_SIZE)
+        abort_printf("%s: corrupted cpio header\n", fname);
+      read_archive(&a, buf, fsize);
+      buf[fsize] = 0;
+      if (symlinkat(buf, dfd, base))
+        abort_perror(p);
+    }
+    else if (S_ISDIR(mode)) {
+      // made writable until the end, the actual mode is set afterwards
+      if (mkdirat(dfd, base, 0700))
+        abort_perror(p);
+      dirs = realloc(dirs, (nb_dirs+1) * sizeof(t_dir));
+      if (!dirs)
+        abort_perror(NULL);
+      dirs[nb_dirs].name = strdup(p);
+      dirs[nb_dirs].mode = mode & 07777;
+      dirs[nb_dirs].mtime = mtime;
+      nb_dirs++;
+    }
+    else if (is_root) {
+      if (mknodat(dfd, base, mode, e->rdev))
+        abort_perror(p);
+    }
+    else
+      fprintf(stderr, "%s: special file skipped (not root)\n", p);
+
+    skip_padding(&a);
+
+    if (!S_ISDIR(mode) && (S_ISREG(mode) || S_ISLNK(mode) || is_root)) {
+      if (is_root && fchownat(dfd, base, e->uid, e->gid, AT_SYMLINK_NOFOLLOW))
+        abort_perror(p);
+      struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+      utimensat(dfd, base, times, AT_SYMLINK_NOFOLLOW);
+    }
+    else if (S_ISDIR(mode) && is_root && fchownat(dfd, base, e->uid, e->gid, AT_SYMLINK_NOFOLLOW))
+      abort_perror(p);
+
+    close(dfd);
+  }
+
+  decompressor_close(a.d);
+  free(e);
+
+  // innermost directories first, so that setting the modes never prevents
+  // reaching the next ones
+  for (i=nb_dirs-1; i>=0; i--) {
+    char* base;
+    int dfd = open_parent(root_fd, dirs[i].name, &base);
+    struct timespec times[2] = { { dirs[i].mtime, 0 }, { dirs[i].mtime, 0 } };
+    if (fchmodat(dfd, base, dirs[i].mode, 0))
+      abort_perror(dirs[i].name);
+    utimensat(dfd, base, times, AT_SYMLINK_NOFOLLOW);
+    close(dfd);
+    free(dirs[i].name);
+  }
+
+  free(dirs);
+  free(buf);
+  close(root_fd);
+}
+
+
+
+/* the entry of an edit, relative to the archive root */
+static char* edit_path(char* path)
+{
+  for (;;) {
+    if (*path == '/')
+      path++;
+    else if (!strncmp(path, "./", 2))
+      path += 2;
+    else
+      return path;
+  }
+}
+
+
+
+/* archive the file of an add or replace edit, under the given header */
+static void write_edit_file(t_compressor* c, t_ramdisk_edit* edit, char* hdr, size_t hlen,
+                            int fd, unsigned long long size, char* buf)
+{
+  compressor_write(c, hdr, hlen);
+  write_file_data(c, fd, size, buf, edit->fname);
+  close(fd);
+}
+
+
+
+static int open_edit_file(t_ramdisk_edit* edit, struct stat* st)
+{
+  int fd = open(edit->fname, O_RDONLY);
+  if (fd == -1)
+    abort_perror(edit->fname);
+  if (fstat(fd, st))
+    abort_perror(edit->fname);
+  if (!S_ISREG(st->st_mode))
+    abort_printf("%s: not a regular file\n", edit->fname);
+  if (st->st_size > 0xffffffffULL)
+    abort_printf("%s: too big\n", edit->fname);
+  return fd;
+}
+
+
+
+void edit_ramdisk(int in_fd, off_t offset, unsigned long long size, char* in_fname,
+                  t_ramdisk_edit* edits, int nb_edits, int out_fd, char* out_fname,
+                  enum codec codec, int nb_threads)
+{
+  int i;
+
+  char* buf = malloc(DATA_BUFFER_SIZE);
+  t_cpio_entry* e = malloc(sizeof(t_cpio_entry));
+  if (!buf || !e)
+    abort_perror(NULL);
+
+  for (i=0; i<nb_edits; i++) {
+    edits[i].path = edit_path(edits[i].path);
+    edits[i].done = 0;
+    if (!*edits[i].path || !valid_name(edits[i].path))
+      abort_printf("%s: invalid ramdisk path\n", edits[i].path);
+  }
+
+  t_archive a = { decompressor_open(in_fd, offset, size, in_fname), in_fname, 0 };
+  if (codec == codec_unknown)
+    codec = decompressor_codec(a.d);
+  t_compressor* c = compressor_open(codec, out_fd, out_fname, nb_threads);
+
+  // entries are copied as they are found, header included, except the
+  // edited ones
+  while (read_cpio_entry(&a, e)) {
+    t_ramdisk_edit* edit = NULL;
+    for (i=0; i<nb_edits; i++) {
+      size_t len = strlen(edits[i].path);
+      if (!strncmp(e->name, edits[i].path, len) && (!e->name[len] ||
+          ((edits[i].op == ramdisk_delete) && (e->name[len] == '/')))) {
+        edit = &edits[i];
+        break;
+      }
+    }
+
+    if (!edit) {
+      compressor_write(c, e->hdr, e->hlen);
+      unsigned left = e->fsize;
+      while (left) {
+        size_t len = left < DATA_BUFFER_SIZE ? left : DATA_BUFFER_SIZE;
+        read_archive(&a, buf, len);
+        compressor_write(c, buf, len);
+        left -= len;
+      }
+      skip_padding(&a);
+      compressor_write(c, "\0\0\0", (4 - (e->fsize % 4)) % 4);
+      continue;
+    }
+
+    skip_data(&a, e->fsize, buf);
+    edit->done = 1;
+
+    switch (edit->op) {
+      case ramdisk_add:
+        abort_printf("%s: already in the ramdisk\n", edit->path);
+        break;
+
+      case ramdisk_delete:
+        print_msg("deleting %s from ramdisk\n", e->name);
+        break;
+
+      case ramdisk_replace:
+        {
+          // the entry keeps its attributes, but the size and date
+          struct stat st;
+          if (!S_ISREG(e->mode))
+            abort_printf("%s: not a regular file in the ramdisk\n", edit->path);
+          int fd = open_edit_file(edit, &st);
+          char field[9];
+          snprintf(field, sizeof(field), "%08X", (unsigned)st.st_mtime);
+          memcpy(e->hdr + 46, field, 8);
+          snprintf(field, sizeof(field), "%08X", (unsigned)st.st_size);
+          memcpy(e->hdr + 54, field, 8);
+          print_msg("replacing %s in ramdisk with %s\n", edit->path, edit->fname);
+          write_edit_file(c, edit, e->hdr, e->hlen, fd, st.st_size, buf);
+        }
+        break;
+    }
+  }
+
+  // new files go last, once their directories exist
+  for (i=0; i<nb_edits; i++) {
+    if (edits[i].done)
+      continue;
+    if (edits[i].op != ramdisk_add)
+      abort_printf("%s: not found in the ramdisk\n", edits[i].path);
+
+    struct stat st;
+    int fd = open_edit_file(&edits[i], &st);
+    print_msg("adding %s to ramdisk from %s\n", edits[i].path, edits[i].fname);
+    size_t hlen = format_cpio_header(e->hdr, edits[i].path, S_IFREG | (st.st_mode & 07777),
+                                     st.st_mtime, st.st_size, 0);
+    write_edit_file(c, &edits[i], e->hdr, hlen, fd, st.st_size, buf);
+  }
+
+  compressor_write(c, e->hdr, format_cpio_header(e->hdr, CPIO_TRAILER, 0, 0, 0, 0));
+  compressor_close(c);
+  decompressor_close(a.d);
+
+  free(e);
+  free(buf);
+}
+
+#endif /* HAS_ZLIB */
@@ -0,0 +1,67 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* ramdisks as compressed cpio archives (newc format) */
+
+#ifndef _RAMDISK_H_
+#define _RAMDISK_H_
+
+#include <sys/types.h>
+
+#include "compress.h"
+
+/*
+ * Archive the content of dir and write it compressed to fd. Entries are
+ * sorted by name and owned by root, as mkbootfs does.
+ * With a cache_dir (gzip only), the compressed members of the files are
+ * kept there and reused as long as their content and attributes do not change.
+ */
+void pack_ramdisk(char* dir, int fd, char* fname, enum codec codec, int nb_threads, char* cache_dir);
+
+/*
+ * Extract the compressed archive found at offset in fd into dir, which is
+ * created and must not exist yet.
+ */
+void unpack_ramdisk(int fd, off_t offset, unsigned long long size, char* fname, char* dir);
+
+enum ramdisk_op {
+  ramdisk_add,
+  ramdisk_replace,
+  ramdisk_delete
+};
+
+typedef struct
+{
+  enum ramdisk_op op;
+  char*           path;   /* in the ramdisk */
+  char*           fname;  /* new content, for add and replace */
+  int             done;
+} t_ramdisk_edit;
+
+/*
+ * Copy the compressed archive found at offset in in_fd to out_fd, in one
+ * pass, applying the edits on the way: replaced files keep their
+ * attributes, deleted directories go with their content, and added files
+ * are appended. The result is compressed with codec, or as the original
+ * for codec_unknown.
+ */
+void edit_ramdisk(int in_fd, off_t offset, unsigned long long size, char* in_fname,
+                  t_ramdisk_edit* edits, int nb_edits, int out_fd, char* out_fname,
+                  enum codec codec, int nb_threads);
+
+#endif
@@ -0,0 +1,415 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE /* asprintf */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef HAS_CURL
+#include <curl/curl.h>
+#endif
+
+#include "abootimg.h"
+#include "stats.h"
+#include "remote.h"
+
+
+#define REMOTE_PART_SIZE  (4*1024*1024)
+#define REMOTE_PARALLEL   8
+
+
+
+int is_remote(const char* fname)
+{
+  return !strncmp(fname, "http://", 7) || !strncmp(fname, "https://", 8) || !strncmp(fname, "s3://", 5);
+}
+
+
+
+#ifdef HAS_CURL
+
+struct remote
+{
+  char*              name;      /* as given, for the messages */
+  char*              url;
+  char*              userpwd;   /* S3 credentials, NULL for anonymous requests */
+  char*              sigv4;
+  struct curl_slist* headers;
+  CURL*              curl;      /* of remote_read(), kept alive from one range to the next */
+  unsigned long long size;
+};
+
+/* one ranged GET, to memory or to a file */
+typedef struct
+{
+  t_remote*          r;
+  CURL*              curl;
+  char               range[64];
+  char*              buf;
+  int                fd;
+  off_t              out_offset;
+  size_t             size;
+  size_t             done;
+  int                not_partial;  /* the server sent the whole file */
+  int                err;          /* errno of a failed write */
+  char               error[CURL_ERROR_SIZE];
+} t_range;
+
+static pthread_once_t curl_once = PTHREAD_ONCE_INIT;
+
+
+
+static void init_curl(void)
+{
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+
+
+static char* format(const char* fmt, ...)
+{
+  va_list args;
+  char* s;
+
+  va_start(args, fmt);
+  int err = vasprintf(&s, fmt, args) < 0;
+  va_end(args);
+  if (err)
+    abort_perror(NULL);
+  return s;
+}
+
+
+
+t_remote* remote_open(const char* url)
+{
+  pthread_once(&curl_once, init_curl);
+
+  t_remote* r = calloc(sizeof(t_remote), 1);
+  if (!r)
+    abort_perror(NULL);
+  r->name = format("%s", url);
+
+  if (strncmp(url, "s3://", 5))
+    r->url = format("%s", url);
+  else {
+    const char* bucket = url + 5;
+    const char* key = strchr(bucket, '/');
+    if (!key || (key == bucket) || !key[1])
+      abort_printf("%s: s3://bucket/key expected\n", url);
+
+    const char* region = getenv("AWS_REGION");
+    if (!region || !*region)
+      region = getenv("AWS_DEFAULT_REGION");
+    if (!region || !*region)
+      region = "us-east-1";
+    const char* endpoint = getenv("AWS_ENDPOINT_URL");
+    if (endpoint && *endpoint)
+      r->url = format("%s/%.*s%s", endpoint, (int)(key - bucket), bucket, key);
+    else
+      r->url = format("https://%.*s.s3.%s.amazonaws.com%s", (int)(key - bucket), bucket, region, key);
+
+    const char* id = getenv("AWS_ACCESS_KEY_ID");
+    const char* secret = getenv("AWS_SECRET_ACCESS_KEY");
+    const char* token = getenv("AWS_SESSION_TOKEN");
+    if (id && secret) {
+#if LIBCURL_VERSION_NUM >= 0x074b00
+      r->userpwd = format("%s:%s", id, secret);
+      r->sigv4 = format("aws:amz:%s:s3", region);
+      if (token && *token) {
+        char* header = format("x-amz-security-token: %s", token);
+        r->headers = curl_slist_append(r->headers, header);
+        free(header);
+      }
+#else
+      abort_printf("%s: signed S3 requests need libcurl 7.75 or later\n", url);
+#endif
+    }
+  }
+
+  if (!(r->curl = curl_easy_init()))
+    abort_printf("%s: cannot initialize libcurl\n", url);
+  return r;
+}
+
+
+
+void remote_close(t_remote* r)
+{
+  if (!r)
+    return;
+  curl_easy_cleanup(r->curl);
+  curl_slist_free_all(r->headers);
+  free(r->name);
+  free(r->url);
+  free(r->userpwd);
+  free(r->sigv4);
+  free(r);
+}
+
+
+
+unsigned long long remote_size(const t_remote* r)
+{
+  return r->size;
+}
+
+
+
+static size_t range_header(char* data, size_t size, size_t n, void* arg)
+{
+  t_range* g = arg;
+  size_t len = size * n;
+  unsigned long long total;
+
+  // "Content-Range: bytes first-last/total", from 206 and 416 responses
+  if ((len > 14) && !strncasecmp(data, "Content-Range:", 14)) {
+    char* slash = memchr(data, '/', len);
+    if (slash && (sscanf(slash + 1, "%llu", &total) == 1))
+      g->r->size = total;
+  }
+  return len;
+}
+
+static size_t range_data(char* data, size_t size, size_t n, void* arg)
+{
+  t_range* g = arg;
+  size_t len = size * n;
+  long code = 0;
+
+  // a server ignoring ranges would send the whole file
+  curl_easy_getinfo(g->curl, CURLINFO_RESPONSE_CODE, &code);
+  if (code != 206) {
+    g->not_partial = (code == 200);
+    return 0;
+  }
+  if (len > g->size - g->done)
+    len = g->size - g->done;
+
+  if (g->buf)
+    memcpy(g->buf + g->done, data, len);
+  else {
+    size_t written = 0;
+    while (written < len) {
+      ssize_t wb = pwrite(g->fd, data + written, len - written, g->out_offset + g->done + written);
+      if ((wb == -1) && (errno == EINTR))
+        continue;
+      if (wb <= 0) {
+        g->err = wb ? errno : EIO;
+        return 0;
+      }
+      written += wb;
+    }
+  }
+  g->done += len;
+  return size * n;
+}
+
+
+
+static void setup_range(t_range* g, unsigned long long offset, size_t size)
+{
+  t_remote* r = g->r;
+  CURL* c = g->curl;
+
+  g->size = size;
+  g->done = 0;
+  g->not_partial = 0;
+  g->err = 0;
+  g->error[0] = '\0';
+  snprintf(g->range, sizeof(g->range), "%llu-%llu", offset, offset + size - 1);
+
+  curl_easy_setopt(c, CURLOPT_URL, r->url);
+  curl_easy_setopt(c, CURLOPT_RANGE, g->range);
+  curl_easy_setopt(c, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(c, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(c, CURLOPT_ERRORBUFFER, g->error);
+  curl_easy_setopt(c, CURLOPT_HEADERFUNCTION, range_header);
+  curl_easy_setopt(c, CURLOPT_HEADERDATA, g);
+  curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, range_data);
+  curl_easy_setopt(c, CURLOPT_WRITEDATA, g);
+  if (r->headers)
+    curl_easy_setopt(c, CURLOPT_HTTPHEADER, r->headers);
+  if (r->userpwd) {
+    curl_easy_setopt(c, CURLOPT_USERPWD, r->userpwd);
+#if LIBCURL_VERSION_NUM >= 0x074b00
+    curl_easy_setopt(c, CURLOPT_AWS_SIGV4, r->sigv4);
+#endif
+  }
+}
+
+/* why a range failed, empty if it did not */
+static void range_error(t_range* g, CURLcode res, char* msg, size_t msg_size)
+{
+  long code = 0;
+
+  curl_easy_getinfo(g->curl, CURLINFO_RESPONSE_CODE, &code);
+  msg[0] = '\0';
+  if (g->not_partial)
+    snprintf(msg, msg_size, "%s: byte ranges not supported by the server", g->r->name);
+  else if (g->err)
+    snprintf(msg, msg_size, "%s", strerror(g->err));
+  else if ((code >= 300) && (code != 416))
+    snprintf(msg, msg_size, "%s: HTTP error %ld", g->r->name, code);
+  else if (res != CURLE_OK)
+    snprintf(msg, msg_size, "%s: %s", g->r->name, g->error[0] ? g->error : curl_easy_strerror(res));
+  else
+    stats_read(g->done);
+}
+
+
+
+size_t remote_read(t_remote* r, void* buf, size_t size, unsigned long long offset)
+{
+  t_range g;
+  char msg[CURL_ERROR_SIZE + 256];
+
+  if (!size || (r->size && (offset >= r->size)))
+    return 0;
+
+  memset(&g, 0, sizeof(g));
+  g.r = r;
+  g.curl = r->curl;
+  g.buf = buf;
+  setup_range(&g, offset, size);
+  CURLcode res = curl_easy_perform(r->curl);
+  range_error(&g, res, msg, sizeof(msg));
+  if (msg[0])
+    abort_printf("%s\n", msg);
+  return g.done;
+}
+
+
+
+void remote_fetch(t_remote* r, unsigned long long offset, unsigned long long size,
+                  int fd, off_t out_offset, char* out_fname)
+{
+  t_range ranges[REMOTE_PARALLEL];
+  char msg[CURL_ERROR_SIZE + 256] = "";
+  unsigned long long next = 0;
+  int i, running = 0;
+
+  CURLM* m = curl_multi_init();
+  if (!m)
+    abort_printf("%s: cannot initialize libcurl\n", r->name);
+
+  memset(ranges, 0, sizeof(ranges));
+  for (i=0; (i<REMOTE_PARALLEL) && (next<size); i++) {
+    t_range* g = &ranges[i];
+    g->r = r;
+    g->fd = fd;
+    if (!(g->curl = curl_easy_init()))
+      abort_printf("%s: cannot initialize libcurl\n", r->name);
+    size_t len = size - next < REMOTE_PART_SIZE ? size - next : REMOTE_PART_SIZE;
+    g->out_offset = out_offset + next;
+    setup_range(g, offset + next, len);
+    curl_easy_setopt(g->curl, CURLOPT_PRIVATE, g);
+    curl_multi_add_handle(m, g->curl);
+    next += len;
+    running++;
+  }
+
+  // each finished range starts the next one, until one fails
+  while (running) {
+    int still, queued;
+    CURLMcode mres = curl_multi_perform(m, &still);
+    if (mres == CURLM_OK)
+      mres = curl_multi_poll(m, NULL, 0, 1000, NULL);
+    if (mres != CURLM_OK) {
+      snprintf(msg, sizeof(msg), "%s: %s", r->name, curl_multi_strerror(mres));
+      break;
+    }
+
+    CURLMsg* done;
+    while ((done = curl_multi_info_read(m, &queued))) {
+      if (done->msg != CURLMSG_DONE)
+        continue;
+      t_range* g;
+      curl_easy_getinfo(done->easy_handle, CURLINFO_PRIVATE, (char**)&g);
+      CURLcode res = done->data.result;
+      curl_multi_remove_handle(m, g->curl);
+      running--;
+
+      if (!msg[0]) {
+        range_error(g, res, msg, sizeof(msg));
+        if (!msg[0] && (g->done < g->size))
+          snprintf(msg, sizeof(msg), "%s: file truncated", r->name);
+        if (msg[0] && g->err)
+          snprintf(msg, sizeof(msg), "%s: %s", out_fname, strerror(g->err));
+      }
+      if (!msg[0] && (next < size)) {
+        size_t len = size - next < REMOTE_PART_SIZE ? size - next : REMOTE_PART_SIZE;
+        g->out_offset = out_offset + next;
+        setup_range(g, offset + next, len);
+        curl_multi_add_handle(m, g->curl);
+        next += len;
+        running++;
+      }
+    }
+    if (msg[0])
+      break;
+  }
+
+  for (i=0; i<REMOTE_PARALLEL; i++)
+    if (ranges[i].curl) {
+      curl_multi_remove_handle(m, ranges[i].curl);
+      curl_easy_cleanup(ranges[i].curl);
+    }
+  curl_multi_cleanup(m);
+  if (msg[0])
+    abort_printf("%s\n", msg);
+}
+
+#else
+
+t_remote* remote_open(const char* url)
+{
+  abort_printf("%s: remote images not supported in this build\n", url);
+  return NULL;
+}
+
+void remote_close(t_remote* r)
+{
+  (void)r;
+}
+
+unsigned long long remote_size(const t_remote* r)
+{
+  (void)r;
+  return 0;
+}
+
+size_t remote_read(t_remote* r, void* buf, size_t size, unsigned long long offset)
+{
+  (void)r; (void)buf; (void)size; (void)offset;
+  return 0;
+}
+
+void remote_fetch(t_remote* r, unsigned long long offset, unsigned long long size,
+                  int fd, off_t out_offset, char* out_fname)
+{
+  (void)r; (void)offset; (void)size; (void)fd; (void)out_offset; (void)out_fname;
+}
+
+#endif
@@ -0,0 +1,57 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* images read over HTTP(S) or from S3, one byte range at a time */
+
+#ifndef _REMOTE_H_
+#define _REMOTE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct remote t_remote;
+
+/* 1 for the names of remote images: http://, https:// and s3://bucket/key */
+int is_remote(const char* fname);
+
+/*
+ * No request is made until the first read. s3:// names are fetched from
+ * $AWS_ENDPOINT_URL/bucket/key, or https://bucket.s3.region.amazonaws.com/key
+ * with the region of $AWS_REGION (or $AWS_DEFAULT_REGION), and signed with
+ * $AWS_ACCESS_KEY_ID, $AWS_SECRET_ACCESS_KEY and $AWS_SESSION_TOKEN when set.
+ */
+t_remote* remote_open(const char* url);
+void remote_close(t_remote* r);
+
+/* the size of the whole file, known once a range was read */
+unsigned long long remote_size(const t_remote* r);
+
+/*
+ * Read size bytes at offset with one ranged GET. Returns the number of
+ * bytes read, fewer at the end of the file.
+ */
+size_t remote_read(t_remote* r, void* buf, size_t size, unsigned long long offset);
+
+/*
+ * Write size bytes from offset to fd at out_offset, fetched in ranges of
+ * REMOTE_PART_SIZE, REMOTE_PARALLEL of them at a time.
+ */
+void remote_fetch(t_remote* r, unsigned long long offset, unsigned long long size,
+                  int fd, off_t out_offset, char* out_fname);
+
+#endif
@@ -0,0 +1,520 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE /* nftw */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAS_IO_URING
+#endif
+
+#include "abootimg.h"
+#include "libabootimg.h"
+#include "info.h"
+#include "index.h"
+#include "scan.h"
+
+
+#define SCAN_BATCH      64      /* images read at once by a worker */
+#define SCAN_READ_SIZE  4096    /* the first page, which holds the header */
+
+
+typedef struct
+{
+  char*           path;
+  int             fd;
+  int             err;          /* errno of the open or read */
+  size_t          len;          /* bytes read */
+  unsigned long long size;      /* of the image */
+  int             cached;       /* found in the index, not read */
+  t_index_entry   entry;
+  char            page[SCAN_READ_SIZE];
+} t_slot;
+
+/* images come from a directory walk, or are read from a list one by one */
+typedef struct
+{
+  char**          paths;
+  unsigned        nb_paths;
+  unsigned        next;
+  FILE*           list;
+  char*           list_fname;
+
+  unsigned        nb_images;
+  unsigned        nb_valid;
+  unsigned        nb_failed;
+  t_info_output*  output;
+  t_index*        index;        /* or NULL */
+  pthread_mutex_t lock;
+} t_scan;
+
+
+/* nftw() has no user pointer */
+static t_scan* walk_scan;
+static unsigned walk_max;
+
+
+
+static int collect_image(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+  t_scan* s = walk_scan;
+
+  if (type != FTW_F)
+    return 0;
+
+  if (s->nb_paths == walk_max) {
+    walk_max = walk_max ? 2*walk_max : 1024;
+    s->paths = realloc(s->paths, walk_max * sizeof(char*));
+    if (!s->paths)
+      abort_perror(NULL);
+  }
+  s->paths[s->nb_paths] = strdup(path);
+  if (!s->paths[s->nb_paths])
+    abort_perror(NULL);
+  s->nb_paths++;
+  return 0;
+}
+
+
+
+/* fill slots with the next paths to scan, returns how many */
+static unsigned next_paths(t_scan* s, t_slot* slots, unsigned max)
+{
+  unsigned n = 0;
+
+  pthread_mutex_lock(&s->lock);
+  while (n < max) {
+    if (!s->list) {
+      if (s->next == s->nb_paths)
+        break;
+      slots[n++].path = s->paths[s->next++];
+      continue;
+    }
+
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len = getline(&line, &size, s->list);
+    if (len == -1) {
+      free(line);
+      if (ferror(s->list))
+        abort_perror(s->list_fname);
+      break;
+    }
+    while (len && ((line[len-1] == '\n') || (line[len-1] == '\r')))
+      line[--len] = '\0';
+    if (!len) {
+      free(line);
+      continue;
+    }
+    slots[n++].path = line;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  return n;
+}
+
+
+
+/* an image which did not change since it was indexed is not even opened */
+static void lookup_slot(t_scan* s, t_slot* slot)
+{
+  struct stat st;
+
+  slot->cached = s->index && !stat(slot->path, &st) && !index_lookup(s->index, &st, &slot->entry);
+}
+
+
+
+static void open_slot(t_slot* slot)
+{
+  slot->err = 0;
+  slot->len = 0;
+  if (slot->cached) {
+    slot->fd = -1;
+    return;
+  }
+  slot->fd = open(slot->path, O_RDONLY);
+  if ((slot->fd == -1) || bootimg_image_size(slot->fd, &slot->size))
+    slot->err = errno;
+}
+
+
+
+/* the fallback: the reads of a batch are done one after the other */
+static void read_slot(t_slot* slot)
+{
+  while (slot->len < SCAN_READ_SIZE) {
+    ssize_t rb = pread(slot->fd, slot->page + slot->len, SCAN_READ_SIZE - slot->len, slot->len);
+    if (rb < 0) {
+      if (errno == EINTR)
+        continue;
+      slot->err = errno;
+      return;
+    }
+    if (!rb)
+      break;
+    slot->len += rb;
+  }
+}
+
+
+
+#ifdef HAS_IO_URING
+
+typedef struct
+{
+  int                  fd;
+  unsigned*            sq_tail;
+  unsigned*            sq_mask;
+  unsigned*            sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned*            cq_head;
+  unsigned*            cq_tail;
+  unsigned*            cq_mask;
+  struct io_uring_cqe* cqes;
+
+  void*                sq_ptr;
+  size_t               sq_len;
+  void*                cq_ptr;
+  size_t               cq_len;
+  size_t               sqes_len;
+} t_ring;
+
+
+
+/*
+ * Set up a ring of SCAN_BATCH entries with the raw system calls, which
+ * avoids a dependency on liburing. Returns 1 if io_uring is not available
+ * (old kernel, or forbidden in a container).
+ */
+static int ring_open(t_ring* r)
+{
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  memset(r, 0, sizeof(*r));
+  r->fd = syscall(__NR_io_uring_setup, SCAN_BATCH, &p);
+  if (r->fd < 0)
+    return 1;
+
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_len > r->sq_len)
+      r->sq_len = r->cq_len;
+    r->cq_len = 0;
+  }
+
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED)
+    goto err;
+  r->cq_ptr = r->sq_ptr;
+  if (r->cq_len) {
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED)
+      goto err;
+  }
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto err;
+
+  r->sq_tail = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+  r->sq_mask = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+  r->cq_head = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+  r->cq_tail = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+  r->cq_mask = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+  return 0;
+
+err:
+  close(r->fd);
+  return 1;
+}
+
+
+
+static void ring_close(t_ring* r)
+{
+  munmap(r->sqes, r->sqes_len);
+  if (r->cq_ptr != r->sq_ptr)
+    munmap(r->cq_ptr, r->cq_len);
+  munmap(r->sq_ptr, r->sq_len);
+  close(r->fd);
+}
+
+
+
+/*
+ * Read the first page of every opened slot with a single submission.
+ * Returns 1 when the ring refused the reads, which are then to be done
+ * with pread().
+ */
+static int ring_read(t_ring* r, t_slot* slots, unsigned n)
+{
+  struct iovec iov[SCAN_BATCH];
+  unsigned tail = *r->sq_tail;
+  unsigned queued = 0;
+  unsigned i;
+
+  for (i=0; i<n; i++) {
+    if (slots[i].err || slots[i].cached)
+      continue;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+
+    iov[i].iov_base = slots[i].page;
+    iov[i].iov_len = SCAN_READ_SIZE;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = slots[i].fd;
+    sqe->addr = (unsigned long)&iov[i];
+    sqe->len = 1;
+    sqe->off = 0;
+    sqe->user_data = i;
+    r->sq_array[idx] = idx;
+    tail++;
+    queued++;
+  }
+  if (!queued)
+    return 0;
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  unsigned submitted = 0;
+  unsigned done = 0;
+  while (done < queued) {
+    int ret = syscall(__NR_io_uring_enter, r->fd, queued - submitted, 1,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      if (!submitted)
+        return 1;
+      abort_perror("io_uring_enter");
+    }
+    submitted += ret;
+
+    unsigned head = *r->cq_head;
+    unsigned end = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != end; head++) {
+      struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+      t_slot* slot = &slots[cqe->user_data];
+      if (cqe->res >= 0)
+        slot->len = cqe->res;
+      else
+        slot->err = -cqe->res;
+      done++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  // short reads are only expected at the end of small files
+  for (i=0; i<n; i++)
+    if (!slots[i].err && slots[i].len && (slots[i].len < SCAN_READ_SIZE))
+      read_slot(&slots[i]);
+  return 0;
+}
+
+#endif /* HAS_IO_URING */
+
+
+
+static void format_record(t_slot* slot, FILE* out, t_scan* s)
+{
+  t_index_entry* e = &slot->entry;
+
+  if (slot->err) {
+    print_info_record(out, s->output, slot->path, 0, NULL, NULL, strerror(slot->err));
+    s->nb_failed++;
+    return;
+  }
+
+  if (!slot->cached) {
+    memset(e, 0, sizeof(*e));
+    e->image_size = slot->size;
+    e->status = bootimg_parse_header(slot->page, slot->len, slot->size, &e->header);
+  }
+  if (e->status) {
+    print_info_record(out, s->output, slot->path, e->image_size, NULL, NULL, bootimg_strerror(e->status));
+    return;
+  }
+
+  print_info_record(out, s->output, slot->path, e->image_size, &e->header,
+                    (e->flags & index_hashes) ? e->sha1 : NULL, "ok");
+  s->nb_valid++;
+}
+
+
+
+/* index the headers just read, invalid ones included */
+static void store_slot(t_slot* slot, t_scan* s)
+{
+  struct stat st;
+
+  if (slot->cached || slot->err || fstat(slot->fd, &st))
+    return;
+  if (slot->entry.status)
+    memset(&slot->entry.header, 0, sizeof(slot->entry.header));
+  slot->entry.flags = index_header;
+  index_store(s->index, &st, &slot->entry);
+}
+
+
+
+static void* scan_worker(void* arg)
+{
+  t_scan* s = arg;
+  t_slot* slots = malloc(SCAN_BATCH * sizeof(t_slot));
+  char* out_buf = NULL;
+  size_t out_len = 0;
+  unsigned i, n;
+
+  if (!slots)
+    abort_perror(NULL);
+
+#ifdef HAS_IO_URING
+  t_ring ring;
+  int has_ring = !ring_open(&ring);
+#endif
+
+  while ((n = next_paths(s, slots, SCAN_BATCH))) {
+    for (i=0; i<n; i++) {
+      lookup_slot(s, &slots[i]);
+      open_slot(&slots[i]);
+    }
+
+#ifdef HAS_IO_URING
+    if (has_ring && ring_read(&ring, slots, n)) {
+      ring_close(&ring);
+      has_ring = 0;
+    }
+    if (!has_ring)
+#endif
+      for (i=0; i<n; i++)
+        if (!slots[i].err && !slots[i].cached)
+          read_slot(&slots[i]);
+
+    // the records of a batch are printed in one go
+    FILE* out = open_memstream(&out_buf, &out_len);
+    if (!out)
+      abort_perror(NULL);
+    pthread_mutex_lock(&s->lock);
+    for (i=0; i<n; i++) {
+      format_record(&slots[i], out, s);
+      s->nb_images++;
+    }
+    fclose(out);
+    fwrite(out_buf, 1, out_len, stdout);
+    pthread_mutex_unlock(&s->lock);
+    free(out_buf);
+
+    if (s->index)
+      for (i=0; i<n; i++)
+        store_slot(&slots[i], s);
+
+    for (i=0; i<n; i++) {
+      if (slots[i].fd != -1)
+        close(slots[i].fd);
+      free(slots[i].path);
+    }
+  }
+
+#ifdef HAS_IO_URING
+  if (has_ring)
+    ring_close(&ring);
+#endif
+  free(slots);
+  return NULL;
+}
+
+
+
+unsigned scan_images(char* path, int nb_threads, t_info_output* output, char* index_fname)
+{
+  t_index index;
+  t_scan s;
+  struct stat st;
+  int i;
+
+  memset(&s, 0, sizeof(s));
+  pthread_mutex_init(&s.lock, NULL);
+
+  // the compact record by default, every field in the other formats
+  if ((output->format == info_text) && !output->nb_fields)
+    parse_info_fields(output, "file,status,image_size,page_size,kernel_size,ramdisk_size,second_size");
+  default_info_fields(output, 1);
+  s.output = output;
+
+  if (index_fname) {
+    index_open(&index, index_fname);
+    s.index = &index;
+  }
+
+  if (!strcmp(path, "-"))
+    s.list = stdin;
+  else if (stat(path, &st))
+    abort_perror(path);
+  else if (S_ISDIR(st.st_mode)) {
+    walk_scan = &s;
+    if (nftw(path, collect_image, 64, FTW_PHYS))
+      abort_perror(path);
+  }
+  else if (!(s.list = fopen(path, "r")))
+    abort_perror(path);
+  s.list_fname = path;
+
+  if (nb_threads <= 0)
+    nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nb_threads <= 0)
+    nb_threads = 1;
+
+  print_info_header(stdout, output);
+  pthread_t threads[nb_threads];
+  for (i=0; i<nb_threads; i++)
+    if ((errno = pthread_create(&threads[i], NULL, scan_worker, &s)))
+      abort_perror("pthread_create");
+  for (i=0; i<nb_threads; i++)
+    pthread_join(threads[i], NULL);
+  fflush(stdout);
+
+  if (s.list && (s.list != stdin))
+    fclose(s.list);
+  free(s.paths);
+  if (s.index)
+    index_close(s.index);
+
+  fprintf(stderr, "%u images, %u valid, %u unreadable\n", s.nb_images, s.nb_valid, s.nb_failed);
+  return s.nb_failed;
+}
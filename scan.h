@@ -0,0 +1,37 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* header-only scan of many images */
+
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include "info.h"
+
+/*
+ * Check the header of every image found under a directory (recursively),
+ * or listed in a file, one path per line (- for stdin), and print one
+ * record per image in the output format. The headers are read by
+ * nb_threads workers (0: one per CPU), in batches submitted to io_uring
+ * where available. With an index file, the images which did not change
+ * since they were last scanned are not read again. Returns the number of
+ * images which could not be read.
+ */
+unsigned scan_images(char* path, int nb_threads, t_info_output* output, char* index_fname);
+
+#endif
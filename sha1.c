@@ -0,0 +1,281 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * The compression function uses the SHA extensions of x86 (SHA-NI, checked
+ * at run time) or ARMv8 (when the build targets a CPU which has them).
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAS_SHA_NI
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#include <arm_neon.h>
+#define HAS_ARM_SHA1
+#endif
+
+#include "sha1.h"
+
+
+#define ROL(x, n)  (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define STEP(f, k)                                  \
+  do {                                              \
+    uint32_t t = ROL(a, 5) + (f) + e + (k) + w[i];  \
+    e = d;                                          \
+    d = c;                                          \
+    c = ROL(b, 30);                                 \
+    b = a;                                          \
+    a = t;                                          \
+  } while (0)
+
+
+
+static void sha1_blocks_generic(uint32_t h[5], const unsigned char* p, size_t nb_blocks)
+{
+  while (nb_blocks--) {
+    uint32_t w[80];
+    uint32_t a, b, c, d, e;
+    int i;
+
+    for (i=0; i<16; i++)
+      w[i] = ((uint32_t)p[4*i] << 24) | ((uint32_t)p[4*i+1] << 16) | ((uint32_t)p[4*i+2] << 8) | p[4*i+3];
+    for (i=16; i<80; i++)
+      w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+    for (i=0; i<20; i++)
+      STEP((b & c) | (~b & d), 0x5a827999);
+    for (; i<40; i++)
+      STEP(b ^ c ^ d, 0x6ed9eba1);
+    for (; i<60; i++)
+      STEP((b & c) | (b & d) | (c & d), 0x8f1bbcdc);
+    for (; i<80; i++)
+      STEP(b ^ c ^ d, 0xca62c1d6);
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+
+    p += 64;
+  }
+}
+
+
+
+#ifdef HAS_SHA_NI
+
+/*
+ * Four rounds, g being their group (0 to 19). The message schedule is
+ * computed three groups ahead, in the four registers m[] used in turn.
+ */
+#define SHA_NI_ROUNDS(g)                                                \
+  do {                                                                  \
+    if (g)                                                              \
+      e[(g)%2] = _mm_sha1nexte_epu32(e[(g)%2], m[(g)%4]);               \
+    else                                                                \
+      e[0] = _mm_add_epi32(e[0], m[0]);                                 \
+    e[((g)+1)%2] = abcd;                                                \
+    if (((g) >= 3) && ((g) <= 18))                                      \
+      m[((g)+1)%4] = _mm_sha1msg2_epu32(m[((g)+1)%4], m[(g)%4]);        \
+    abcd = _mm_sha1rnds4_epu32(abcd, e[(g)%2], (g)/5);                  \
+    if (((g) >= 1) && ((g) <= 16))                                      \
+      m[((g)+3)%4] = _mm_sha1msg1_epu32(m[((g)+3)%4], m[(g)%4]);        \
+    if (((g) >= 2) && ((g) <= 17))                                      \
+      m[((g)+2)%4] = _mm_xor_si128(m[((g)+2)%4], m[(g)%4]);             \
+  } while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_sha_ni(uint32_t h[5], const unsigned char* p, size_t nb_blocks)
+{
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)h), 0x1b);
+  __m128i e0 = _mm_set_epi32(h[4], 0, 0, 0);
+
+  while (nb_blocks--) {
+    __m128i abcd_save = abcd;
+    __m128i e[2] = { e0, e0 };
+    __m128i m[4];
+    int i;
+
+    for (i=0; i<4; i++)
+      m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16*i)), mask);
+
+    SHA_NI_ROUNDS(0);  SHA_NI_ROUNDS(1);  SHA_NI_ROUNDS(2);  SHA_NI_ROUNDS(3);
+    SHA_NI_ROUNDS(4);  SHA_NI_ROUNDS(5);  SHA_NI_ROUNDS(6);  SHA_NI_ROUNDS(7);
+    SHA_NI_ROUNDS(8);  SHA_NI_ROUNDS(9);  SHA_NI_ROUNDS(10); SHA_NI_ROUNDS(11);
+    SHA_NI_ROUNDS(12); SHA_NI_ROUNDS(13); SHA_NI_ROUNDS(14); SHA_NI_ROUNDS(15);
+    SHA_NI_ROUNDS(16); SHA_NI_ROUNDS(17); SHA_NI_ROUNDS(18); SHA_NI_ROUNDS(19);
+
+    e0 = _mm_sha1nexte_epu32(e[0], e0);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+    p += 64;
+  }
+
+  _mm_storeu_si128((__m128i*)h, _mm_shuffle_epi32(abcd, 0x1b));
+  h[4] = _mm_extract_epi32(e0, 3);
+}
+
+static int has_sha_ni(void)
+{
+  unsigned a, b, c, d;
+
+  if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSSE3) || !(c & bit_SSE4_1))
+    return 0;
+  return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1 << 29));
+}
+
+#endif /* HAS_SHA_NI */
+
+
+
+#ifdef HAS_ARM_SHA1
+
+/* same as for SHA-NI, the round constants being added ahead as well */
+#define ARM_SHA1_ROUNDS(g, op)                                          \
+  do {                                                                  \
+    e[((g)+1)%2] = vsha1h_u32(vgetq_lane_u32(abcd, 0));                 \
+    abcd = op(abcd, e[(g)%2], t[(g)%2]);                                \
+    if ((g) <= 17)                                                      \
+      t[(g)%2] = vaddq_u32(m[((g)+2)%4], vdupq_n_u32(k[((g)+2)/5]));    \
+    if (((g) >= 1) && ((g) <= 16))                                      \
+      m[((g)+3)%4] = vsha1su1q_u32(m[((g)+3)%4], m[((g)+2)%4]);         \
+    if ((g) <= 15)                                                      \
+      m[(g)%4] = vsha1su0q_u32(m[(g)%4], m[((g)+1)%4], m[((g)+2)%4]);   \
+  } while (0)
+
+static void sha1_blocks_arm(uint32_t h[5], const unsigned char* p, size_t nb_blocks)
+{
+  static const uint32_t k[4] = { 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6 };
+  uint32x4_t abcd = vld1q_u32(h);
+  uint32_t e0 = h[4];
+
+  while (nb_blocks--) {
+    uint32x4_t abcd_save = abcd;
+    uint32_t e[2] = { e0, 0 };
+    uint32x4_t m[4], t[2];
+    int i;
+
+    for (i=0; i<4; i++)
+      m[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + 16*i)));
+    t[0] = vaddq_u32(m[0], vdupq_n_u32(k[0]));
+    t[1] = vaddq_u32(m[1], vdupq_n_u32(k[0]));
+
+    ARM_SHA1_ROUNDS(0, vsha1cq_u32);  ARM_SHA1_ROUNDS(1, vsha1cq_u32);
+    ARM_SHA1_ROUNDS(2, vsha1cq_u32);  ARM_SHA1_ROUNDS(3, vsha1cq_u32);
+    ARM_SHA1_ROUNDS(4, vsha1cq_u32);  ARM_SHA1_ROUNDS(5, vsha1pq_u32);
+    ARM_SHA1_ROUNDS(6, vsha1pq_u32);  ARM_SHA1_ROUNDS(7, vsha1pq_u32);
+    ARM_SHA1_ROUNDS(8, vsha1pq_u32);  ARM_SHA1_ROUNDS(9, vsha1pq_u32);
+    ARM_SHA1_ROUNDS(10, vsha1mq_u32); ARM_SHA1_ROUNDS(11, vsha1mq_u32);
+    ARM_SHA1_ROUNDS(12, vsha1mq_u32); ARM_SHA1_ROUNDS(13, vsha1mq_u32);
+    ARM_SHA1_ROUNDS(14, vsha1mq_u32); ARM_SHA1_ROUNDS(15, vsha1pq_u32);
+    ARM_SHA1_ROUNDS(16, vsha1pq_u32); ARM_SHA1_ROUNDS(17, vsha1pq_u32);
+    ARM_SHA1_ROUNDS(18, vsha1pq_u32); ARM_SHA1_ROUNDS(19, vsha1pq_u32);
+
+    e0 = e[0] + e0;
+    abcd = vaddq_u32(abcd, abcd_save);
+    p += 64;
+  }
+
+  vst1q_u32(h, abcd);
+  h[4] = e0;
+}
+
+#endif /* HAS_ARM_SHA1 */
+
+
+
+static void (*sha1_blocks)(uint32_t h[5], const unsigned char* p, size_t nb_blocks) = sha1_blocks_generic;
+static pthread_once_t sha1_once = PTHREAD_ONCE_INIT;
+
+static void select_sha1_blocks(void)
+{
+#ifdef HAS_SHA_NI
+  if (has_sha_ni())
+    sha1_blocks = sha1_blocks_sha_ni;
+#endif
+#ifdef HAS_ARM_SHA1
+  sha1_blocks = sha1_blocks_arm;
+#endif
+}
+
+
+
+void sha1_init(t_sha1* s)
+{
+  pthread_once(&sha1_once, select_sha1_blocks);
+
+  s->h[0] = 0x67452301;
+  s->h[1] = 0xefcdab89;
+  s->h[2] = 0x98badcfe;
+  s->h[3] = 0x10325476;
+  s->h[4] = 0xc3d2e1f0;
+  s->len = 0;
+  s->buf_len = 0;
+}
+
+
+
+void sha1_update(t_sha1* s, const void* data, size_t size)
+{
+  const unsigned char* p = data;
+
+  s->len += size;
+  if (s->buf_len) {
+    size_t len = 64 - s->buf_len;
+    if (len > size)
+      len = size;
+    memcpy(s->buf + s->buf_len, p, len);
+    s->buf_len += len;
+    p += len;
+    size -= len;
+    if (s->buf_len < 64)
+      return;
+    sha1_blocks(s->h, s->buf, 1);
+    s->buf_len = 0;
+  }
+
+  // whole blocks straight from the caller's buffer
+  sha1_blocks(s->h, p, size / 64);
+  p += size - (size % 64);
+  size %= 64;
+
+  memcpy(s->buf, p, size);
+  s->buf_len = size;
+}
+
+
+
+void sha1_final(t_sha1* s, unsigned char digest[SHA1_DIGEST_SIZE])
+{
+  uint64_t bits = s->len * 8;
+  unsigned char pad[72];
+  size_t pad_len = (s->buf_len < 56 ? 56 : 120) - s->buf_len;
+  int i;
+
+  memset(pad, 0, sizeof(pad));
+  pad[0] = 0x80;
+  for (i=0; i<8; i++)
+    pad[pad_len + i] = bits >> (56 - 8*i);
+  sha1_update(s, pad, pad_len + 8);
+
+  for (i=0; i<SHA1_DIGEST_SIZE; i++)
+    digest[i] = s->h[i/4] >> (24 - 8*(i%4));
+}
@@ -0,0 +1,41 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* SHA-1, as used by mkbootimg for the image id */
+
+#ifndef _SHA1_H_
+#define _SHA1_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_SIZE  20
+
+typedef struct
+{
+  uint32_t       h[5];
+  uint64_t       len;
+  unsigned char  buf[64];
+  size_t         buf_len;
+} t_sha1;
+
+void sha1_init(t_sha1* s);
+void sha1_update(t_sha1* s, const void* data, size_t size);
+void sha1_final(t_sha1* s, unsigned char digest[SHA1_DIGEST_SIZE]);
+
+#endif
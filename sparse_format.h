@@ -0,0 +1,60 @@
+/* sparse_format.h - Android sparse image (simg) format
+ *
+ * Layout compatible with the sparse images understood by fastboot, as
+ * defined in AOSP system/core/libsparse.
+ */
+
+#ifndef _SPARSE_FORMAT_H_
+#define _SPARSE_FORMAT_H_
+
+#include <stdint.h>
+
+typedef struct sparse_header sparse_header_t;
+typedef struct chunk_header chunk_header_t;
+
+#define SPARSE_HEADER_MAGIC     0xed26ff3a
+#define SPARSE_HEADER_MAJOR_VER 1
+#define SPARSE_HEADER_MINOR_VER 0
+
+#define CHUNK_TYPE_RAW          0xCAC1
+#define CHUNK_TYPE_FILL         0xCAC2
+#define CHUNK_TYPE_DONT_CARE    0xCAC3
+#define CHUNK_TYPE_CRC32        0xCAC4
+
+#define SPARSE_BLOCK_SIZE       4096
+
+struct sparse_header
+{
+    uint32_t magic;          /* SPARSE_HEADER_MAGIC */
+    uint16_t major_version;  /* SPARSE_HEADER_MAJOR_VER */
+    uint16_t minor_version;  /* SPARSE_HEADER_MINOR_VER */
+    uint16_t file_hdr_sz;    /* sizeof(sparse_header_t) */
+    uint16_t chunk_hdr_sz;   /* sizeof(chunk_header_t) */
+    uint32_t blk_sz;         /* block size in bytes, multiple of 4 */
+    uint32_t total_blks;     /* blocks in the expanded image */
+    uint32_t total_chunks;   /* chunks in the sparse file */
+    uint32_t image_checksum; /* crc32 of the expanded image, 0 if unused */
+};
+
+struct chunk_header
+{
+    uint16_t chunk_type;     /* CHUNK_TYPE_* */
+    uint16_t reserved1;
+    uint32_t chunk_sz;       /* in blocks of the expanded image */
+    uint32_t total_sz;       /* in bytes, chunk header and data included */
+};
+
+/*
+** +-----------------+
+** | sparse header   | file_hdr_sz bytes
+** +-----------------+
+** | chunk header    | chunk_hdr_sz bytes
+** | chunk data      | RAW: chunk_sz * blk_sz bytes
+** +-----------------+      FILL: 4 bytes pattern
+** | ...             |      DONT_CARE: no data
+** +-----------------+
+**
+** all fields are little endian.
+*/
+
+#endif
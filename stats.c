@@ -0,0 +1,293 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "abootimg.h"
+#include "stats.h"
+
+
+static const char* phase_names[stats_nb_phases] = {
+  "read_header", "update_header", "update_images", "write_bootimg", "extract"
+};
+
+// the stats the I/O of each thread is counted in, the threads of a
+// command (section copies, ramdisk packer) sharing them
+static __thread t_stats* current;
+static __thread int current_section = -1;
+static __thread unsigned nb_counted;
+
+// the heap is sampled once every HEAP_SAMPLING counted syscalls, and at
+// the end of the phases
+#define HEAP_SAMPLING 16
+
+
+
+t_stats* new_stats(void)
+{
+  t_stats* s = calloc(sizeof(t_stats), 1);
+  if (!s)
+    abort_perror(NULL);
+  s->phase = -1;
+  return s;
+}
+
+
+
+int parse_stats_format(t_stats* s, const char* name)
+{
+  if (!strcmp(name, "text"))
+    s->json = 0;
+  else if (!strcmp(name, "json"))
+    s->json = 1;
+  else
+    return 1;
+  return 0;
+}
+
+
+
+void stats_attach(t_stats* s)
+{
+  current = s;
+  current_section = -1;
+}
+
+t_stats* stats_current(void)
+{
+  return current;
+}
+
+void stats_section(int section)
+{
+  current_section = section;
+}
+
+
+
+static double seconds_since(clockid_t clock, struct timespec* start)
+{
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void sample_heap(t_stats* s)
+{
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+  struct mallinfo2 mi = mallinfo2();
+  size_t heap = mi.uordblks + mi.hblkhd;
+  size_t peak = __atomic_load_n(&s->peak_heap, __ATOMIC_RELAXED);
+  while ((heap > peak) &&
+         !__atomic_compare_exchange_n(&s->peak_heap, &peak, heap, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+#endif
+}
+
+void stats_begin(t_stats* s, enum stats_phase phase)
+{
+  if (!s)
+    return;
+
+  stats_end(s);
+  if (!s->started) {
+    clock_gettime(CLOCK_MONOTONIC, &s->total_wall_start);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &s->total_cpu_start);
+    s->started = 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &s->wall_start);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &s->cpu_start);
+  __atomic_store_n(&s->phase, phase, __ATOMIC_RELAXED);
+}
+
+void stats_end(t_stats* s)
+{
+  if (!s || (s->phase == -1))
+    return;
+
+  t_stats_counters* c = &s->phases[s->phase];
+  c->wall += seconds_since(CLOCK_MONOTONIC, &s->wall_start);
+  c->cpu += seconds_since(CLOCK_PROCESS_CPUTIME_ID, &s->cpu_start);
+  sample_heap(s);
+  __atomic_store_n(&s->phase, -1, __ATOMIC_RELAXED);
+}
+
+
+
+enum syscall {
+  no_syscall,
+  syscall_read,
+  syscall_write,
+  syscall_copy,
+  syscall_seek
+};
+
+static unsigned long long* syscall_counter(t_stats_counters* c, enum syscall call)
+{
+  switch (call) {
+    case syscall_read:  return &c->reads;
+    case syscall_write: return &c->writes;
+    case syscall_copy:  return &c->copies;
+    case syscall_seek:  return &c->seeks;
+    default:            return NULL;
+  }
+}
+
+static void add(t_stats_counters* c, enum syscall call, size_t read, size_t written)
+{
+  unsigned long long* n = syscall_counter(c, call);
+
+  if (n)
+    __atomic_add_fetch(n, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&c->bytes_read, read, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&c->bytes_written, written, __ATOMIC_RELAXED);
+}
+
+/*
+ * Helper threads count concurrently with the thread running the phases,
+ * hence the atomic adds. They are only counted in a phase while it runs.
+ */
+static void count(enum syscall call, size_t read, size_t written)
+{
+  t_stats* s = current;
+
+  if (!s)
+    return;
+
+  int phase = __atomic_load_n(&s->phase, __ATOMIC_RELAXED);
+  add(&s->total, call, read, written);
+  if (phase != -1)
+    add(&s->phases[phase], call, read, written);
+
+  if (current_section != -1) {
+    __atomic_add_fetch(&s->section_read[current_section], read, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->section_written[current_section], written, __ATOMIC_RELAXED);
+  }
+
+  if (!(nb_counted++ % HEAP_SAMPLING))
+    sample_heap(s);
+}
+
+void stats_read(size_t bytes)
+{
+  count(syscall_read, bytes, 0);
+}
+
+void stats_write(size_t bytes)
+{
+  count(syscall_write, 0, bytes);
+}
+
+void stats_copy(size_t bytes)
+{
+  count(syscall_copy, bytes, bytes);
+}
+
+void stats_seek(void)
+{
+  count(syscall_seek, 0, 0);
+}
+
+void stats_mapped(size_t bytes)
+{
+  count(no_syscall, bytes, 0);
+}
+
+void stats_staged(size_t bytes)
+{
+  count(no_syscall, 0, bytes);
+}
+
+void stats_padding(size_t bytes)
+{
+  if (current)
+    __atomic_add_fetch(&current->padding, bytes, __ATOMIC_RELAXED);
+}
+
+
+
+static void print_counters(t_stats* s, const char* name, t_stats_counters* c)
+{
+  if (s->json)
+    print_msg("\"%s\": {\"wall_ms\": %.3f, \"process_cpu_ms\": %.3f, \"reads\": %llu, \"writes\": %llu, "
+              "\"copies\": %llu, \"seeks\": %llu, \"bytes_read\": %llu, \"bytes_written\": %llu}",
+              name, c->wall * 1000, c->cpu * 1000, c->reads, c->writes, c->copies, c->seeks,
+              c->bytes_read, c->bytes_written);
+  else
+    print_msg("%-14s %10.3f %11.3f %8llu %8llu %8llu %8llu %14llu %14llu\n",
+              name, c->wall * 1000, c->cpu * 1000, c->reads, c->writes, c->copies, c->seeks,
+              c->bytes_read, c->bytes_written);
+}
+
+void print_stats(t_stats* s)
+{
+  struct rusage ru;
+  int i, printed = 0;
+
+  stats_end(s);
+  if (s->started) {
+    s->total.wall = seconds_since(CLOCK_MONOTONIC, &s->total_wall_start);
+    s->total.cpu = seconds_since(CLOCK_PROCESS_CPUTIME_ID, &s->total_cpu_start);
+  }
+  sample_heap(s);
+  // kB on Linux, the peak of the whole process. As the CPU time and the
+  // heap, it includes the other jobs of --batch and --serve, which the
+  // names printed say.
+  if (getrusage(RUSAGE_SELF, &ru))
+    ru.ru_maxrss = 0;
+
+  if (s->json) {
+    print_msg("{\"phases\": {");
+    for (i=0; i<stats_nb_phases; i++)
+      if (s->phases[i].wall > 0) {
+        if (printed++)
+          print_msg(", ");
+        print_counters(s, phase_names[i], &s->phases[i]);
+      }
+    print_msg("}, ");
+    print_counters(s, "total", &s->total);
+    print_msg(", \"sections\": {");
+    for (i=0; i<bootimg_nb_sections; i++)
+      print_msg("%s\"%s\": {\"bytes_read\": %llu, \"bytes_written\": %llu}", i ? ", " : "",
+                bootimg_section_name(i), s->section_read[i], s->section_written[i]);
+    print_msg("}, \"padding_bytes\": %llu, \"process_peak_heap_bytes\": %zu, \"process_peak_rss_kb\": %ld}\n",
+              s->padding, s->peak_heap, ru.ru_maxrss);
+    return;
+  }
+
+  print_msg("%-14s %10s %11s %8s %8s %8s %8s %14s %14s\n", "phase", "wall ms", "proc cpu ms",
+            "reads", "writes", "copies", "seeks", "bytes read", "bytes written");
+  for (i=0; i<stats_nb_phases; i++)
+    if (s->phases[i].wall > 0)
+      print_counters(s, phase_names[i], &s->phases[i]);
+  print_counters(s, "total", &s->total);
+
+  print_msg("%-14s %14s %14s\n", "section", "bytes read", "bytes written");
+  for (i=0; i<bootimg_nb_sections; i++)
+    if (s->section_read[i] || s->section_written[i] || (i <= bootimg_second))
+      print_msg("%-14s %14llu %14llu\n", bootimg_section_name(i), s->section_read[i], s->section_written[i]);
+
+  print_msg("padding: %llu bytes written\n", s->padding);
+  print_msg("peak heap: %zu kB, peak RSS: %ld kB (of the whole process)\n", (s->peak_heap + 1023) / 1024, ru.ru_maxrss);
+}
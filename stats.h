@@ -0,0 +1,107 @@
+/* abootimg - Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* per phase timings and I/O counters, for --stats */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <time.h>
+
+#include "libabootimg.h"
+
+enum stats_phase {
+  phase_read_header,
+  phase_update_header,    /* config file and -c parameters */
+  phase_update_images,    /* opening, spooling or packing the inputs */
+  phase_write_bootimg,
+  phase_extract,
+  stats_nb_phases
+};
+
+typedef struct
+{
+  double             wall;          /* seconds */
+  double             cpu;           /* of the whole process, helper threads included */
+  unsigned long long reads;         /* syscalls */
+  unsigned long long writes;
+  unsigned long long copies;        /* kernel side copies: copy_file_range, sendfile, splice */
+  unsigned long long seeks;
+  unsigned long long bytes_read;    /* mapped inputs included */
+  unsigned long long bytes_written;
+} t_stats_counters;
+
+typedef struct
+{
+  int                json;
+  int                phase;         /* running, -1 between phases */
+  struct timespec    wall_start;    /* of the running phase */
+  struct timespec    cpu_start;
+  int                started;
+  struct timespec    total_wall_start;
+  struct timespec    total_cpu_start;
+
+  t_stats_counters   phases[stats_nb_phases];
+  t_stats_counters   total;         /* from the first phase to the end */
+  unsigned long long section_read[bootimg_nb_sections];
+  unsigned long long section_written[bootimg_nb_sections];
+  unsigned long long padding;       /* zeros actually written, holes are not */
+  size_t             peak_heap;     /* the highest sampled */
+} t_stats;
+
+t_stats* new_stats(void);
+
+/* return 1 for an unknown format, text or json */
+int parse_stats_format(t_stats* s, const char* name);
+
+/*
+ * Count the I/O of the calling thread in s, NULL to stop. Helper threads
+ * attach to the stats of the command they work for.
+ */
+void stats_attach(t_stats* s);
+t_stats* stats_current(void);
+
+/* the section the I/O of the calling thread belongs to, -1 for none */
+void stats_section(int section);
+
+/* end the running phase, if any, and start a new one */
+void stats_begin(t_stats* s, enum stats_phase phase);
+void stats_end(t_stats* s);
+
+/* one syscall of bytes, for the stats of the calling thread */
+void stats_read(size_t bytes);
+void stats_write(size_t bytes);
+void stats_copy(size_t bytes);
+void stats_seek(void);
+
+/* bytes read from a map, without syscalls */
+void stats_mapped(size_t bytes);
+
+/*
+ * Bytes queued by the direct writer, counted as written then, in the
+ * section they belong to: the write syscalls come later, with stats_write(0).
+ */
+void stats_staged(size_t bytes);
+
+void stats_padding(size_t bytes);
+
+/* print the counters, through print_msg() */
+void print_stats(t_stats* s);
+
+#endif